@@ -60,13 +60,23 @@ void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
+/*
+ *   tlb_setasid: load ASID into the PID field of ENTRYHI. Translations
+ *        only match TLB entries tagged with the current ASID.
+ *
+ *        IMPORTANT NOTE: tlb_random, tlb_write, tlb_read and tlb_probe
+ *        all load ENTRYHI, and with it the current ASID. Call this again
+ *        after using them.
+ */
+void tlb_setasid(uint32_t asid);
+
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * Note that the MIPS has support for a 6-bit address space ID, which we
+ * use to tag each entry with the address space it belongs to (see
+ * vm_activate). TLBLO_GLOBAL is left always zero, as are the bits that
+ * aren't assigned a meaning.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -78,7 +88,11 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PID_SHIFT 6
+
+/* Number of address space IDs */
+#define NUM_ASID 64
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -38,7 +38,7 @@
 #define PAGE_SIZE  4096         /* size of VM page */
 #define PAGE_FRAME 0xfffff000   /* mask for getting page number from addr */
 
-/* FIXME under our VM, we always have 72k of user stack */
+/* The user stack starts out 72k long, and grows from there; see vm.h */
 /* (this must be > 64K so argument blocks of size ARG_MAX will fit) */
 #define STACKPAGES    18
 #define PAGE_SIZE_LOG_2 12
@@ -120,13 +120,18 @@ paddr_t ram_getfirstfree(void);
  * TLB shootdown bits.
  *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * Each one carries a batch of pages of one address space; the target
+ * looks up the ASID the address space has there.
  */
 
+struct semaphore;
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* address space of the pages */
+	const vaddr_t *ts_vaddrs;	/* pages to invalidate, NULL for all */
+	unsigned ts_npages;		/* number of pages in ts_vaddrs */
+	struct semaphore *ts_done;	/* V'd by each target when done */
 };
 
 #define TLBSHOOTDOWN_MAX 16
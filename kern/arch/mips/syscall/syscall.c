@@ -156,6 +156,10 @@ syscall(struct trapframe *tf)
                 err = sys_close((int)tf->tf_a0);
                 break;
 
+            case SYS_fsync:
+                err = sys_fsync((int)tf->tf_a0);
+                break;
+
             case SYS_dup2:
                 err = sys_dup2(&retval, (int)tf->tf_a0, (int)tf->tf_a1);
                 break;
@@ -176,10 +180,18 @@ syscall(struct trapframe *tf)
                 err = sys_fork(&retval, tf);
                 break;
 
+            case SYS_vfork: /* parent returns here once the child execs or exits */
+                err = sys_vfork(&retval, tf);
+                break;
+
             case SYS_execv:
                 err = sys_execv((const char*)tf->tf_a0, (char **)tf->tf_a1);
                 break;
 
+            case SYS_spawn:
+                err = sys_spawn(&retval, (const char*)tf->tf_a0, (char **)tf->tf_a1);
+                break;
+
             case SYS__exit:
                 sys__exit(_MKWAIT_EXIT((int)tf->tf_a0));
                 break;
@@ -196,6 +208,27 @@ syscall(struct trapframe *tf)
                 err = sys_sbrk(&retval, (intptr_t) tf->tf_a0 );
                 break;
 
+            case SYS_mmap: {
+                    /* fd and the 64bit offset are on the user stack, the offset aligned to 8 bytes */
+                    int kfd;
+                    off_t koffset;
+                    err = copyin((userptr_t) (tf->tf_sp + 16), &kfd, sizeof(kfd));
+                    if (err) {
+                            break;
+                    }
+                    err = copyin((userptr_t) (tf->tf_sp + 24), &koffset, sizeof(koffset));
+                    if (err) {
+                            break;
+                    }
+                    err = sys_mmap(&retval, (vaddr_t)tf->tf_a0, (size_t)tf->tf_a1,
+                                   (int)tf->tf_a2, (int)tf->tf_a3, kfd, koffset);
+                    break;
+            }
+
+            case SYS_munmap:
+                err = sys_munmap((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1);
+                break;
+
             default:
                 kprintf("Unknown syscall %d\n", callno);
                 err = ENOSYS;
@@ -41,7 +41,102 @@
 #include <page_table.h>
 #include <vm.h>
 #include <coremap.h>
+#include <page_file.h>
+#include <synch.h>
+#include <cpu.h>
+#include <clock.h>
+#include <platform/maxcpus.h>
 
+#if MAXCPUS > 32
+#error "The cpu masks of address spaces hold 32 cpus"
+#endif
+
+/*
+ * Serializes TLB shootdowns, so that no CPU ever has more than one of
+ * them pending, and so that shootdown_done counts for one sender.
+ */
+static struct lock* shootdown_lock;
+static struct semaphore* shootdown_done;
+
+/*
+ * Pages per fault-around window, see tlb_fault_around. Set from the menu;
+ * faults read it without synchronization.
+ */
+static unsigned faultaround_window = VM_FAULTAROUND_WINDOW;
+static unsigned stack_limit = VM_STACK_LIMIT;
+
+/* Shootdown statistics, protected by shootdown_lock */
+static unsigned shootdown_count;        /* Calls to vm_tlbshootdown_pages */
+static unsigned shootdown_pages;        /* Pages they invalidated */
+static unsigned shootdown_flushes;      /* Calls to vm_tlbshootdown_as */
+static unsigned shootdown_ipis;         /* Cpus interrupted for them */
+static unsigned shootdown_forgotten;    /* Remote ASIDs dropped instead */
+
+/*
+ * Protects the ASIDs of every address space, their as_cpus masks and the
+ * ts_as of every cpu. The shootdown reads them to decide which cpus must
+ * be interrupted; vm_activate takes it to change them.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Per-cpu TLB state and statistics. Only touched by the cpu itself, at
+ * splhigh, except for ts_as, see asid_lock.
+ *
+ * TLB entries are tagged with an address space ID, so that they need not
+ * be flushed when switching address spaces. Each cpu hands out its own
+ * ASIDs in order. When they run out, it starts a new generation: the TLB
+ * is flushed once, and every address space takes a new ASID the next time
+ * it is activated on the cpu. ASID 0 is never handed out; it tags the
+ * invalid entries.
+ */
+#define ASID_FIRST 1
+
+struct tlb_state {
+        unsigned ts_hand;       /* Next entry to replace */
+
+        /*
+         * The address space whose ASID is loaded. It stays loaded while
+         * kernel threads run, so it may be NULL only before the first
+         * activation, or once the address space is destroyed.
+         */
+        struct addrspace* ts_as;
+
+        unsigned ts_asid;            /* ASID of the active address space */
+        unsigned ts_asid_next;       /* Next ASID to hand out */
+        unsigned ts_asid_generation; /* Starts at 1, 0 means never assigned */
+
+        /* Statistics */
+        unsigned ts_refills;    /* Entries loaded for a miss */
+        unsigned ts_evictions;  /* Refills that replaced a valid entry */
+        unsigned ts_updates;    /* Entries replaced in place */
+        unsigned ts_activations;     /* Address space activations */
+        unsigned ts_asid_assigned;   /* Activations that took a new ASID */
+        unsigned ts_asid_rollovers;  /* New generations, each a full flush */
+        unsigned ts_shootdowns;      /* Shootdown IPIs handled */
+        unsigned ts_preloaded;       /* Entries loaded by fault-around */
+};
+
+static struct tlb_state tlb_state[MAXCPUS];
+
+/* The TLB state of this cpu. Call at splhigh */
+static
+struct tlb_state*
+tlb_state_of_curcpu(void)
+{
+        return tlb_state + curcpu->c_number;
+}
+
+/*
+ * Reloads the ASID of the active address space, after a TLB operation
+ * loaded entryhi. Call at splhigh.
+ */
+static
+void
+tlb_restore_asid(void)
+{
+        tlb_setasid(tlb_state_of_curcpu()->ts_asid);
+}
 
 /*
  * Called in boot sequence.
@@ -49,28 +144,453 @@
 void
 vm_bootstrap(void)
 {
-        /* TODO ? initialize page table */
+        shootdown_lock = lock_create("tlb shootdown");
+        shootdown_done = sem_create("tlb shootdown done", 0);
+        if (shootdown_lock == NULL || shootdown_done == NULL) {
+                panic("vm: Could not create shootdown synchronization\n");
+        }
+
+        for (unsigned c = 0; c < MAXCPUS; ++c) {
+                tlb_state[c].ts_hand = 0;
+                tlb_state[c].ts_as = NULL;
+                tlb_state[c].ts_asid = 0;
+                tlb_state[c].ts_asid_next = ASID_FIRST;
+                tlb_state[c].ts_asid_generation = 1;
+        }
 }
 
 /*
- * Called by interrupt handler in the case of an interprocessor interrupt of
- * type IPI_TLBSHOOTDOWN, where all processors are specified.
+ * Returns whether as has an ASID of the current generation on this cpu,
+ * that is, whether this cpu's TLB may hold entries of as. Call at splhigh.
+ */
+static
+bool
+tlb_asid_is_live(const struct addrspace *as)
+{
+        const unsigned c = curcpu->c_number;
+
+        return as->as_asid_generation[c] == tlb_state_of_curcpu()->ts_asid_generation;
+}
+
+/*
+ * Invalidates the entries of as for the npages virtual pages in vaddrs in
+ * this cpu's TLB. As each entry is tagged with an ASID, it is looked up
+ * with a probe rather than a scan of the TLB. Call at splhigh.
+ */
+static
+void
+tlb_invalidate_pages(const struct addrspace *as, const vaddr_t *vaddrs, unsigned npages)
+{
+        if (!tlb_asid_is_live(as)) {
+                /* It cannot have entries here */
+                return;
+        }
+        const uint32_t asid = as->as_asid[curcpu->c_number] << TLBHI_PID_SHIFT;
+
+        for (unsigned i = 0; i < npages; ++i) {
+                const int index = tlb_probe(vaddrs[i] | asid, 0);
+                if (index >= 0) {
+                        tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+                }
+        }
+        tlb_restore_asid();
+}
+
+/*
+ * Invalidates every entry in this cpu's TLB.
+ * Also called by interrupt handler in the case of an interprocessor
+ * interrupt of type IPI_TLBSHOOTDOWN, where all mappings are specified.
  */
 void
 vm_tlbshootdown_all(void)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	/* Disable interrupts on this CPU while clearing the TLB. */
+	const int spl = splhigh();
+
+	for (int i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_restore_asid();
+
+	splx(spl);
+}
+
+void
+vm_activate(struct addrspace *as)
+{
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	const int spl = splhigh();
+
+        const unsigned c = curcpu->c_number;
+        const uint32_t bit = (uint32_t)1 << c;
+        struct tlb_state* ts = tlb_state_of_curcpu();
+
+        spinlock_acquire(&asid_lock);
+
+        ts->ts_activations += 1;
+
+        /* Shootdowns of as must interrupt this cpu from now on */
+        if (ts->ts_as != as) {
+                if (ts->ts_as != NULL) {
+                        ts->ts_as->as_cpus &= ~bit;
+                }
+                as->as_cpus |= bit;
+                ts->ts_as = as;
+        }
+
+        if (as->as_asid_generation[c] != ts->ts_asid_generation) {
+                if (ts->ts_asid_next == NUM_ASID) {
+                        /*
+                         * Out of ASIDs. Start a new generation, in which
+                         * no entry left in the TLB may be matched.
+                         */
+                        ts->ts_asid_generation += 1;
+                        ts->ts_asid_next = ASID_FIRST;
+                        ts->ts_asid_rollovers += 1;
+                        for (int i=0; i<NUM_TLB; i++) {
+                                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+                        }
+                }
+                as->as_asid[c] = ts->ts_asid_next++;
+                as->as_asid_generation[c] = ts->ts_asid_generation;
+                ts->ts_asid_assigned += 1;
+        }
+
+        ts->ts_asid = as->as_asid[c];
+        tlb_setasid(ts->ts_asid);
+
+        spinlock_release(&asid_lock);
+
+	splx(spl);
+}
+
+void
+vm_forget(struct addrspace *as)
+{
+        spinlock_acquire(&asid_lock);
+
+        for (unsigned c = 0; c < MAXCPUS; ++c) {
+                if (as->as_cpus & ((uint32_t)1 << c)) {
+                        KASSERT(tlb_state[c].ts_as == as);
+                        tlb_state[c].ts_as = NULL;
+                }
+        }
+        as->as_cpus = 0;
+
+        spinlock_release(&asid_lock);
 }
 
 /*
  * Called by interrupt handler in the case of an interprocessor interrupt of
- * type IPI_TLBSHOOTDOWN, where all processors are specified.
+ * type IPI_TLBSHOOTDOWN, where a batch of mappings is specified.
  */
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+        /* Interrupts are off, and the sender waits for us */
+        if (ts->ts_vaddrs == NULL) {
+                /*
+                 * Every entry of ts_as. Taking it a new ASID would need
+                 * asid_lock, which the sender may hold while it waits for
+                 * our IPI lock, so flush the whole TLB instead.
+                 */
+                vm_tlbshootdown_all();
+        }
+        else {
+                tlb_invalidate_pages(ts->ts_as, ts->ts_vaddrs, ts->ts_npages);
+        }
+        tlb_state_of_curcpu()->ts_shootdowns += 1;
+
+	V(ts->ts_done);
+}
+
+/*
+ * Invalidates the npages pages at vaddrs of as in every TLB, or all of
+ * its entries if vaddrs is NULL, for vm_tlbshootdown_pages and
+ * vm_tlbshootdown_as.
+ */
+static
+void
+tlb_shootdown(struct addrspace *as, const vaddr_t *vaddrs, unsigned npages)
+{
+        KASSERT(lock_do_i_hold(as->as_lock));
+
+        const bool all = vaddrs == NULL;
+        const struct tlbshootdown ts = {
+                .ts_as = as,
+                .ts_vaddrs = vaddrs,
+                .ts_npages = npages,
+                .ts_done = shootdown_done,
+        };
+
+        lock_acquire(shootdown_lock);
+
+        /* Don't migrate between choosing the targets and the local flush */
+        const int spl = splhigh();
+        const unsigned c = curcpu->c_number;
+
+        spinlock_acquire(&asid_lock);
+
+        /*
+         * Cpus that have as loaded may translate through its entries at
+         * any moment, so they must invalidate them before we go on. On the
+         * others, as is not active, and it is enough to forget its ASID:
+         * it gets a new one the next time it is activated there, which
+         * vm_activate can only do once we release asid_lock.
+         */
+        const uint32_t targets = as->as_cpus & ~((uint32_t)1 << c);
+        for (unsigned i = 0; i < MAXCPUS; ++i) {
+                if (i != c && (targets & ((uint32_t)1 << i)) == 0
+                    && as->as_asid_generation[i] != 0) {
+                        as->as_asid_generation[i] = 0;
+                        shootdown_forgotten += 1;
+                }
+        }
+        const unsigned ntargets = ipi_tlbshootdown_cpus(targets, &ts);
+
+        /* Drop ours too; if as is loaded here, it takes a new one below */
+        const bool active = tlb_state_of_curcpu()->ts_as == as;
+        if (all) {
+                as->as_asid_generation[c] = 0;
+        }
+
+        spinlock_release(&asid_lock);
+
+        if (!all) {
+                tlb_invalidate_pages(as, vaddrs, npages);
+        }
+        else if (active) {
+                vm_activate(as);
+        }
+
+        splx(spl);
+
+        for (unsigned i = 0; i < ntargets; i++) {
+                P(shootdown_done);
+        }
+
+        if (all) {
+                shootdown_flushes += 1;
+        }
+        else {
+                shootdown_count += 1;
+                shootdown_pages += npages;
+        }
+        shootdown_ipis += ntargets;
+
+        lock_release(shootdown_lock);
+}
+
+void
+vm_tlbshootdown_pages(struct addrspace *as, const vaddr_t *vaddrs, unsigned npages)
+{
+        KASSERT(vaddrs != NULL);
+
+        if (npages == 0) {
+                return;
+        }
+        tlb_shootdown(as, vaddrs, npages);
+}
+
+void
+vm_tlbshootdown_as(struct addrspace *as)
+{
+        tlb_shootdown(as, NULL, 0);
+}
+
+/*
+ * Loads an entry into the TLB of this cpu, replacing the entries
+ * round-robin. Invalid entries are reused as the hand comes across them.
+ * Call at splhigh, and restore the ASID afterwards.
+ */
+static
+void
+tlb_refill(struct tlb_state* ts, uint32_t ehi, uint32_t elo)
+{
+        const unsigned victim = ts->ts_hand;
+        ts->ts_hand = (victim + 1) % NUM_TLB;
+
+        uint32_t victim_ehi, victim_elo;
+        tlb_read(&victim_ehi, &victim_elo, victim);
+        if (victim_elo & TLBLO_VALID) {
+                ts->ts_evictions += 1;
+        }
+
+        tlb_write(ehi, elo, victim);
+}
+
+/*
+ * Fault-around: after a miss on vpage, also loads entries for the other
+ * resident pages of its region in the aligned window of faultaround_window
+ * pages that holds it, so that a walk over memory that is already resident does not
+ * trap once per page. Pages that are not resident are left to fault in
+ * the usual way. Called at splhigh with the address space lock held,
+ * once the entry for vpage is loaded; the round-robin replacement will
+ * not come back to it before NUM_TLB - 1 more refills. Returns the
+ * number of entries loaded.
+ */
+static
+unsigned
+tlb_fault_around(struct addrspace* as, const struct as_region* region,
+                 vpage_t vpage, struct tlb_state* ts)
+{
+        const unsigned window = faultaround_window;
+        if (window <= 1) {
+                return 0;
+        }
+
+        const page_table* pt = &as->as_page_table;
+        const vpage_t first = max(vpage & ~(vpage_t)(window - 1),
+                                  addr_to_page(region->ar_start));
+        const vpage_t last = min((vpage | (vpage_t)(window - 1)) + 1,
+                                 addr_to_page(region->ar_end));
+        const bool writeable = (region->ar_perms & AS_REGION_WRITE) != 0;
+        unsigned loaded = 0;
+
+        for (vpage_t v = first; v < last; ++v) {
+
+                if (v == vpage || !page_table_contains(pt, v)) {
+                        continue;
+                }
+                const ppage_t ppage = page_table_read(pt, v);
+                if (!PPAGE_IS_RESIDENT(ppage)) {
+                        continue;
+                }
+                /* Pages read ahead must trap on first use, see vm_swap_in */
+                if (coremap_is_readahead(ppage)) {
+                        continue;
+                }
+
+                const uint32_t ehi = page_to_addr(v) | (ts->ts_asid << TLBHI_PID_SHIFT);
+                if (tlb_probe(ehi, 0) >= 0) {
+                        continue;
+                }
+
+                /* Same rules as vm_fault, see there */
+                const bool copy_on_write = !region->ar_shared && coremap_is_shared(ppage);
+                const uint32_t dirty = writeable && coremap_is_dirty(ppage) && !copy_on_write
+                        ? TLBLO_DIRTY : 0;
+                tlb_refill(ts, ehi, page_to_addr(ppage) | dirty | TLBLO_VALID);
+                ++loaded;
+        }
+        return loaded;
+}
+
+int
+vm_set_faultaround(unsigned pages)
+{
+        /* A power of two, so that the windows are aligned */
+        if (pages == 0 || pages > VM_FAULTAROUND_MAX || (pages & (pages - 1)) != 0) {
+                return EINVAL;
+        }
+        faultaround_window = pages;
+        return 0;
+}
+
+int
+vm_set_stack_limit(unsigned pages)
+{
+        /* No less than the stack starts out with */
+        if (pages < STACKPAGES || pages > VM_STACK_LIMIT_MAX) {
+                return EINVAL;
+        }
+        stack_limit = pages;
+        return 0;
+}
+
+unsigned
+vm_get_stack_limit(void)
+{
+        return stack_limit;
+}
+
+static int vm_fault_locked(struct addrspace* as, int faulttype, vaddr_t faultaddress);
+
+/*
+ * The readahead window for a swap-in at vpage: none unless it carries on
+ * from the last one, growing while the pages read ahead get used.
+ */
+static
+unsigned
+vm_readahead_window(const struct addrspace* as, vpage_t vpage)
+{
+        if (vpage != as->as_ra_next) {
+                return 0;
+        }
+        if (as->as_ra_window == 0) {
+                return VM_READAHEAD_MIN;
+        }
+        if (as->as_ra_used >= as->as_ra_issued) {
+                return min(as->as_ra_window * 2, VM_READAHEAD_MAX);
+        }
+        return max(as->as_ra_window / 2, VM_READAHEAD_MIN);
+}
+
+/*
+ * Reads swapped-out vpage from page file slot index into ppage, along
+ * with the pages after it that are read ahead: those of the region that
+ * are in the slots right after index, as the clustered writes of the
+ * page replacement leave them, for as many as the window allows and
+ * there are free frames for. They all come in with a single I/O. The
+ * pages read ahead are mapped, keeping their slots as swap copies, but
+ * not loaded into the TLB, so that their first use tells whether reading
+ * them was worth it.
+ */
+static
+int
+vm_swap_in(struct addrspace* as, const struct as_region* region,
+           vpage_t vpage, pfid index, ppage_t ppage)
+{
+        KASSERT(VM_READAHEAD_MAX < PF_BATCH_MAX);
+
+        page_table* pt = &as->as_page_table;
+        const unsigned window = vm_readahead_window(as, vpage);
+        const vpage_t end = addr_to_page(region->ar_end);
+
+        ppage_t ppages[PF_BATCH_MAX];
+        void* dsts[PF_BATCH_MAX];
+        ppages[0] = ppage;
+        unsigned npages = 1;
+
+        while (npages <= window && vpage + (vpage_t)npages < end) {
+                const ppage_t entry = page_table_read(pt, vpage + npages);
+                if (!PPAGE_IS_SWAPPED(entry)
+                    || PPAGE_TO_PFID(entry) != index + (pfid)npages) {
+                        break;
+                }
+                /* Reading ahead is not worth an eviction */
+                const ppage_t frame = claim_free_pages(1);
+                if (frame == PPAGE_INVALID) {
+                        break;
+                }
+                ppages[npages++] = frame;
+        }
+
+        for (unsigned i = 0; i < npages; ++i) {
+                dsts[i] = (void*)PADDR_TO_KVADDR(page_to_addr(ppages[i]));
+        }
+
+        const int result = page_file_read_batch(index, dsts, npages);
+        if (result) {
+                for (unsigned i = 1; i < npages; ++i) {
+                        coremap_decref(ppages[i]);
+                }
+                as->as_ra_next = VPAGE_INVALID;
+                return result;
+        }
+
+        for (unsigned i = 1; i < npages; ++i) {
+                coremap_set_swap_copy(ppages[i], index + i);
+                page_table_write(pt, vpage + i, ppages[i]);
+                coremap_set_owner(ppages[i], as, vpage + i);
+                coremap_set_readahead(ppages[i]);
+        }
+
+        as->as_ra_next = vpage + npages;
+        as->as_ra_window = window;
+        as->as_ra_issued = npages - 1;
+        as->as_ra_used = 0;
+        return 0;
 }
 
 /*
@@ -87,9 +607,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-                    /* TODO */
-		/* We always create pages read-write, so we can't get this */
-		panic("vm: got VM_FAULT_READONLY\n");
+		/* A write to a clean or copy-on-write page, see below */
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -106,8 +624,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-        const pid_t pid = curproc->p_pid;
-
 	struct addrspace* as = proc_getas();
 	if (as == NULL) {
 		/*
@@ -117,38 +633,193 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-    // check that it is not in the region between the heap and the stack, and that the heap is allocated
-    if ( faultaddress >= as->as_heap_end && faultaddress <= USERSTACK - 18*4096
-            && as->as_heap_end != 0 ) {
-        return EFAULT;
-    }
+        /* Keep the page replacement away from the page table meanwhile */
+        lock_acquire(as->as_lock);
+        const int result = vm_fault_locked(as, faulttype, faultaddress);
+        lock_release(as->as_lock);
 
-        page_table* pt = &as->as_page_table;
+        return result;
+}
 
-        const vpage_t vpage = addr_to_page(faultaddress);
+/*
+ * The body of vm_fault, called with the address space lock held.
+ */
+static
+int
+vm_fault_locked(struct addrspace* as, int faulttype, vaddr_t faultaddress)
+{
+        const pid_t pid = curproc->p_pid;
 
-        if (!page_table_contains(pt, vpage)) {
+        /* Only addresses in a region are valid; see as_region_of */
+        const struct as_region* region = as_region_of(as, faultaddress);
+        if (region == NULL) {
+                /* Unless the stack can grow down to them */
+                region = as_grow_stack(as, faultaddress);
+        }
+        if (region == NULL) {
                 kprintf("vm: hard fault! pid %d, vaddr 0x%x\n", pid, faultaddress);
                 return EFAULT;
         }
-
-        /* check if this region is within the heap  */
-        if (!page_table_contains(pt, vpage)) {
-                kprintf("vm: hard fault! pid %d, vaddr 0x%x\n", pid, faultaddress);
+        const bool writeable = (region->ar_perms & AS_REGION_WRITE) != 0;
+        if (faulttype != VM_FAULT_READ && !writeable) {
+                kprintf("vm: write to read-only page! pid %d, vaddr 0x%x\n",
+                        pid, faultaddress);
+                return EFAULT;
+        }
+        if ((region->ar_perms & AS_REGION_READ) == 0) {
+                /* mmap with PROT_NONE */
+                kprintf("vm: access to protected page! pid %d, vaddr 0x%x\n",
+                        pid, faultaddress);
                 return EFAULT;
         }
 
+        page_table* pt = &as->as_page_table;
+
+        const vpage_t vpage = addr_to_page(faultaddress);
+
+        /* Pages that were never touched have no entry, and read as invalid */
         ppage_t ppage = page_table_read(pt, vpage);
-        if (ppage == PPAGE_INVALID) {
-                ppage = claim_free_pages(1);
+
+        if (faulttype != VM_FAULT_READONLY) {
+                as->as_tlb_misses += 1;
+                if (PPAGE_IS_RESIDENT(ppage)) {
+                        /* Only the TLB entry was missing */
+                        as->as_soft_misses += 1;
+                }
+        }
+
+        if (PPAGE_IS_RESIDENT(ppage) && coremap_take_readahead(ppage)) {
+                /* The first use of a page vm_swap_in read ahead */
+                as->as_ra_used += 1;
+        }
+
+        if (PPAGE_IS_SWAPPED(ppage)) {
+                const pfid index = PPAGE_TO_PFID(ppage);
+
+                ppage = claim_user_page();
+                if (ppage == PPAGE_INVALID) {
+                        kprintf("vm: Ran out of memory!\n");
+                        return ENOMEM;
+                }
+                DEBUG(DB_VM, "vm: swap in pid %d, vaddr 0x%x from pfid %d\n",
+                      pid, faultaddress, index);
+
+                /*
+                 * Keep the slot: as long as the page stays clean, it can
+                 * be evicted again without writing it out.
+                 */
+                const int result = vm_swap_in(as, region, vpage, index, ppage);
+                if (result) {
+                        coremap_decref(ppage);
+                        return result;
+                }
+                coremap_set_swap_copy(ppage, index);
+
+                /* Overwrites the swapped entry, so it cannot fail */
+                page_table_write(pt, vpage, ppage);
+        }
+        else if (ppage == PPAGE_INVALID && faulttype == VM_FAULT_READ
+                 && as_page_is_zero(as, vpage)) {
+                /*
+                 * Reading a page that was never written: share the zero
+                 * page until the first write, see the copy-on-write below.
+                 */
+                ppage = coremap_map_zero_page();
+                const int result = page_table_write(pt, vpage, ppage);
+                if (result) {
+                        coremap_decref(ppage);
+                        return result;
+                }
+        }
+        else if (ppage == PPAGE_INVALID && as_page_is_zero(as, vpage)) {
+                /*
+                 * Writing a page that starts out as zeros. Frames come
+                 * with whatever their last user left in them, so take one
+                 * zeroed beforehand, if there is one.
+                 */
+                struct timespec before, after;
+                const bool timed = coremap_zero_timing();
+                if (timed) {
+                        gettime(&before);
+                }
+
+                bool pooled;
+                ppage = claim_zeroed_user_page(&pooled);
+                if (ppage == PPAGE_INVALID) {
+                        kprintf("vm: Ran out of memory!\n");
+                        return ENOMEM;
+                }
+                const int result = page_table_write(pt, vpage, ppage);
+                if (result) {
+                        coremap_decref(ppage);
+                        return result;
+                }
+
+                if (timed) {
+                        gettime(&after);
+                        timespec_sub(&after, &before, &after);
+                        coremap_account_zero_fault(pooled, &after);
+                }
+        }
+        else if (ppage == PPAGE_INVALID) {
+                ppage = claim_user_page();
                 if (ppage == PPAGE_INVALID) {
                         kprintf("vm: Ran out of memory!\n");
                         return ENOMEM;
                 }
-                else {
-                        page_table_write(pt, vpage, ppage);
+
+                /* Read the page in if it is part of the executable */
+                int result = as_fill_page(as, vpage, ppage);
+                if (result == 0) {
+                        result = page_table_write(pt, vpage, ppage);
+                }
+                if (result) {
+                        coremap_decref(ppage);
+                        return result;
+                }
+        }
+        else if (faulttype != VM_FAULT_READ && coremap_is_shared(ppage)
+                 && !region->ar_shared) {
+                /*
+                 * Copy-on-write: the first write to a frame shared with
+                 * another address space gets a private copy of it. The
+                 * frames of a MAP_SHARED file stay shared after a fork.
+                 */
+                const ppage_t copy = copy_to_new_page(ppage);
+                if (copy == PPAGE_INVALID) {
+                        kprintf("vm: Ran out of memory!\n");
+                        return ENOMEM;
                 }
+                DEBUG(DB_VM, "vm: copy-on-write pid %d, vaddr 0x%x\n", pid, faultaddress);
+
+                page_table_write(pt, vpage, copy);
+
+                /*
+                 * Other threads of ours may still read the shared frame
+                 * through their TLBs. The entry here is replaced below.
+                 */
+                vm_tlbshootdown_pages(as, &faultaddress, 1);
+
+                coremap_decref_owner(ppage, as);
+                ppage = copy;
+        }
+
+        /* Make the frame a candidate for eviction, and mark it used */
+        coremap_set_owner(ppage, as, vpage);
+
+        /*
+         * Frames are mapped read-only until they are written to, so that
+         * clean frames can be told apart. A write to a frame we don't
+         * share marks it dirty; shared frames stay read-only, see above.
+         * Pages of regions that are not writeable, like the text, never
+         * get TLBLO_DIRTY, so that writes to them trap.
+         */
+        const bool copy_on_write = !region->ar_shared && coremap_is_shared(ppage);
+        if (faulttype != VM_FAULT_READ && !copy_on_write) {
+                coremap_set_dirty(ppage);
         }
+        const uint32_t dirty = writeable && coremap_is_dirty(ppage) && !copy_on_write
+                ? TLBLO_DIRTY : 0;
 
         const paddr_t paddr = page_to_addr(ppage);
 
@@ -156,36 +827,84 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	int spl = splhigh();
 
         /*
-         * TODO: Consider writing TLB entries using the combined
-         * hash of the virtual page and process id
+         * A read-only entry for this page is still in the TLB after a
+         * VM_FAULT_READONLY. Replace it in place, as the TLB must never
+         * hold two entries for the same virtual page.
          */
-	for (int i = 0; i < NUM_TLB; i++) {
+        struct tlb_state* ts = tlb_state_of_curcpu();
 
-                uint32_t ehi, elo;
+        /* Entries are tagged with the ASID of the address space */
+        const uint32_t ehi = faultaddress | (ts->ts_asid << TLBHI_PID_SHIFT);
+        const uint32_t elo = paddr | dirty | TLBLO_VALID;
 
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
-		}
-                /*
-                 * TLB PID Note 1, see TLB PID Note 2
-                 */
-		ehi = faultaddress | (pid << 6);
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "vm: pid %d 0x%x -> 0x%x\n", pid, faultaddress, paddr);
-		tlb_write(ehi, elo, i);
+        const int existing = tlb_probe(ehi, 0);
+        if (existing >= 0) {
+		tlb_write(ehi, elo, existing);
+		tlb_restore_asid();
+                ts->ts_updates += 1;
 		splx(spl);
 		return 0;
-	}
+        }
+
+        tlb_refill(ts, ehi, elo);
+        ts->ts_refills += 1;
+
+        if (faulttype != VM_FAULT_READONLY) {
+                const unsigned preloaded = tlb_fault_around(as, region, vpage, ts);
+                as->as_preloaded += preloaded;
+                ts->ts_preloaded += preloaded;
+        }
+        tlb_restore_asid();
+
+	splx(spl);
 
         /*
-         * WARNING, May not want to use krpintf in here after a tlb write, as
+         * WARNING, May not want to use krpintf in here before the tlb write, as
          * it may touch some of the TLB entries and make some weird bugs
          */
+        DEBUG(DB_VM, "vm: pid %d 0x%x -> 0x%x\n", pid, faultaddress, paddr);
 
-	// kprintf("vm: Ran out of TLB entries - cannot handle page fault\n");
-	splx(spl);
-	return EFAULT;
+	return 0;
+}
+
+void
+vm_printstats(void)
+{
+        kprintf("TLB:  cpu   refills  evictions   updates  activations  new ASIDs  rollovers\n");
+
+        for (unsigned c = 0; c < MAXCPUS; ++c) {
+                /* Only the cpu itself writes these, a torn read is harmless */
+                const struct tlb_state* ts = tlb_state + c;
+
+                if (ts->ts_refills + ts->ts_updates + ts->ts_activations == 0) {
+                        continue;
+                }
+                kprintf("      %3u  %8u   %8u  %8u     %8u   %8u   %8u\n", c,
+                        ts->ts_refills, ts->ts_evictions, ts->ts_updates,
+                        ts->ts_activations, ts->ts_asid_assigned,
+                        ts->ts_asid_rollovers);
+        }
+
+        unsigned preloaded = 0;
+        for (unsigned c = 0; c < MAXCPUS; ++c) {
+                preloaded += tlb_state[c].ts_preloaded;
+        }
+        kprintf("Fault-around: %u page window, %u entries preloaded\n",
+                faultaround_window, preloaded);
+
+        lock_acquire(shootdown_lock);
+        kprintf("Shootdowns: %u of %u pages, %u of whole address spaces, %u IPIs, "
+                "%u remote ASIDs dropped\n", shootdown_count, shootdown_pages,
+                shootdown_flushes, shootdown_ipis, shootdown_forgotten);
+        lock_release(shootdown_lock);
+
+        kprintf("Shootdown IPIs handled:");
+        for (unsigned c = 0; c < MAXCPUS; ++c) {
+                if (tlb_state[c].ts_shootdowns != 0) {
+                        kprintf(" cpu%u %u", c, tlb_state[c].ts_shootdowns);
+                }
+        }
+        kprintf("\n");
 }
 
 
@@ -261,6 +261,53 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 	return result;
 }
 
+/*
+ * emu_doread for user-space transfers: copy the data out of the I/O
+ * buffer under e_lock, then move it to the user with the lock released.
+ */
+static
+int
+emu_doread_bounced(struct emu_softc *sc, uint32_t handle, uint32_t len,
+		   uint32_t op, struct uio *uio)
+{
+	char *bounce;
+	uint32_t amt;
+	off_t newoffset;
+	int result;
+
+	bounce = kmalloc(len);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(sc->e_lock);
+
+	emu_wreg(sc, REG_HANDLE, handle);
+	emu_wreg(sc, REG_IOLEN, len);
+	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
+	emu_wreg(sc, REG_OPER, op);
+	result = emu_waitdone(sc);
+	if (result) {
+		lock_release(sc->e_lock);
+		kfree(bounce);
+		return result;
+	}
+
+	membar_load_load();
+	amt = emu_rreg(sc, REG_IOLEN);
+	KASSERT(amt <= len);
+	memcpy(bounce, sc->e_iobuf, amt);
+	newoffset = emu_rreg(sc, REG_OFFSET);
+
+	lock_release(sc->e_lock);
+
+	result = uiomove(bounce, amt, uio);
+	uio->uio_offset = newoffset;
+
+	kfree(bounce);
+	return result;
+}
+
 /*
  * Common code for read and readdir.
  */
@@ -278,6 +325,16 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 		return 0;
 	}
 
+	/*
+	 * Transfers to and from user memory may page fault, and the
+	 * fault handler may itself read from the emulator (to load a
+	 * program page, or to swap). So they go through a bounce
+	 * buffer, outside e_lock.
+	 */
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return emu_doread_bounced(sc, handle, len, op, uio);
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
@@ -321,6 +378,49 @@ emu_readdir(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	return emu_doread(sc, handle, len, EMU_OP_READDIR, uio);
 }
 
+/*
+ * emu_write for user-space transfers: move the data in from the user
+ * before taking e_lock, then copy it into the I/O buffer.
+ */
+static
+int
+emu_write_bounced(struct emu_softc *sc, uint32_t handle, uint32_t len,
+		  struct uio *uio)
+{
+	char *bounce;
+	off_t offset;
+	int result;
+
+	bounce = kmalloc(len);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+
+	offset = uio->uio_offset;
+	result = uiomove(bounce, len, uio);
+	if (result) {
+		kfree(bounce);
+		return result;
+	}
+
+	lock_acquire(sc->e_lock);
+
+	emu_wreg(sc, REG_HANDLE, handle);
+	emu_wreg(sc, REG_IOLEN, len);
+	emu_wreg(sc, REG_OFFSET, offset);
+
+	memcpy(sc->e_iobuf, bounce, len);
+	membar_store_store();
+
+	emu_wreg(sc, REG_OPER, EMU_OP_WRITE);
+	result = emu_waitdone(sc);
+
+	lock_release(sc->e_lock);
+
+	kfree(bounce);
+	return result;
+}
+
 /*
  * Write to a hardware-level file handle.
  */
@@ -337,6 +437,11 @@ emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 		return EFBIG;
 	}
 
+	/* See emu_doread */
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return emu_write_bounced(sc, handle, len, uio);
+	}
+
 	lock_acquire(sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
@@ -845,13 +950,16 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * Files can be mapped; the pages go through emufs_read and emufs_write.
  */
 static
 int
-emufs_mmap(struct vnode *v)
+emufs_mmap(struct vnode *v, int prot)
 {
 	(void)v;
-	return ENOSYS;
+	(void)prot;
+	return 0;
 }
 
 //////////////////////////////
@@ -1121,7 +1229,7 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_gettype = emufs_dir_gettype,
 	.vop_isseekable = emufs_isseekable,
 	.vop_fsync = emufs_void_op_isdir,
-	.vop_mmap = emufs_void_op_isdir,
+	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = emufs_truncate_isdir,
 	.vop_namefile = emufs_namefile,
 
@@ -39,9 +39,77 @@
 #include "opt-dumbvm.h"
 
 #include <page_table.h>
+#include <page_file.h>
+#include <platform/maxcpus.h>
 
 struct vnode;
+struct lock;
 
+/* Maximum number of ELF segments backing an address space */
+#define AS_MAX_SEGMENTS 4
+
+/*
+ * An ELF segment whose pages are read from the executable on demand.
+ * The segment occupies [seg_vaddr, seg_vaddr + seg_memsize); the first
+ * seg_filesize bytes come from seg_vnode at seg_offset, the rest is
+ * zero-filled.
+ */
+struct as_segment {
+        vaddr_t seg_vaddr;
+        size_t seg_memsize;
+        off_t seg_offset;
+        size_t seg_filesize;
+        struct vnode* seg_vnode; /* Holds a reference */
+        bool seg_executable;
+};
+
+
+/* Access allowed to the pages of a region */
+#define AS_REGION_READ   0x4
+#define AS_REGION_WRITE  0x2
+#define AS_REGION_EXEC   0x1
+
+/* What the pages of a region start out as */
+#define AS_REGION_ANON     0    /* Zeros */
+#define AS_REGION_SEGMENT  1    /* An ELF segment, see ar_segment */
+#define AS_REGION_HEAP     2    /* Zeros; grows and shrinks with sbrk */
+#define AS_REGION_STACK    3    /* Zeros */
+#define AS_REGION_FILE     4    /* A file mapped with mmap, see ar_vnode */
+#define AS_REGION_MAPPED   5    /* Zeros, mapped with mmap(MAP_ANON) */
+
+/*
+ * A range of valid user addresses, [ar_start, ar_end), both page aligned.
+ * The regions of an address space are kept sorted by address and never
+ * overlap. vm_fault looks up the region of the faulting address, and
+ * fails the fault if there is none or it does not allow the access.
+ * Only the pages that have been touched have page table entries.
+ */
+struct as_region {
+        vaddr_t ar_start;
+        vaddr_t ar_end;
+        unsigned ar_perms;      /* AS_REGION_READ | AS_REGION_WRITE | ... */
+        unsigned ar_kind;       /* AS_REGION_ANON, ... */
+        unsigned ar_segment;    /* Index into as_segments, if a segment */
+
+        /* For AS_REGION_FILE; the vnode holds a reference */
+        struct vnode* ar_vnode;
+        off_t ar_offset;        /* Where ar_start is found in the file */
+        bool ar_shared;         /* MAP_SHARED: written back to the file */
+};
+
+/*
+ * A resident page chosen for eviction, see as_evict_pages.
+ */
+struct as_victim {
+        vpage_t av_vpage;
+        ppage_t av_ppage;
+        bool av_dirty;          /* Written to since it was filled */
+        pfid av_swap_copy;      /* Page file slot with the same contents */
+
+        /* Set by as_evict_pages */
+        bool av_evicted;        /* The frame is no longer mapped */
+        bool av_written;        /* It took a page file write */
+};
 
 /*
  * Address space - data structure associated with the virtual memory
@@ -63,6 +131,44 @@ struct addrspace {
         page_table as_page_table;
         vaddr_t as_heap_end;
         vaddr_t as_heap_start;
+        struct as_segment as_segments[AS_MAX_SEGMENTS];
+        unsigned as_nsegments;
+
+        /* Sorted by address, see as_region_of */
+        struct as_region* as_regions;
+        unsigned as_nregions;
+        unsigned as_maxregions;
+
+        /*
+         * Protects the page table, the regions and the heap bounds.
+         * Held by vm_fault for the whole fault, and by the page
+         * replacement while it evicts one of our pages.
+         */
+        struct lock* as_lock;
+
+        /* The lowest address the stack may grow down to, see as_grow_stack */
+        vaddr_t as_stack_limit;
+
+        /*
+         * The TLB ASID of this address space on each cpu, valid while the
+         * generation matches the cpu's, see vm_activate.
+         */
+        unsigned as_asid[MAXCPUS];
+        unsigned as_asid_generation[MAXCPUS];
+
+        /* The cpus that have our ASID loaded, one bit each, see vm_activate */
+        uint32_t as_cpus;
+
+        /* Fault-around statistics, protected by as_lock, see vm_fault */
+        unsigned as_tlb_misses;         /* Faults for a missing entry */
+        unsigned as_soft_misses;        /* ... for a page already resident */
+        unsigned as_preloaded;          /* Entries loaded around them */
+
+        /* Swap-in readahead, protected by as_lock, see vm_swap_in */
+        vpage_t as_ra_next;             /* Where the next swap-in in sequence faults */
+        unsigned as_ra_window;          /* Window of the last swap-in */
+        unsigned as_ra_issued;          /* Pages it read ahead */
+        unsigned as_ra_used;            /* ... that were used since */
         /* Put stuff here for your VM system */
 #endif
 };
@@ -103,6 +209,71 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *                The region starts out STACKPAGES long; below it, room
+ *                is kept for it to grow to the stack limit.
+ *
+ *    as_grow_stack - extend the stack down to a virtual address, if it
+ *                is close enough below its bottom and within the stack
+ *                limit. Returns the stack region, or NULL. Called by
+ *                vm_fault with as_lock held for addresses outside any
+ *                region.
+ *
+ *    as_define_segment - record where the contents of a region are found
+ *                in the executable, so that its pages can be read in
+ *                when they are first touched. Called by load_elf.
+ *
+ *    as_fill_page - initialize a newly claimed frame for a virtual page,
+ *                reading it from the executable if it is part of a
+ *                segment. Called by vm_fault.
+ *
+ *    as_region_of - return the region holding a virtual address, or
+ *                NULL if it is not part of any. Takes O(log n) in the
+ *                number of regions. Called by vm_fault with as_lock held.
+ *
+ *    as_resize_region - move the end of the region starting at a given
+ *                address. Fails with ENOMEM if it would run into the
+ *                next region, or into the room kept for the stack. Used
+ *                by sys_sbrk for the heap.
+ *
+ *    as_shootdown_range - remove the TLB entries of a range of pages on
+ *                every cpu, in batches. Called with as_lock held before
+ *                the frames of the pages are given up.
+ *
+ *    as_map_file - add a region of LEN bytes at an address of our
+ *                choosing, below the regions above the heap and the room
+ *                kept for the stack, that maps
+ *                a vnode from OFFSET on. Its pages are read in on
+ *                demand; if SHARED, dirty pages are written back to the
+ *                file when they are evicted or unmapped. Used by sys_mmap.
+ *
+ *    as_map_anon - like as_map_file, but for LEN bytes of private,
+ *                zero-filled memory. Used by sys_mmap for MAP_ANON.
+ *
+ *    as_unmap  - remove the mappings in a range of whole pages, writing
+ *                back the dirty pages of shared files first. Fails with
+ *                EINVAL if the range touches a region that was not
+ *                mapped with as_map_file or as_map_anon.
+ *
+ *    as_sync_file - write back the dirty pages of the shared mappings
+ *                of a vnode. Used by sys_fsync.
+ *
+ *    as_page_is_zero - return whether a virtual page starts out as all
+ *                zeros, that is, it is anonymous memory or lies wholly
+ *                in the BSS. vm_fault maps the shared zero page there
+ *                until it is first written.
+ *
+ *    as_release_mapping - a page_table_visitor that gives up the frame
+ *                or page file slot a mapping holds, in the address space
+ *                passed as data. Used by as_destroy, as_unmap and
+ *                sys_sbrk.
+ *
+ *    as_evict_pages - unmap up to PF_BATCH_MAX resident pages, so that
+ *                their frames can be reused, and record where their
+ *                contents can be found. Clean pages fall back on their
+ *                swap copy if there is one, or on the executable. The
+ *                others are written to the page file together in one
+ *                clustered write. Reports the outcome for each victim.
+ *                Called by the page replacement with as_lock held.
  *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
@@ -122,6 +293,32 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+const struct as_region *as_grow_stack(struct addrspace *as, vaddr_t vaddr);
+int               as_define_segment(struct addrspace *as, struct vnode *v,
+                                    off_t offset, vaddr_t vaddr,
+                                    size_t memsize, size_t filesize,
+                                    int executable);
+int               as_fill_page(struct addrspace *as, vpage_t vpage,
+                               ppage_t ppage);
+const struct as_region *as_region_of(const struct addrspace *as,
+                                    vaddr_t vaddr);
+int               as_resize_region(struct addrspace *as, vaddr_t start,
+                                   vaddr_t end);
+void              as_shootdown_range(struct addrspace *as, vpage_t first,
+                                     unsigned npages);
+int               as_map_file(struct addrspace *as, size_t len,
+                              unsigned perms, struct vnode *vn,
+                              off_t offset, bool shared, vaddr_t *ret);
+int               as_map_anon(struct addrspace *as, size_t len,
+                              unsigned perms, vaddr_t *ret);
+int               as_unmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_sync_file(struct addrspace *as, struct vnode *vn);
+bool              as_page_is_zero(struct addrspace *as, vpage_t vpage);
+int               as_release_mapping(vpage_t vpage, ppage_t *ppage,
+                                     void *data);
+void              as_evict_pages(struct addrspace *as,
+                                 struct as_victim *victims,
+                                 unsigned nvictims);
 
 
 /*
@@ -31,6 +31,16 @@
 #define _COREMAP_H_
 
 #include <types.h>
+#include <page_file.h>
+
+struct addrspace;
+struct timespec;
+
+/*
+ * Number of buddy allocator block orders. The largest block is
+ * 2^(COREMAP_ORDERS - 1) pages, which covers 512MB of physical memory.
+ */
+#define COREMAP_ORDERS 18
 
 /*
  * called by main 
@@ -63,12 +73,177 @@ alloc_kpages(unsigned npages);
 void
 free_kpages(vaddr_t vaddr);
 
-UNUSED
-page_t
-find_free_coremap_entries(unsigned npages);
-
-UNUSED
+/*
+ * Claims npages contiguous page frames from the buddy allocator.
+ * Returns the first physical page, or PPAGE_INVALID if there is no free
+ * run of pages that is large enough.
+ */
 ppage_t
 claim_free_pages(unsigned npages);
 
+/*
+ * Frees a run of page frames returned by claim_free_pages, coalescing it
+ * with its free neighbours.
+ */
+void
+free_pages(ppage_t ppage);
+
+/*
+ * Reference counting for user page frames, which may be shared
+ * copy-on-write between address spaces after a fork. claim_free_pages
+ * hands out frames with a reference count of 1; coremap_decref frees the
+ * frame when the count drops to 0.
+ *
+ * The clock evicts a frame from the mappings it knows of: its owner, see
+ * coremap_set_owner, or both sides of a fork pair. coremap_share records
+ * a pair when as_copy shares a frame that only as mapped, at vpage, with
+ * other. coremap_decref_owner drops the reference of a mapping in as, and
+ * if that breaks up a pair, the other side becomes the owner.
+ *
+ * Other shared frames are not evicted: those coremap_incref shares, and
+ * those of three or more address spaces, as after a second fork. They
+ * become evictable again once the remaining mapping gets an owner.
+ */
+void
+coremap_incref(ppage_t ppage);
+
+void
+coremap_share(ppage_t ppage, struct addrspace* as, struct addrspace* other,
+              vpage_t vpage);
+
+void
+coremap_decref(ppage_t ppage);
+
+void
+coremap_decref_owner(ppage_t ppage, struct addrspace* as);
+
+/* Is the frame mapped by more than one page table entry? */
+bool
+coremap_is_shared(ppage_t ppage);
+
+/*
+ * Dirty tracking. User frames are mapped read-only until the first write,
+ * which marks them dirty. Clean frames are evicted without writing them
+ * out when their contents can be found elsewhere: in the page file slot
+ * they were read from (the swap copy), or in the executable.
+ *
+ * coremap_set_dirty frees the swap copy, which is stale from then on.
+ * coremap_clear_dirty marks a frame clean again once it has been written
+ * back to a file mapped MAP_SHARED; no TLB may map it writeable by then.
+ * coremap_set_swap_copy hands ownership of the slot to the frame; it is
+ * freed along with the frame.
+ */
+bool
+coremap_is_dirty(ppage_t ppage);
+
+void
+coremap_set_dirty(ppage_t ppage);
+
+void
+coremap_clear_dirty(ppage_t ppage);
+
+void
+coremap_set_swap_copy(ppage_t ppage, pfid index);
+
+/*
+ * Swap-in readahead. vm_fault reads the swapped pages that follow a
+ * sequential swap-in into frames of their own, without loading them into
+ * the TLB, so that their first use still traps.
+ *
+ * coremap_set_readahead marks such a frame, after coremap_set_owner, and
+ * leaves it unreferenced, so that it is the first to be evicted if it is
+ * not used. coremap_is_readahead tells whether it is still unused.
+ * coremap_take_readahead clears the mark on its first use, and returns
+ * whether there was one. Frames evicted or freed with the mark still on
+ * count as wasted readahead.
+ */
+void
+coremap_set_readahead(ppage_t ppage);
+
+bool
+coremap_is_readahead(ppage_t ppage);
+
+bool
+coremap_take_readahead(ppage_t ppage);
+
+/*
+ * Records that the frame is mapped at vpage in as, and that it was just
+ * used. Only frames with an owner are considered for eviction. Called with
+ * the address space lock held whenever a mapping is loaded into the TLB.
+ */
+void
+coremap_set_owner(ppage_t ppage, struct addrspace* as, vpage_t vpage);
+
+/*
+ * Claims a single page frame for user memory. If there is no free frame,
+ * a user page is evicted to the page file to make room. Must be able to
+ * sleep. Returns PPAGE_INVALID if no frame could be found or freed.
+ */
+ppage_t
+claim_user_page(void);
+
+/*
+ * Like claim_user_page, but the frame is zeroed, for the first touch of
+ * an anonymous page. Takes a frame from the pool that the prezero thread
+ * zeroes ahead of time if it can, and sets pooled to whether it did.
+ */
+ppage_t
+claim_zeroed_user_page(bool* pooled);
+
+/*
+ * Starts the thread that fills the pool of zeroed frames. It runs only
+ * when its cpu has nothing else to do. Called once threads can be forked.
+ */
+void
+coremap_prezero_bootstrap(void);
+
+/*
+ * Timing of the faults that claim a zeroed frame. Off to begin with, as it
+ * reads the clock twice for each; coremap_set_zero_timing is called by the
+ * menu. While it is on, vm_fault records how long each such fault took
+ * with coremap_account_zero_fault.
+ */
+bool
+coremap_zero_timing(void);
+
+void
+coremap_set_zero_timing(bool on);
+
+void
+coremap_account_zero_fault(bool pooled, const struct timespec* duration);
+
+/*
+ * Evicts up to npages user pages and frees their frames. Used by the
+ * pageout daemon. Returns the number of frames freed, which is less than
+ * npages if no more pages could be evicted right now.
+ */
+unsigned
+coremap_reclaim(unsigned npages);
+
+/* The number of free page frames, including those cached per cpu */
+size_t
+coremap_free_page_count(void);
+
+/*
+ * Returns the shared frame of zeros, with a new reference for the caller
+ * to map read-only at an anonymous page that has never been written. A
+ * write breaks the sharing like any copy-on-write fault.
+ */
+ppage_t
+coremap_map_zero_page(void);
+
+/*
+ * Claims a new page frame and copies the contents of old_page into it.
+ * Returns PPAGE_INVALID if old_page is invalid or no frame is available.
+ */
+ppage_t
+copy_to_new_page(ppage_t old_page);
+
+/*
+ * Prints the free list lengths and fragmentation of the buddy allocator.
+ * Called by the menu.
+ */
+void
+coremap_printstats(void);
+
 #endif /* _COREMAP_H_ */
@@ -74,6 +74,12 @@ struct device_ops {
 /* Create vnode for a vfs-level device. */
 struct vnode *dev_create_vnode(struct device *dev);
 
+/*
+ * The device behind a vnode, or NULL if the vnode is not a device.
+ * For callers that do their own DEVOP_IO, like the page file.
+ */
+struct device *dev_getdevice(struct vnode *v);
+
 
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
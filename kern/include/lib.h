@@ -211,4 +211,9 @@ static inline unsigned max(unsigned a, unsigned b)
         return a > b ? a : b;
 }
 
+static inline unsigned min(unsigned a, unsigned b)
+{
+        return a < b ? a : b;
+}
+
 #endif /* _LIB_H_ */
@@ -35,6 +35,10 @@
 /* Index of a page on disk */
 typedef int pfid;
 
+/*
+ * Opens the page file: the raw disk lhd0raw:, striped with lhd1raw: under
+ * the swapstripe option, or the file LHD0.img if there is no raw disk.
+ */
 void page_file_bootstrap(void);
 
 /*
@@ -45,6 +49,39 @@ void page_file_bootstrap(void);
  */
 pfid page_file_write(const void* src);
 
+/* The most pages written by a single page_file_write_batch */
+#define PF_BATCH_MAX 16
+
+/*
+ * Writes npages pages, each PAGE_SIZE bytes, to consecutive pages on
+ * disk in a single I/O per disk, less the pages the swap cache keeps.
+ * Returns the index of the first page: srcs[i] can be retrieved from the
+ * index plus i.
+ * Returns PF_INVALID if there is no free run of npages pages on disk.
+ */
+pfid page_file_write_batch(const void* const* srcs, unsigned npages);
+
+/*
+ * Writes PAGE_SIZE bytes to page pfid on disk, which is in use already.
+ * Used by the swap cache to spill the pages it holds.
+ * Returns an error code if the data cannot be written.
+ */
+int page_file_write_at(pfid index, const void* src);
+
+/*
+ * Reads PAGE_SIZE bytes from page pfid, from the swap cache or from disk.
+ * Returns an error code if the data cannot be read.
+ */
+int page_file_read(pfid index, void* data);
+
+/*
+ * Reads npages pages, each PAGE_SIZE bytes, from consecutive pages from
+ * first on into dsts, reading the pages the swap cache does not have in a
+ * single I/O per disk. Used for swap-in readahead.
+ * Returns an error code if the data cannot be read.
+ */
+int page_file_read_batch(pfid first, void* const* dsts, unsigned npages);
+
 /*
  * Reads PAGE_SIZE bytes from page pfid on disk.
  * Returns an error code if the data cannot be read.
@@ -52,10 +89,21 @@ pfid page_file_write(const void* src);
  */
 int page_file_read_and_free(pfid index, void* data);
 
+/*
+ * Copies page pfid to a new page on disk.
+ * Returns the index of the copy, or PF_INVALID.
+ */
+pfid page_file_copy(pfid index);
+
 /*
  * Free's the page pfid for future use.
  */
 void page_file_free(pfid index);
 
+/*
+ * Prints page file usage and traffic. Called by the menu.
+ */
+void page_file_printstats(void);
+
 #endif /* _PAGE_FILE_H_ */
 
@@ -33,14 +33,63 @@
 #define PAGE_TABLE_MAX_LOAD_PERCENT 70
 #define PAGE_TABLE_MIN_LOAD_PERCENT 10
 
+/*
+ * Past this load, if growing the hash table keeps failing, inserts fail
+ * rather than fill it up, as a full table could not be probed.
+ */
+#define PAGE_TABLE_HARD_LOAD_PERCENT 90
+
 #define PAGE_TABLE_CAPACITY_MIN 8
 #define PAGE_TABLE_GROWTH_FACTOR 2
 
+/*
+ * The hash table grows or shrinks by moving its mappings to a new array
+ * a few buckets at a time, with each write or remove, so that no single
+ * operation has to rehash them all.
+ */
+#define PAGE_TABLE_MIGRATE_BUCKETS 8
+
 #define VPAGE_INVALID -1
+#define VPAGE_TOMBSTONE -2 /* A mapping moved out of the old array */
 #define PPAGE_INVALID -1
 
+/*
+ * A page table entry holds the physical page a virtual page is resident in,
+ * PPAGE_INVALID if the page was reserved but never touched, or, if the page
+ * was evicted, the index of the page in the page file. The latter is stored
+ * as a negative value below PPAGE_INVALID.
+ */
+#define PPAGE_SWAPPED(pfid)      (-2 - (pfid))
+#define PPAGE_IS_SWAPPED(ppage)  ((ppage) < PPAGE_INVALID)
+#define PPAGE_TO_PFID(ppage)     (-2 - (ppage))
+#define PPAGE_IS_RESIDENT(ppage) ((ppage) >= 0)
+
 #include <types.h>
 
+/*
+ * A page table maps the virtual pages of an address space to page table
+ * entries as above. There are two implementations behind the one
+ * interface, chosen when the table is initialized:
+ *
+ *    PAGE_TABLE_HASH - an open-addressing hash table of (vpage, ppage)
+ *                pairs. Small for sparse address spaces, but it has to
+ *                be rehashed as it grows, and going through a range of
+ *                pages means going through every bucket.
+ *
+ *    PAGE_TABLE_RADIX - a two-level radix tree, like the MIPS page
+ *                tables: a directory of 1024 tables of 1024 entries,
+ *                each table covering 4MB of the address space. Tables
+ *                are allocated on the first write to their range and
+ *                freed once it is empty again. Ranges are walked table
+ *                by table.
+ */
+#define PAGE_TABLE_HASH  0
+#define PAGE_TABLE_RADIX 1
+
+#define PT_RADIX_BITS    10
+#define PT_RADIX_ENTRIES (1 << PT_RADIX_BITS)
+#define PT_VPAGE_LIMIT   (1 << (2 * PT_RADIX_BITS)) /* One past the last vpage */
+
 typedef struct page_mapping {
         vpage_t pm_vpage; /* The virtual page number */
         ppage_t pm_ppage; /* The physical page number */
@@ -49,17 +98,42 @@ typedef struct page_mapping {
 void page_mapping_invalidate(page_mapping* pm);
 bool page_mapping_is_valid(const page_mapping* pm);
 
+struct pt_radix_directory;
+
 typedef struct {
+        unsigned pt_kind;  /* PAGE_TABLE_HASH or PAGE_TABLE_RADIX */
+        unsigned pt_count; /* number of page mappings, not of buckets */
+
+        /*
+         * Of those, how many are resident and how many in the page file,
+         * and the most that were ever resident at once. Kept up to date
+         * by every operation below, including the changes visitors make.
+         */
+        unsigned pt_resident;
+        unsigned pt_swapped;
+        unsigned pt_resident_max;
+
+        /* PAGE_TABLE_HASH */
         page_mapping* pt_mappings;
         unsigned pt_capacity;
-        unsigned pt_count; /* number of page mappings, not of buckets */
 
         /* Is the memory of the pt_mappings array owned? */
         /* If so it must be freed */
         bool pt_owns_mappings;
 
-        /* Is a resize pending? Used to prevent recursive resize loop */
-        bool pt_resize_pending;
+        /*
+         * The array being migrated from, NULL if none. Mappings below
+         * pt_migrate_next have moved to pt_mappings already; pt_count
+         * counts those in both arrays.
+         */
+        page_mapping* pt_old_mappings;
+        unsigned pt_old_capacity;
+        unsigned pt_old_count;
+        bool pt_owns_old_mappings;
+        unsigned pt_migrate_next;
+
+        /* PAGE_TABLE_RADIX: NULL until the first write */
+        struct pt_radix_directory* pt_directory;
 } page_table;
 
 
@@ -72,6 +146,17 @@ void page_table_init_with_capacity(page_table*, unsigned capacity);
 
 void page_table_init(page_table*);
 
+void page_table_init_radix(page_table*);
+
+/*
+ * Initializes a page table of the kind chosen with
+ * page_table_set_default_kind, PAGE_TABLE_HASH to begin with. capacity
+ * is the initial capacity of a hash table. Called by as_create.
+ */
+void page_table_init_default(page_table*, unsigned capacity);
+
+void page_table_set_default_kind(unsigned kind);
+
 page_table* page_table_create_with_capacity(unsigned capacity);
 
 page_table* page_table_create(void);
@@ -90,8 +175,59 @@ bool page_table_contains(const page_table* pt, vpage_t vpage);
 
 ppage_t page_table_read(const page_table* pt, vpage_t vpage);
 
-void page_table_write(page_table* pt, vpage_t vpage, ppage_t ppage);
+/*
+ * Maps vpage to ppage. Fails with ENOMEM if a radix table has to be
+ * allocated for it and there is no kernel memory, or if a hash table is
+ * past PAGE_TABLE_HARD_LOAD_PERCENT and cannot grow. Overwriting a
+ * mapping that exists never fails.
+ */
+int page_table_write(page_table* pt, vpage_t vpage, ppage_t ppage);
 
 void page_table_remove(page_table* pt, vpage_t vpage);
 
+/*
+ * Range operations, on the npages pages from first.
+ *
+ * page_table_iterate calls visit for each mapping in the range, in no
+ * particular order, with a pointer to its entry, which visit may change.
+ * visit must not add or remove mappings. Iteration stops at the first
+ * nonzero value visit returns, which is returned.
+ *
+ * page_table_write_range maps every page in the range to ppage. Like
+ * page_table_write it may fail with ENOMEM, having mapped part of it.
+ * page_table_remove_range removes every mapping in the range.
+ */
+typedef int (*page_table_visitor)(vpage_t vpage, ppage_t* ppage, void* data);
+
+int page_table_iterate(page_table* pt, vpage_t first, unsigned npages,
+                       page_table_visitor visit, void* data);
+
+int page_table_write_range(page_table* pt, vpage_t first, unsigned npages,
+                           ppage_t ppage);
+
+void page_table_remove_range(page_table* pt, vpage_t first, unsigned npages);
+
+/*
+ * The number of resident and swapped pages the table maps, and the most
+ * pages that were ever resident at once.
+ */
+unsigned page_table_resident(const page_table* pt);
+unsigned page_table_swapped(const page_table* pt);
+unsigned page_table_resident_max(const page_table* pt);
+
+/* The number of bytes of memory the page table takes up */
+size_t page_table_footprint(const page_table* pt);
+
+/*
+ * Turns the timing of writes and removes on or off. Off to begin with,
+ * as it reads the clock twice for each. Called by the menu.
+ */
+void page_table_set_timing(bool on);
+
+/*
+ * Prints a histogram of how long writes and removes took while timing
+ * was on, over all page tables. Called by the menu.
+ */
+void page_table_printstats(void);
+
 #endif /* _PAGE_TABLE_H_ */
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2018
+ *	The Trap Handlers!
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _PAGEOUT_H_
+#define _PAGEOUT_H_
+
+#include <types.h>
+
+/*
+ * The pageout daemon is a kernel thread that evicts user pages in the
+ * background. It is woken when the number of free page frames drops
+ * below the low watermark, and evicts pages until it is back above the
+ * high watermark, so that faulting threads rarely find no free frame and
+ * have to wait for a page file write themselves.
+ *
+ * Both watermarks are a fraction of hardware_pages_available().
+ */
+#define PAGEOUT_LOW_WATERMARK_DIVISOR  32  /* 1/32 of memory free */
+#define PAGEOUT_HIGH_WATERMARK_DIVISOR 16  /* 1/16 of memory free */
+#define PAGEOUT_WATERMARK_MIN          8   /* pages, for tiny memories */
+
+/*
+ * Starts the daemon. Called by main once the page file is open.
+ */
+void pageout_bootstrap(void);
+
+/*
+ * Wakes the daemon if nfree, the number of free page frames as counted by
+ * coremap_free_page_count(), is below the low watermark. Called by the
+ * coremap after each claim. Does not sleep, and may be called with
+ * spinlocks held.
+ */
+void pageout_check(size_t nfree);
+
+/*
+ * Tells the daemon that a frame was freed or gained an owner, so that
+ * eviction may succeed again after a round that freed nothing; until
+ * then pageout_check does not wake it. Called by the coremap. Cheap, and
+ * may be called with spinlocks held.
+ */
+void pageout_progress(void);
+
+/*
+ * Returns whether nfree free page frames are comfortably above the high
+ * watermark, so that some may be set aside without waking the daemon.
+ */
+bool pageout_memory_is_plentiful(size_t nfree);
+
+/*
+ * Prints the watermarks and what the daemon has done. Called by the menu.
+ */
+void pageout_printstats(void);
+
+#endif /* _PAGEOUT_H_ */
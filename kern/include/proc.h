@@ -77,6 +77,12 @@ struct proc {
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
 
+	/*
+	 * Set while p_addrspace is borrowed from the parent, by vfork;
+	 * V'd when the child gives it back. See proc_vfork_release.
+	 */
+	struct semaphore *p_vfork_done;
+
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
 
@@ -111,5 +117,19 @@ struct addrspace *proc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *proc_setas(struct addrspace *);
 
+/*
+ * Let the parent of a vfork child run again, now that the child no
+ * longer uses its address space. Called when the child execs, and by
+ * proc_destroy if it never does.
+ */
+void proc_vfork_release(struct proc *proc);
+
+/*
+ * Print the memory footprint of each live user process: its resident and
+ * swapped pages, and the most pages it ever had resident. Called by the
+ * menu.
+ */
+void proc_printstats(void);
+
 
 #endif /* _PROC_H_ */
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2018
+ *	The Trap Handlers!
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SWAP_CACHE_H_
+#define _SWAP_CACHE_H_
+
+#include <types.h>
+#include <page_file.h>
+
+/*
+ * The swap cache keeps evicted pages in memory, compressed, in front of
+ * the page file. page_file_write offers each page to it first, and only
+ * writes the pages it turns down; page_file_read looks in it before going
+ * to disk. Every cached page still has its slot in the page file, which
+ * is where it goes when the cache needs the room: the oldest pages are
+ * spilled to their slots to make way for new ones.
+ *
+ * The cache has a fixed budget of 1/SWAP_CACHE_DIVISOR of memory, set
+ * aside at boot, and divided into blocks of SWAP_CACHE_BLOCK bytes. A
+ * page takes as many blocks as it compresses to. Pages that do not fit
+ * in SWAP_CACHE_MAX_STORED bytes are not worth keeping.
+ */
+#define SWAP_CACHE_DIVISOR    16
+#define SWAP_CACHE_MIN_PAGES  4
+#define SWAP_CACHE_BLOCK      64
+#define SWAP_CACHE_MAX_STORED (PAGE_SIZE - PAGE_SIZE / 4)
+#define SWAP_CACHE_SPILL_MAX  4   /* Pages spilled to make room for one */
+
+/*
+ * The compressor is a byte-oriented LZ77 in the manner of LZ4: runs of
+ * literals and back references of at least 4 bytes into the page, found
+ * through a hash table of the last position each 4 bytes were seen at.
+ *
+ *    swap_cache_compress - compress the PAGE_SIZE bytes at src into dst.
+ *                Returns the compressed size, or 0 if it would take
+ *                more than cap bytes. table is SWAP_CACHE_HASH_SIZE
+ *                entries of scratch space.
+ *
+ *    swap_cache_decompress - expand size bytes at src back into the
+ *                PAGE_SIZE bytes at dst. Returns EINVAL if they are
+ *                not a compressed page.
+ */
+#define SWAP_CACHE_HASH_BITS 10
+#define SWAP_CACHE_HASH_SIZE (1 << SWAP_CACHE_HASH_BITS)
+
+size_t swap_cache_compress(const void *src, void *dst, size_t cap,
+                           uint16_t *table);
+int swap_cache_decompress(const void *src, size_t size, void *dst);
+
+/*
+ * Sets the cache up for a page file of nslots pages. Called by
+ * page_file_bootstrap; without it, the cache turns every page down.
+ */
+void swap_cache_bootstrap(unsigned nslots);
+
+/*
+ * Offers the page at src, bound for page file slot index. Returns true if
+ * the cache keeps it, in which case the slot need not be written. May
+ * write older pages to their slots to make room.
+ */
+bool swap_cache_store(pfid index, const void *src);
+
+/*
+ * Copies the page of slot index into dst if the cache has it, and
+ * returns whether it did. May sleep until a spill of the page is done.
+ */
+bool swap_cache_load(pfid index, void *dst);
+
+/*
+ * Forgets the page of slot index, if the cache has it. Returns false if
+ * the page is being spilled or loaded at the moment; whichever finishes
+ * it frees the slot with page_file_free once it is done.
+ */
+bool swap_cache_drop(pfid index);
+
+/* Turns caching of new pages on or off. Set from the menu */
+void swap_cache_set_enabled(bool enabled);
+
+/*
+ * Prints the cache usage, compression ratio and hit rate. Called by the
+ * menu.
+ */
+void swap_cache_printstats(void);
+
+#endif /* _SWAP_CACHE_H_ */
@@ -80,6 +80,8 @@ int sys_lseek(off_t* retval, int fd, off_t pos, int whence);
 
 int sys_close(int fd);
 
+int sys_fsync(int fd);
+
 int sys_dup2(int* retval, int oldfd, int newfd);
 
 int sys_chdir(const char* pathname);
@@ -95,6 +97,10 @@ int sys_execv(const char *program, char **args);
 
 int sys_fork(pid_t* retval, struct trapframe* trapframe);
 
+int sys_vfork(pid_t* retval, struct trapframe* trapframe);
+
+int sys_spawn(pid_t* retval, const char *program, char **argv);
+
 int sys_getpid(pid_t* retval);
 
 int sys_waitpid(pid_t* retval, pid_t pid, int *status, int options);
@@ -106,5 +112,13 @@ __DEAD void sys__exit(int exitcode);
  */
 int sys_sbrk(int* retval, intptr_t amount);
 
+/*
+ * Memory mapped files (see mmap_syscall.c)
+ */
+int sys_mmap(int* retval, vaddr_t addr, size_t len, int prot, int flags,
+             int fd, off_t offset);
+
+int sys_munmap(vaddr_t addr, size_t len);
+
 
 #endif /* _SYSCALL_H_ */
@@ -72,6 +72,8 @@ int mallocstress(int, char **);
 int malloctest3(int, char **);
 int malloctest4(int, char **);
 int nettest(int, char **);
+int ptbench(int, char **);
+int swapcachebench(int, char **);
 
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
@@ -163,6 +163,13 @@ __DEAD void thread_exit_destroy_proc(void);
  */
 void thread_yield(void);
 
+/*
+ * Return true if other threads are waiting to run on this cpu. Only a
+ * hint, as that may change as soon as it returns; used by background
+ * threads to give way to everything else.
+ */
+bool thread_others_ready(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
@@ -59,6 +59,81 @@ void free_kpages(vaddr_t addr);
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+struct addrspace;
+
+/*
+ * Invalidate the npages pages at vaddrs of as in every TLB, waiting for
+ * the other cpus to finish. Only the cpus that have as loaded are
+ * interrupted, once each for the whole batch; elsewhere its ASID is
+ * dropped instead. Call with as->as_lock held.
+ */
+void vm_tlbshootdown_pages(struct addrspace *as, const vaddr_t *vaddrs,
+                           unsigned npages);
+
+/*
+ * Make as the address space the TLB translates for on this cpu. Its
+ * entries are tagged with an ASID, so those of other address spaces need
+ * not be flushed. Called by as_activate.
+ */
+void vm_activate(struct addrspace *as);
+
+/*
+ * Drop every TLB entry of as, on every cpu, waiting for the other cpus to
+ * finish. Like vm_tlbshootdown_pages, the cpus that have as loaded are
+ * interrupted, and flush their whole TLB; elsewhere its ASID is dropped.
+ * On this cpu it takes a new ASID. Call with as->as_lock held.
+ */
+void vm_tlbshootdown_as(struct addrspace *as);
+
+/*
+ * Forget that any cpu has as loaded. Called by as_destroy, after which
+ * no cpu may activate it again.
+ */
+void vm_forget(struct addrspace *as);
+
+/*
+ * Fault-around: on a TLB miss, entries are also loaded for the resident
+ * pages in the aligned window of this many pages around the missing one.
+ * The window is a power of two; 1 turns fault-around off.
+ */
+#define VM_FAULTAROUND_WINDOW 4
+#define VM_FAULTAROUND_MAX    16
+
+/*
+ * Swap-in readahead: a swap-in right after the pages read ahead at the
+ * last one also reads in the swapped pages that follow it in the same
+ * page file cluster. The window starts at VM_READAHEAD_MIN pages, doubles
+ * while every page read ahead gets used, and halves when some do not.
+ */
+#define VM_READAHEAD_MIN 2
+#define VM_READAHEAD_MAX 8  /* Less than PF_BATCH_MAX */
+
+/*
+ * The user stack starts out STACKPAGES long and grows down: a fault in
+ * the VM_STACK_REACH pages below its bottom extends it to the faulting
+ * page, see as_grow_stack. It may grow as far as the stack limit, which
+ * each process gets when it execs, and nothing else is placed in the
+ * VM_STACK_GUARD pages below that, so a stack that overflows faults
+ * instead of running into the heap or a mapping.
+ */
+#define VM_STACK_LIMIT     256   /* pages, 1MB */
+#define VM_STACK_LIMIT_MAX 8192  /* 32MB */
+#define VM_STACK_REACH     16
+#define VM_STACK_GUARD     16
+
+/* Set the fault-around window. Returns EINVAL for a bad size. */
+int vm_set_faultaround(unsigned pages);
+
+/*
+ * Set the stack limit, in pages, of the processes that exec from now on.
+ * Returns EINVAL for a bad size.
+ */
+int vm_set_stack_limit(unsigned pages);
+unsigned vm_get_stack_limit(void);
+
+/* Print TLB refill and shootdown statistics. Called by the menu */
+void vm_printstats(void);
+
 page_t
 addr_to_page(unsigned addr);
 
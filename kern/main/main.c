@@ -51,6 +51,7 @@
 #include <test.h>
 #include <version.h>
 #include <coremap.h>
+#include <pageout.h>
 #include "autoconf.h"  // for pseudoconfig
 
 
@@ -137,6 +138,8 @@ boot(void)
 	kheap_nextgeneration();
 
         page_file_bootstrap();
+        pageout_bootstrap();
+        coremap_prezero_bootstrap();
 	/*
 	 * Make sure various things aren't screwed up.
 	 */
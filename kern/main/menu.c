@@ -41,6 +41,12 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <coremap.h>
+#include <page_file.h>
+#include <swap_cache.h>
+#include <pageout.h>
+#include <vm.h>
+#include <page_table.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
@@ -415,6 +421,152 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	if (nargs == 3 && !strcmp(args[1], "timing") &&
+	    !strcmp(args[2], "on")) {
+		coremap_set_zero_timing(true);
+	}
+	else if (nargs == 3 && !strcmp(args[1], "timing") &&
+		 !strcmp(args[2], "off")) {
+		coremap_set_zero_timing(false);
+	}
+	else if (nargs == 1) {
+		coremap_printstats();
+		page_file_printstats();
+		swap_cache_printstats();
+	}
+	else {
+		kprintf("Usage: cm [timing on|off]\n");
+		return EINVAL;
+	}
+	return 0;
+}
+
+static
+int
+cmd_tlbstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	if (nargs != 2) {
+		kprintf("Usage: fa pages\n");
+		return EINVAL;
+	}
+
+	int result = vm_set_faultaround(atoi(args[1]));
+	if (result) {
+		kprintf("fa: window must be a power of two up to %d pages\n",
+			VM_FAULTAROUND_MAX);
+	}
+	return result;
+}
+
+static
+int
+cmd_stacklimit(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("Stack limit: %u pages\n", vm_get_stack_limit());
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: stack [pages]\n");
+		return EINVAL;
+	}
+
+	int result = vm_set_stack_limit(atoi(args[1]));
+	if (result) {
+		kprintf("stack: limit must be %d to %d pages\n",
+			STACKPAGES, VM_STACK_LIMIT_MAX);
+	}
+	return result;
+}
+
+static
+int
+cmd_pagetablekind(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "hash")) {
+		page_table_set_default_kind(PAGE_TABLE_HASH);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "radix")) {
+		page_table_set_default_kind(PAGE_TABLE_RADIX);
+	}
+	else if (nargs == 3 && !strcmp(args[1], "timing") &&
+		 !strcmp(args[2], "on")) {
+		page_table_set_timing(true);
+	}
+	else if (nargs == 3 && !strcmp(args[1], "timing") &&
+		 !strcmp(args[2], "off")) {
+		page_table_set_timing(false);
+	}
+	else if (nargs == 1) {
+		page_table_printstats();
+	}
+	else {
+		kprintf("Usage: pt [hash|radix|timing on|off]\n");
+		return EINVAL;
+	}
+	return 0;
+}
+
+static
+int
+cmd_swapcache(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		swap_cache_set_enabled(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		swap_cache_set_enabled(false);
+	}
+	else if (nargs == 1) {
+		swap_cache_printstats();
+	}
+	else {
+		kprintf("Usage: zc [on|off]\n");
+		return EINVAL;
+	}
+	return 0;
+}
+
+static
+int
+cmd_procstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	proc_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_pageoutstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	pageout_printstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -494,6 +646,8 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+	"[ptb] Page table benchmark          ",
+	"[zcb] Swap cache compressor bench   ",
 	NULL
 };
 
@@ -521,6 +675,14 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[cm] Coremap stats                  ",
+	"[po] Pageout daemon stats           ",
+	"[tlb] TLB stats                     ",
+	"[fa] Set fault-around window        ",
+	"[stack] Stack limit for new programs",
+	"[pt] Page table stats/kind          ",
+	"[ps] Process memory stats           ",
+	"[zc] Swap cache stats/on/off        ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -575,6 +737,14 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "cm",         cmd_coremapstats },
+	{ "po",         cmd_pageoutstats },
+	{ "tlb",        cmd_tlbstats },
+	{ "fa",         cmd_faultaround },
+	{ "stack",      cmd_stacklimit },
+	{ "pt",         cmd_pagetablekind },
+	{ "ps",         cmd_procstats },
+	{ "zc",         cmd_swapcache },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -604,6 +774,8 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
+	{ "ptb",	ptbench },
+	{ "zcb",	swapcachebench },
 
 	{ NULL, NULL }
 };
@@ -52,12 +52,20 @@
 #include <vfs.h>
 #include <kern/unistd.h>
 #include <kern/fcntl.h>
+#include <page_table.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/*
+ * Every process by pid, from proc_create to proc_destroy, so that
+ * proc_printstats can find them. The pid table only knows pids.
+ */
+static struct proc *proc_registry[__PID_MAX];
+static struct spinlock proc_registry_lock = SPINLOCK_INITIALIZER;
+
 /*
  * Create and return an entry in a proccesses file table with a NULL vnode, and
  * 0 for open_flags, offset, and refcount.
@@ -171,6 +179,7 @@ proc_create(const char *name, pid_t pid)
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
+	proc->p_vfork_done = NULL;
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
@@ -184,6 +193,11 @@ proc_create(const char *name, pid_t pid)
         KASSERT(proc_table_entry_exists(pid));
         proc->p_pid = pid;
 
+        spinlock_acquire(&proc_registry_lock);
+        KASSERT(proc_registry[pid] == NULL);
+        proc_registry[pid] = proc;
+        spinlock_release(&proc_registry_lock);
+
 	return proc;
 }
 
@@ -207,6 +221,11 @@ proc_destroy(struct proc *proc)
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
 
+        /* Out of sight of proc_printstats before anything goes away */
+        spinlock_acquire(&proc_registry_lock);
+        proc_registry[proc->p_pid] = NULL;
+        spinlock_release(&proc_registry_lock);
+
 	/*
 	 * We don't take p_lock in here because we must have the only
 	 * reference to this structure. (Otherwise it would be
@@ -227,6 +246,17 @@ proc_destroy(struct proc *proc)
         }
 
 	/* VM fields */
+	if (proc->p_vfork_done != NULL) {
+		/* Borrowed from the parent: give it back, not destroy it */
+		if (proc == curproc) {
+			proc_setas(NULL);
+			as_deactivate();
+		}
+		else {
+			proc->p_addrspace = NULL;
+		}
+		proc_vfork_release(proc);
+	}
 	if (proc->p_addrspace) {
 		/*
 		 * If p is the current process, remove it safely from
@@ -316,6 +346,7 @@ proc_create_runprogram(const char *name)
 	/* VM fields */
 
 	newproc->p_addrspace = NULL;
+	newproc->p_vfork_done = NULL;
 
 	/* VFS fields */
 
@@ -453,3 +484,68 @@ proc_setas(struct addrspace *newas)
 	spinlock_release(&proc->p_lock);
 	return oldas;
 }
+
+void
+proc_vfork_release(struct proc *proc)
+{
+	struct semaphore *done = proc->p_vfork_done;
+
+	KASSERT(done != NULL);
+
+	/* The parent destroys the semaphore once it wakes up */
+	proc->p_vfork_done = NULL;
+	V(done);
+}
+
+void
+proc_printstats(void)
+{
+        unsigned nprocs = 0;
+        unsigned total_resident = 0, total_swapped = 0;
+
+        kprintf("  pid  resident   swapped      peak  name\n");
+
+        for (pid_t pid = 0; pid < __PID_MAX; ++pid) {
+                char name[32];
+                unsigned resident, swapped, peak;
+
+                /*
+                 * Holding p_lock keeps the address space from being
+                 * swapped out from under us by execv, which destroys
+                 * the old one only after proc_setas.
+                 */
+                spinlock_acquire(&proc_registry_lock);
+                struct proc *proc = proc_registry[pid];
+                if (proc == NULL || proc == kproc) {
+                        spinlock_release(&proc_registry_lock);
+                        continue;
+                }
+                spinlock_acquire(&proc->p_lock);
+                const struct addrspace *as = proc->p_addrspace;
+#if OPT_DUMBVM
+                (void)as;
+                resident = swapped = peak = 0;
+#else
+                if (as == NULL) {
+                        resident = swapped = peak = 0;
+                }
+                else {
+                        resident = page_table_resident(&as->as_page_table);
+                        swapped = page_table_swapped(&as->as_page_table);
+                        peak = page_table_resident_max(&as->as_page_table);
+                }
+#endif
+                snprintf(name, sizeof(name), "%s", proc->p_name);
+                spinlock_release(&proc->p_lock);
+                spinlock_release(&proc_registry_lock);
+
+                kprintf("%5d %9u %9u %9u  %s\n", pid, resident, swapped,
+                        peak, name);
+                nprocs += 1;
+                total_resident += resident;
+                total_swapped += swapped;
+        }
+
+        kprintf("%u processes, %u pages resident, %u swapped\n", nprocs,
+                total_resident, total_swapped);
+}
@@ -12,6 +12,7 @@
 #include <vnode.h>
 #include <vfs.h>
 #include <stat.h>
+#include <addrspace.h>
 
 #include <kern/errno.h>
 #include <kern/fcntl.h>
@@ -319,6 +320,38 @@ sys_close(int fd)
         return 0;
 }
 
+/*
+ * sys_fsync:
+ *     writes the dirty pages of our MAP_SHARED mappings of the file back to
+ *     it, then forces the file's dirty buffers out to the disk.
+ */
+int
+sys_fsync(int fd)
+{
+	/*
+	 * Possible Errors
+	 *   +	EBADF	fd is not a valid file handle.
+	 *   +	EIO	A hard I/O error occurred.
+	 */
+
+        if (fd < 0 || __OPEN_MAX <= fd) {
+                return EBADF;
+        }
+        struct file_table_entry** file_table = curproc->p_file_table;
+        if (file_table[fd] == NULL) {
+                return EBADF;
+        }
+        struct vnode* file = file_table[fd]->vnode;
+
+#if !OPT_DUMBVM
+        const int error = as_sync_file(proc_getas(), file);
+        if (error) {
+                return error;
+        }
+#endif
+        return VOP_FSYNC(file);
+}
+
 
 /* dup2 clones the file handle oldfd onto the file handle newfd.
    If newfd names an already-open file, that file is closed */
@@ -42,8 +42,9 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Without DUMBVM, segments are not read here at all. load_segment only
+ * records where each one lives in the file and the VM system reads its
+ * pages in on demand.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -72,7 +73,7 @@
  * Note that uiomove will catch it if someone tries to load an
  * executable whose load address is in kernel space. If you should
  * change this code to not use uiomove, be sure to check for this case
- * explicitly.
+ * explicitly. (as_define_segment does.)
  */
 static
 int
@@ -93,6 +94,19 @@ load_segment(struct addrspace *as, struct vnode *v,
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
+#if !OPT_DUMBVM
+	/*
+	 * Pages are loaded on demand: only record where the segment
+	 * lives in the file. vm_fault reads each page in when it is
+	 * first touched, and zero-fills the part past FILESIZE.
+	 */
+	(void)iov;
+	(void)u;
+	(void)result;
+	return as_define_segment(as, v, offset, vaddr, memsize, filesize,
+				 is_executable);
+#else
+
 	iov.iov_ubase = (userptr_t)vaddr;
 	iov.iov_len = memsize;		 // length of the memory space
 	u.uio_iov = &iov;
@@ -143,6 +157,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 #endif
 
 	return result;
+#endif /* OPT_DUMBVM */
 }
 
 /*
@@ -0,0 +1,138 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <syscall.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <limits.h>
+#include <vnode.h>
+
+/*
+ * See manpages at http://ece.ubc.ca/~os161/man/syscall/ for the calls these
+ * follow. Mappings are regions of the address space, see as_map_file: their
+ * pages are read from the file when first touched, and MAP_SHARED pages are
+ * written back when they are evicted, unmapped, or fsync'd. There is no page
+ * cache, so two processes that map the same file only see each other's writes
+ * once they have been written back; pages that were resident at a fork stay
+ * shared between parent and child. Anonymous mappings are zero-filled like
+ * the heap, see as_map_anon, but unlike the heap they can be given back in
+ * any order.
+ */
+
+/*
+ * sys_mmap:
+ *     maps len bytes of the file open as fd, from offset on, at an address the
+ *     kernel picks; addr is only a hint, and is ignored. Returns the address.
+ *     With MAP_ANON, maps len bytes of zeros instead, and ignores fd and
+ *     offset; those must be MAP_PRIVATE.
+ *
+ *     Errors: EBADF, fd is not open.
+ *             EACCES, fd is not open for reading, or prot has PROT_WRITE and
+ *                     flags has MAP_SHARED but fd is not open for writing.
+ *             EINVAL, len is 0, offset is not page aligned, flags does not
+ *                     have exactly one of MAP_SHARED and MAP_PRIVATE, or has
+ *                     MAP_SHARED with MAP_ANON.
+ *             ENODEV, the file cannot be mapped, see VOP_MMAP.
+ *             ENOMEM, there is no room for the mapping.
+ */
+int
+sys_mmap(int* retval, vaddr_t addr, size_t len, int prot, int flags,
+         int fd, off_t offset)
+{
+#if OPT_DUMBVM
+        (void)retval;
+        (void)addr;
+        (void)len;
+        (void)prot;
+        (void)flags;
+        (void)fd;
+        (void)offset;
+        return ENOSYS;
+#else
+        (void)addr;
+
+        const int type = flags & MAP_TYPE;
+        if (len == 0 || (type != MAP_SHARED && type != MAP_PRIVATE) ||
+            (flags & ~(MAP_TYPE | MAP_ANON)) != 0 ||
+            (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+                return EINVAL;
+        }
+
+        /* PROT_NONE leaves the region in place, but every access faults */
+        const unsigned perms = ((prot & PROT_READ) ? AS_REGION_READ : 0) |
+                ((prot & PROT_WRITE) ? AS_REGION_WRITE | AS_REGION_READ : 0) |
+                ((prot & PROT_EXEC) ? AS_REGION_EXEC | AS_REGION_READ : 0);
+
+        vaddr_t start;
+        int result;
+
+        if (flags & MAP_ANON) {
+                /* Sharing would need frames shared between processes, not copied on write */
+                if (type == MAP_SHARED) {
+                        return EINVAL;
+                }
+                result = as_map_anon(proc_getas(), len, perms, &start);
+                if (result) {
+                        return result;
+                }
+                *retval = start;
+                return 0;
+        }
+
+        if (offset < 0 || offset % PAGE_SIZE != 0) {
+                return EINVAL;
+        }
+        if (fd < 0 || fd >= __OPEN_MAX || curproc->p_file_table[fd] == NULL) {
+                return EBADF;
+        }
+        struct file_table_entry* fte = curproc->p_file_table[fd];
+
+        /* Pages are read from the file even if they are only written */
+        const int accmode = fte->open_flags & O_ACCMODE;
+        if (accmode == O_WRONLY) {
+                return EACCES;
+        }
+        if (type == MAP_SHARED && (prot & PROT_WRITE) && accmode == O_RDONLY) {
+                return EACCES;
+        }
+
+        result = VOP_MMAP(fte->vnode, prot);
+        if (result) {
+                return result;
+        }
+
+        result = as_map_file(proc_getas(), len, perms, fte->vnode, offset,
+                             type == MAP_SHARED, &start);
+        if (result) {
+                return result;
+        }
+
+        *retval = start;
+        return 0;
+#endif
+}
+
+/*
+ * sys_munmap:
+ *     removes the mappings in the pages from addr to addr + len, writing back
+ *     the dirty pages of MAP_SHARED mappings first. Pages that are not mapped
+ *     are skipped.
+ *
+ *     Errors: EINVAL, addr is not page aligned, len is 0, or the range is
+ *                     not in user space or touches memory that mmap did not
+ *                     map.
+ */
+int
+sys_munmap(vaddr_t addr, size_t len)
+{
+#if OPT_DUMBVM
+        (void)addr;
+        (void)len;
+        return ENOSYS;
+#else
+        return as_unmap(proc_getas(), addr, len);
+#endif
+}
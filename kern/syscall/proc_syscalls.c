@@ -40,49 +40,54 @@ enter_forked_process_wrapper(void* data1, unsigned long data2) {
         enter_forked_process((struct trapframe*)data1);
 }
 
-/* ------------------------------------------------------------------------- */
-/* System calls */
-int sys_execv(const char *program, char **argv) {
+/* Where a spawned process starts in user mode, see sys_spawn */
+struct spawn_start {
+        int ss_argc;
+        vaddr_t ss_stackptr;
+        vaddr_t ss_entrypoint;
+};
 
-        /*
-         * Possible Errors:
-         * ENODEV       The device prefix of program did not exist.
-         * ENOTDIR      A non-final component of program was not a directory.
-         * ENOENT       program did not exist.
-         * EISDIR       program is a directory.
-         * ENOEXEC      program is not in a recognizable executable file format, was for the wrong platform, or contained invalid fields.
-         * ENOMEM       Insufficient virtual memory is available.
-         * E2BIG        The total size of the argument strings exceeeds ARG_MAX.
-         * EIO          A hard I/O error occurred.
-         * EFAULT       One of the arguments is an invalid pointer.
-         */
+static
+void
+enter_spawned_process_wrapper(void* data1, unsigned long data2) {
+        (void)data2;
 
-        int err = 0;
+        struct spawn_start start = *(struct spawn_start*)data1;
+        kfree(data1);
 
+        as_activate();
 
-        struct addrspace * old_as = proc_getas();
-        struct addrspace * new_as = NULL; /* null for now */
-        /* DUMBVIM, this does nothing */
-        as_deactivate();
+        enter_new_process(start.ss_argc, (userptr_t) start.ss_stackptr /*userspace addr of argv*/,
+                        NULL /*userspace addr of environment*/,
+                        start.ss_stackptr, start.ss_entrypoint);
+}
 
-        /* ---------------------------------------------------------------- */
+/* ------------------------------------------------------------------------- */
+/* Helpers */
 
-        /*
-         * Copy arguments (argv) into a kernel buffer, kargv, and program
-         * name into kprogram
-         */
+/*
+ * Copies the program name and argv of execv or spawn into the kernel. On
+ * success the caller frees them with exec_free_args.
+ */
+static
+int
+exec_copyin_args(const char *program, char **argv,
+                 char **kprogram_ret, char ***kargv_ret, size_t *kargv_size_ret) {
 
         size_t kargv_size;
         char ** kargv;
-        err = copyinstr_array((userptr_t) argv, &kargv, &kargv_size, ARG_MAX);
+        int err = copyinstr_array((userptr_t) argv, &kargv, &kargv_size, ARG_MAX);
         if (err) {
                 /* no need deallocate kargv on copyinstr_array err  */
-                as_activate();
                 return err;
         }
 
         size_t got;
         char * kprogram = kmalloc(NAME_MAX);
+        if (kprogram == NULL) {
+                err = ENOMEM;
+                goto err;
+        }
         err = copyinstr((const_userptr_t)program, kprogram, NAME_MAX, &got);
         if (err) {
                 goto err;
@@ -94,23 +99,38 @@ int sys_execv(const char *program, char **argv) {
                 goto err;
         }
 
-        /*
-         * Create new address space
-         */
+        *kprogram_ret = kprogram;
+        *kargv_ret = kargv;
+        *kargv_size_ret = kargv_size;
+        return 0;
 
-        new_as = as_create();
-        if (new_as == NULL) {
-                err = ENOMEM;
-                goto err;
-        }
+err:
+        kfree(kargv[1]);
+        kfree(kargv);
+        kfree(kprogram);
+        return err;
+}
 
-        /*
-         * Switch to new address space
-         */
+static
+void
+exec_free_args(char *kprogram, char **kargv) {
+        kfree(kargv[1]);
+        kfree(kargv);
+        kfree(kprogram);
+}
 
-        /* as_activate invalidates tlb indexes */
-        as_activate();
-        proc_setas(new_as);
+/*
+ * Loads kprogram into the address space as, which must be the current
+ * one, defines its stack and copies kargv onto it. Hands back where the
+ * program starts and its initial stack pointer, which is also the user
+ * address of its argv.
+ */
+static
+int
+exec_load(struct addrspace *as, char *kprogram, char **kargv, size_t kargv_size,
+          vaddr_t *entrypoint, vaddr_t *stackptr) {
+
+        KASSERT(proc_getas() == as);
 
         /*
          * Load new executable
@@ -118,30 +138,28 @@ int sys_execv(const char *program, char **argv) {
 
         /* Open the file. */
         struct vnode * v;
-        err = vfs_open(kprogram, O_RDONLY, 0, &v);
+        int err = vfs_open(kprogram, O_RDONLY, 0, &v);
         if (err) {
-                goto err;
+                return err;
         }
 
-        vaddr_t entrypoint;
-        err = load_elf(v, &entrypoint);
-        if (err) {
-                vfs_close(v);
-                goto err;
-        }
+        err = load_elf(v, entrypoint);
 
         /* done with file */
         vfs_close(v);
 
+        if (err) {
+                return err;
+        }
+
         /*
          * Define new stack region
          */
 
         /* Define the user stack in the new address space */
-        vaddr_t stackptr;
-        err = as_define_stack(new_as, &stackptr);
+        err = as_define_stack(as, stackptr);
         if (err) {
-                goto err;
+                return err;
         }
 
         /*
@@ -149,55 +167,39 @@ int sys_execv(const char *program, char **argv) {
          */
 
         KASSERT(kargv_size % 4 == 0);
-        stackptr -= kargv_size;
-        stackptr += 4;  /* user dosen't need the argc count in kargv[0] */
+        *stackptr -= kargv_size;
+        *stackptr += 4;  /* user dosen't need the argc count in kargv[0] */
 
         /* copyoutstr_array handles copying as well as fixing the string
         address pointers for us. */
-        err = copyoutstr_array( (const char**) kargv, (userptr_t) stackptr, kargv_size);
-        if (err) {
-                goto err;
-        }
-
-        /*
-         * Clean up old address space
-         */
-
-        as_destroy(old_as); /* the point of no return...  */
-
-        /*
-         * Warp to user mode
-         */
-
-        int argc = ((int) kargv[0]);
-
-        /* clean up before doing so */
-        kfree(kargv[1]);
-        kfree(kargv);
-        kfree(kprogram);
-
-        enter_new_process(argc, (userptr_t) stackptr /*userspace addr of argv*/,
-                        NULL /*userspace addr of environment*/,
-                        stackptr, entrypoint);
-
-        /* enter_new_process does not return. */
-        panic("enter_new_process returned\n");
-        return EINVAL;
-
-err:
-        kfree(kargv[1]);
-        kfree(kargv);
-        kfree(kprogram);
+        return copyoutstr_array( (const char**) kargv, (userptr_t) *stackptr, kargv_size);
+}
 
-        /* clean up address space */
-        proc_setas(old_as);
-        as_destroy(new_as); /* DUMBVM handles the case where new_as is NULL */
-        as_activate();
-        return err;
+/*
+ * Called by start_child when the child cannot be created after its pid
+ * was reserved. The pid is marked as exited, so that it is reaped along
+ * with the parent's other children.
+ */
+static
+void
+fork_abandon_child(pid_t child_pid) {
+        pid_lock_acquire(child_pid);
+        proc_exit(child_pid, 0);
+        pid_lock_release(child_pid);
 }
 
+/*
+ * Creates a child of the current process for fork, vfork or spawn, with
+ * the address space as, a copy of the file table and the same cwd, and
+ * starts its thread in entry with data. If vfork_done is set, as is
+ * borrowed from us until the child execs or exits, see proc_vfork_release;
+ * otherwise it is the child's. Hands back the child's pid. On error, as
+ * and data are still the caller's.
+ */
+static
 int
-sys_fork(pid_t* retval, struct trapframe* trapframe) {
+start_child(const char *name, struct addrspace *as, struct semaphore *vfork_done,
+            void (*entry)(void *, unsigned long), void *data, pid_t *retval) {
 
         /* Possible Errors:
          * EMPROC  The current user already has too many processes.
@@ -231,10 +233,15 @@ sys_fork(pid_t* retval, struct trapframe* trapframe) {
         DEBUG(DB_PROC_TABLE, "fork %d -> %d\n", curpid, child_pid);
 
         /* Create child process with proc_create */
-        struct proc* child_proc = proc_create(curproc->p_name, child_pid);
+        struct proc* child_proc = proc_create(name, child_pid);
+        if (child_proc == NULL) {
+                fork_abandon_child(child_pid);
+                pid_lock_release(curpid);
+                return ENOMEM;
+        }
 
-        /* Copy the address space */
-        as_copy(curproc->p_addrspace, &child_proc->p_addrspace);
+        child_proc->p_addrspace = as;
+        child_proc->p_vfork_done = vfork_done;
 
         /* Copy the file table */
         file_table_copy(&curproc->p_file_table, &child_proc->p_file_table);
@@ -247,18 +254,243 @@ sys_fork(pid_t* retval, struct trapframe* trapframe) {
 
         /* TODO: Copy threads */
 
-        /* TODO: Create kernel thread */
+        const int result = thread_fork(name, child_proc, entry, data, 0);
+        if (result) {
+                /* Leave the address space to the caller */
+                child_proc->p_addrspace = NULL;
+                child_proc->p_vfork_done = NULL;
+                proc_destroy(child_proc);
+                fork_abandon_child(child_pid);
+                pid_lock_release(curpid);
+                return result;
+        }
+
+        *retval = child_pid;
+
+        pid_lock_release(curpid);
+
+        return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* System calls */
+int sys_execv(const char *program, char **argv) {
+
+        /*
+         * Possible Errors:
+         * ENODEV       The device prefix of program did not exist.
+         * ENOTDIR      A non-final component of program was not a directory.
+         * ENOENT       program did not exist.
+         * EISDIR       program is a directory.
+         * ENOEXEC      program is not in a recognizable executable file format, was for the wrong platform, or contained invalid fields.
+         * ENOMEM       Insufficient virtual memory is available.
+         * E2BIG        The total size of the argument strings exceeeds ARG_MAX.
+         * EIO          A hard I/O error occurred.
+         * EFAULT       One of the arguments is an invalid pointer.
+         */
+
+        int err = 0;
+
+
+        struct addrspace * old_as = proc_getas();
+        struct addrspace * new_as = NULL; /* null for now */
+        /* DUMBVIM, this does nothing */
+        as_deactivate();
+
+        /* ---------------------------------------------------------------- */
+
+        /*
+         * Copy arguments (argv) into a kernel buffer, kargv, and program
+         * name into kprogram
+         */
+
+        size_t kargv_size;
+        char ** kargv;
+        char * kprogram;
+        err = exec_copyin_args(program, argv, &kprogram, &kargv, &kargv_size);
+        if (err) {
+                as_activate();
+                return err;
+        }
+
+        /*
+         * Create new address space
+         */
+
+        new_as = as_create();
+        if (new_as == NULL) {
+                err = ENOMEM;
+                goto err;
+        }
+
+        /*
+         * Switch to new address space
+         */
+
+        /*
+         * The new address space has its own TLB ASID, so none of the old
+         * one's entries can be matched once it is activated
+         */
+        proc_setas(new_as);
+        as_activate();
+
+        vaddr_t entrypoint, stackptr;
+        err = exec_load(new_as, kprogram, kargv, kargv_size, &entrypoint, &stackptr);
+        if (err) {
+                goto err;
+        }
+
+        /*
+         * Clean up old address space
+         */
+
+        if (curproc->p_vfork_done != NULL) {
+                /* It was our parent's, which can run again */
+                proc_vfork_release(curproc);
+        }
+        else {
+                as_destroy(old_as); /* the point of no return...  */
+        }
+
+        /*
+         * Warp to user mode
+         */
+
+        int argc = ((int) kargv[0]);
+
+        /* clean up before doing so */
+        exec_free_args(kprogram, kargv);
+
+        enter_new_process(argc, (userptr_t) stackptr /*userspace addr of argv*/,
+                        NULL /*userspace addr of environment*/,
+                        stackptr, entrypoint);
+
+        /* enter_new_process does not return. */
+        panic("enter_new_process returned\n");
+        return EINVAL;
+
+err:
+        exec_free_args(kprogram, kargv);
+
+        /* clean up address space */
+        proc_setas(old_as);
+        as_destroy(new_as); /* DUMBVM handles the case where new_as is NULL */
+        as_activate();
+        return err;
+}
+
+int
+sys_spawn(pid_t* retval, const char *program, char **argv) {
+
+        /*
+         * Possible Errors: those of execv, and those of fork.
+         *
+         * Like fork followed by execv in the child, but the program is
+         * loaded into a new address space directly, so ours is never
+         * copied. It is loaded while we borrow it, so that the arguments
+         * can be copied out onto its stack, which only takes this thread.
+         */
+
+        size_t kargv_size;
+        char ** kargv;
+        char * kprogram;
+        int err = exec_copyin_args(program, argv, &kprogram, &kargv, &kargv_size);
+        if (err) {
+                return err;
+        }
+
+        struct spawn_start* start = kmalloc(sizeof(struct spawn_start));
+        struct addrspace * new_as = as_create();
+        if (start == NULL || new_as == NULL) {
+                kfree(start);
+                as_destroy(new_as);
+                exec_free_args(kprogram, kargv);
+                return ENOMEM;
+        }
+
+        struct addrspace * old_as = proc_setas(new_as);
+        as_activate();
+
+        err = exec_load(new_as, kprogram, kargv, kargv_size,
+                        &start->ss_entrypoint, &start->ss_stackptr);
+        start->ss_argc = (int) kargv[0];
+
+        proc_setas(old_as);
+        as_activate();
+
+        if (err == 0) {
+                err = start_child(kprogram, new_as, NULL,
+                                  &enter_spawned_process_wrapper, start, retval);
+        }
+
+        exec_free_args(kprogram, kargv);
+        if (err) {
+                kfree(start);
+                as_destroy(new_as);
+        }
+        return err;
+}
+
+int
+sys_fork(pid_t* retval, struct trapframe* trapframe) {
+
+        /* Copy the address space */
+        struct addrspace* child_as;
+        int result = as_copy(curproc->p_addrspace, &child_as);
+        if (result) {
+                return result;
+        }
 
         /* Create a copy of the trapframe for the child */
         struct trapframe* tf_copy = kmalloc(sizeof(struct trapframe));
+        if (tf_copy == NULL) {
+                as_destroy(child_as);
+                return ENOMEM;
+        }
         memcpy(tf_copy, trapframe, sizeof(struct trapframe));
 
         /* Fork the child process */
-        thread_fork("child", child_proc, &enter_forked_process_wrapper, tf_copy, 0);
+        result = start_child(curproc->p_name, child_as, NULL,
+                             &enter_forked_process_wrapper, tf_copy, retval);
+        if (result) {
+                kfree(tf_copy);
+                as_destroy(child_as);
+        }
+        return result;
+}
 
-        *retval = child_proc->p_pid;
+int
+sys_vfork(pid_t* retval, struct trapframe* trapframe) {
 
-        pid_lock_release(curpid);
+        /*
+         * Like fork, but the child runs in our address space, and we
+         * sleep until it execs or exits. The child must do nothing else:
+         * it runs on our user stack, and whatever it writes we see.
+         */
+
+        struct semaphore* done = sem_create("vfork", 0);
+        if (done == NULL) {
+                return ENOMEM;
+        }
+
+        struct trapframe* tf_copy = kmalloc(sizeof(struct trapframe));
+        if (tf_copy == NULL) {
+                sem_destroy(done);
+                return ENOMEM;
+        }
+        memcpy(tf_copy, trapframe, sizeof(struct trapframe));
+
+        const int result = start_child(curproc->p_name, curproc->p_addrspace, done,
+                                       &enter_forked_process_wrapper, tf_copy, retval);
+        if (result) {
+                kfree(tf_copy);
+                sem_destroy(done);
+                return result;
+        }
+
+        /* Our address space is the child's until it gives it back */
+        P(done);
+        sem_destroy(done);
 
         return 0;
 }
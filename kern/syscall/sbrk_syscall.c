@@ -7,6 +7,11 @@
 #include <limits.h>
 #include <kern/errno.h>
 #include <page_table.h>
+#include <synch.h>
+
+#if !OPT_DUMBVM
+static int sbrk_locked(struct addrspace* as, int* retval, intptr_t amount);
+#endif
 
 /*
 * Retval is a pointer to the new ending of the user heap region.
@@ -27,46 +32,57 @@ int sys_sbrk(int* retval, intptr_t amount) {
 
 	struct addrspace* as = proc_getas();
 
+        lock_acquire(as->as_lock);
+        const int result = sbrk_locked(as, retval, amount);
+        lock_release(as->as_lock);
+
+        return result;
+#endif
+}
+
+#if !OPT_DUMBVM
+/*
+ * The body of sys_sbrk, called with the address space lock held.
+ */
+static
+int
+sbrk_locked(struct addrspace* as, int* retval, intptr_t amount) {
 
         /* Check proper amount given  */
         if ( amount % PAGE_SIZE != 0 || as->as_heap_end + amount < as->as_heap_start ) {
                 return EINVAL;
         }
 
-        /* Check if would result in too much heap */
-        /* Currently, the stack is a fixed size, so too much heap would means
-         * extending into the stack */
-        if ( as->as_heap_end + amount >= USERSTACK - 18*4096 ) {
-                return ENOMEM;
+        /* Check if would result in too much heap, that is, run into the region after it */
+        const int result = as_resize_region(as, as->as_heap_start, as->as_heap_end + amount);
+        if ( result ) {
+                return result;
         }
 
         intptr_t npages = amount / PAGE_SIZE;
         page_table * pt = &as->as_page_table;
         // destroy pages such that the user can not fault on them anymore
         if ( amount < 0 ) {
-                for ( intptr_t i = 1; i <= npages ; i++ ) { 
-                        vpage_t nxt_vpage = addr_to_page( as->as_heap_end - i*4096 );
-                        ppage_t nxt_ppage = page_table_read(pt, nxt_vpage);
+                npages = -npages;
+                const vpage_t first = addr_to_page( as->as_heap_end + amount );
 
-                        /* this page is in use, so free it and invalidate it */
-                        if (nxt_ppage != PPAGE_INVALID) {
-                                // TODO free nxt_ppage ?  how does one do
-                        }
+                /*
+                 * Other threads of ours may still reach the frames through
+                 * their TLBs, so shoot the pages down before giving up the
+                 * frames. They cannot fault them back in while we hold
+                 * the lock.
+                 */
+                as_shootdown_range(as, first, npages);
 
-                        page_table_remove(pt, nxt_vpage);
-                }
+                page_table_iterate(pt, first, npages, as_release_mapping, as);
+                page_table_remove_range(pt, first, npages);
         }
 
-        // write new INVALID pages above heap so that the user threads may fault on their addresses
-        else if ( amount > 0 ) {
-                for ( intptr_t i = 0; i < npages ; i++ ) { 
-                        page_table_write(pt, addr_to_page( as->as_heap_end + i*4096 ), PPAGE_INVALID );
-                }
-        }
+        /* Growing takes no page table entries, vm_fault finds the heap region */
 
         /* return old end, and adjust it */
         *retval =  as->as_heap_end;
         as->as_heap_end = as->as_heap_end + amount;
         return 0;
-#endif
 }
+#endif /* !OPT_DUMBVM */
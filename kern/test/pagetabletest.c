@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2018
+ *	The Trap Handlers!
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Page table benchmark: the hash table against the radix tree.
+ *
+ * Both are filled with the layout of a process: a few pages of text
+ * low in memory, a heap of a given number of pages right after it, and
+ * a stack at the top of the user address space. Then we time lookups
+ * in a scattered order, a copy as fork makes it, and the teardown, and
+ * report the memory each table takes up.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <page_table.h>
+#include <test.h>
+
+#define PTB_TEXT_FIRST   0x400   /* vpage of 0x00400000 */
+#define PTB_TEXT_PAGES   16
+#define PTB_STACK_PAGES  16
+#define PTB_STACK_FIRST  (0x80000 - PTB_STACK_PAGES)
+#define PTB_HEAP_PAGES   4096    /* default; ptb takes another */
+#define PTB_LOOKUPS      100000  /* a multiple of 1000 */
+#define PTB_STRIDE       7919    /* prime, to scatter the lookups */
+
+/* Microseconds since before */
+static
+unsigned
+ptb_elapsed(const struct timespec *before)
+{
+	struct timespec now;
+
+	gettime(&now);
+	timespec_sub(&now, before, &now);
+	return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* The index-th mapped page of the layout */
+static
+vpage_t
+ptb_vpage(unsigned index, unsigned heappages)
+{
+	if (index < PTB_TEXT_PAGES) {
+		return PTB_TEXT_FIRST + index;
+	}
+	index -= PTB_TEXT_PAGES;
+	if (index < heappages) {
+		return PTB_TEXT_FIRST + PTB_TEXT_PAGES + index;
+	}
+	return PTB_STACK_FIRST + (index - heappages);
+}
+
+static
+int
+ptb_copy_mapping(vpage_t vpage, ppage_t *ppage, void *data)
+{
+	return page_table_write(data, vpage, *ppage);
+}
+
+static
+void
+ptb_init(page_table *pt, unsigned kind)
+{
+	if (kind == PAGE_TABLE_RADIX) {
+		page_table_init_radix(pt);
+	}
+	else {
+		page_table_init_with_capacity(pt, 32);
+	}
+}
+
+static
+int
+ptb_run(unsigned kind, unsigned heappages)
+{
+	page_table pt, child;
+	struct timespec before;
+	unsigned populate, lookup, fork, teardown, i;
+	int result;
+	const unsigned npages = PTB_TEXT_PAGES + heappages + PTB_STACK_PAGES;
+	size_t footprint;
+
+	ptb_init(&pt, kind);
+
+	/* One write per page, as the faults make them */
+	gettime(&before);
+	for (i=0; i<npages; i++) {
+		result = page_table_write(&pt, ptb_vpage(i, heappages), i);
+		if (result) {
+			kprintf("ptb: page_table_write: %s\n",
+				strerror(result));
+			page_table_cleanup(&pt);
+			return result;
+		}
+	}
+	populate = ptb_elapsed(&before);
+	footprint = page_table_footprint(&pt);
+
+	gettime(&before);
+	for (i=0; i<PTB_LOOKUPS; i++) {
+		(void)page_table_read(&pt,
+			ptb_vpage((i * PTB_STRIDE) % npages, heappages));
+	}
+	lookup = ptb_elapsed(&before);
+
+	/* What as_copy does, less the frames */
+	ptb_init(&child, kind);
+	gettime(&before);
+	result = page_table_iterate(&pt, 0, PT_VPAGE_LIMIT, ptb_copy_mapping,
+				    &child);
+	fork = ptb_elapsed(&before);
+	if (result) {
+		kprintf("ptb: copy: %s\n", strerror(result));
+		page_table_cleanup(&child);
+		page_table_cleanup(&pt);
+		return result;
+	}
+
+	for (i=0; i<npages; i++) {
+		if (page_table_read(&child, ptb_vpage(i, heappages))
+		    != (ppage_t)i) {
+			kprintf("ptb: copy of page %u is wrong; test failed\n",
+				i);
+			page_table_cleanup(&child);
+			page_table_cleanup(&pt);
+			return EINVAL;
+		}
+	}
+	if (page_table_resident(&child) != npages ||
+	    page_table_resident(&pt) != npages) {
+		kprintf("ptb: %u and %u pages counted resident, not %u; "
+			"test failed\n", page_table_resident(&pt),
+			page_table_resident(&child), npages);
+		page_table_cleanup(&child);
+		page_table_cleanup(&pt);
+		return EINVAL;
+	}
+
+	gettime(&before);
+	page_table_cleanup(&child);
+	teardown = ptb_elapsed(&before);
+
+	page_table_cleanup(&pt);
+
+	kprintf("%-6s %7u %10u %7u.%02u %8u %9u %9zu\n",
+		kind == PAGE_TABLE_RADIX ? "radix" : "hash", npages,
+		populate, lookup / (PTB_LOOKUPS / 1000),
+		(100 * (lookup % (PTB_LOOKUPS / 1000))) / (PTB_LOOKUPS / 1000),
+		fork, teardown, footprint);
+	return 0;
+}
+
+int
+ptbench(int nargs, char **args)
+{
+	unsigned heappages = PTB_HEAP_PAGES;
+	int result;
+
+	if (nargs == 2) {
+		heappages = atoi(args[1]);
+	}
+	if (nargs > 2 || heappages == 0 ||
+	    PTB_TEXT_FIRST + PTB_TEXT_PAGES + heappages > PTB_STACK_FIRST) {
+		kprintf("Usage: ptb [heappages]\n");
+		return EINVAL;
+	}
+
+	kprintf("Page table benchmark, %u lookups; times in us\n",
+		PTB_LOOKUPS);
+	kprintf("kind     pages   populate  ns/lookup     fork  teardown     bytes\n");
+
+	result = ptb_run(PAGE_TABLE_HASH, heappages);
+	if (result) {
+		return result;
+	}
+	result = ptb_run(PAGE_TABLE_RADIX, heappages);
+	if (result) {
+		return result;
+	}
+
+	kprintf("Page table benchmark done.\n");
+	return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2018
+ *	The Trap Handlers!
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Swap cache compressor benchmark.
+ *
+ * Compresses and decompresses pages of a few kinds that evicted user
+ * memory is made of, checks that they come back intact, and reports the
+ * ratio each kind compresses to and how long it takes.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <vm.h>
+#include <swap_cache.h>
+#include <test.h>
+
+#define ZCB_ROUNDS 64    /* Pages of each kind */
+
+/* Microseconds since before */
+static
+unsigned
+zcb_elapsed(const struct timespec *before)
+{
+	struct timespec now;
+
+	gettime(&now);
+	timespec_sub(&now, before, &now);
+	return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static const char *zcb_kinds[] = {
+	"zeros", "sparse", "ints", "text", "random", NULL
+};
+
+static
+void
+zcb_fill(uint8_t *page, unsigned kind, unsigned round)
+{
+	static const char text[] = "the quick brown fox jumps over the lazy dog. ";
+	unsigned i;
+
+	for (i=0; i<PAGE_SIZE; i++) {
+		switch (kind) {
+		    case 0:
+			page[i] = 0;
+			break;
+		    case 1:
+			/* A sparse matrix: one nonzero word in 32 */
+			page[i] = (i / 4) % 32 == round % 32 ? random() : 0;
+			break;
+		    case 2:
+			/* An array of small ascending ints */
+			page[i] = i % 4 == 3 ? (i / 4 + round) & 0xff : 0;
+			break;
+		    case 3:
+			page[i] = text[(i + round + random() % 2) %
+				       (sizeof(text) - 1)];
+			break;
+		    default:
+			page[i] = random();
+			break;
+		}
+	}
+}
+
+static
+bool
+zcb_same(const uint8_t *a, const uint8_t *b)
+{
+	unsigned i;
+
+	for (i=0; i<PAGE_SIZE; i++) {
+		if (a[i] != b[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int
+swapcachebench(int nargs, char **args)
+{
+	uint8_t *page, *compressed, *check;
+	uint16_t *table;
+	struct timespec before;
+	unsigned kind, round, size, total, stored, ctime, dtime;
+	int result = 0;
+
+	(void)nargs;
+	(void)args;
+
+	page = kmalloc(PAGE_SIZE);
+	check = kmalloc(PAGE_SIZE);
+	compressed = kmalloc(SWAP_CACHE_MAX_STORED);
+	table = kmalloc(SWAP_CACHE_HASH_SIZE * sizeof(uint16_t));
+	if (page == NULL || check == NULL || compressed == NULL ||
+	    table == NULL) {
+		kfree(page);
+		kfree(check);
+		kfree(compressed);
+		kfree(table);
+		return ENOMEM;
+	}
+
+	kprintf("Swap cache compressor, %u pages of each kind; times in us\n",
+		ZCB_ROUNDS);
+	kprintf("kind     stored     ratio  compress  decompress\n");
+
+	for (kind=0; zcb_kinds[kind] != NULL && result == 0; kind++) {
+		total = stored = ctime = dtime = 0;
+
+		for (round=0; round<ZCB_ROUNDS; round++) {
+			zcb_fill(page, kind, round);
+
+			gettime(&before);
+			size = swap_cache_compress(page, compressed,
+				SWAP_CACHE_MAX_STORED, table);
+			ctime += zcb_elapsed(&before);
+			if (size == 0) {
+				/* Turned down, as the cache would */
+				continue;
+			}
+
+			gettime(&before);
+			result = swap_cache_decompress(compressed, size, check);
+			dtime += zcb_elapsed(&before);
+			if (result || !zcb_same(page, check)) {
+				kprintf("zcb: %s page %u came back wrong; "
+					"test failed\n", zcb_kinds[kind], round);
+				result = EINVAL;
+				break;
+			}
+			stored++;
+			total += size;
+		}
+
+		kprintf("%-8s %6u %6u.%02u %9u %11u\n", zcb_kinds[kind],
+			stored,
+			total == 0 ? 0 : stored * PAGE_SIZE / total,
+			total == 0 ? 0 : (100 * stored * PAGE_SIZE / total) % 100,
+			ctime, dtime);
+	}
+
+	kfree(page);
+	kfree(check);
+	kfree(compressed);
+	kfree(table);
+
+	if (result == 0) {
+		kprintf("Swap cache compressor benchmark done.\n");
+	}
+	return result;
+}
@@ -260,6 +260,31 @@ lock_release(struct lock *lock)
 	spinlock_release(&lock->lk_spinlock);
 }
 
+/*
+ * lock_tryacquire::
+ *   acquires the lock specified if it is free, without sleeping.
+ *     Inputs:         lock - the lock to acquire, not ==NULL
+ *     Output:         true if the lock was acquired, false if it is held
+ *     Preconditions:  None, may be called with spinlocks held.
+ *     Postconditions: If true is returned, the lock is acquired and no other
+ *                     thread has it.
+ */
+bool
+lock_tryacquire(struct lock *lock)
+{
+        bool acquired = false;
+
+	spinlock_acquire(&lock->lk_spinlock);
+        if (lock->lk_free == 1) {
+                lock->lk_free = 0; //Take lock
+                lock->lk_holder = curthread;
+                acquired = true;
+        }
+	spinlock_release(&lock->lk_spinlock);
+
+        return acquired;
+}
+
 /*
  * lock_do_i_hold::
  *   checks whether this thread currently holds the lock specified,
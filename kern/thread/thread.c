@@ -860,6 +860,21 @@ thread_yield(void)
 	thread_switch(S_READY, NULL, NULL);
 }
 
+/*
+ * Check if other threads are waiting to run on this cpu.
+ */
+bool
+thread_others_ready(void)
+{
+	bool ready;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	ready = !threadlist_isempty(&curcpu->c_runqueue);
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	return ready;
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -1224,6 +1239,23 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+unsigned
+ipi_tlbshootdown_cpus(uint32_t cpus, const struct tlbshootdown *mapping)
+{
+	unsigned i, n = 0;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self &&
+		    (cpus & ((uint32_t)1 << c->c_number)) != 0) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+	return n;
+}
+
 void
 interprocessor_interrupt(void)
 {
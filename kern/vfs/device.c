@@ -237,15 +237,18 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Some devices may not make sense to map. Others do, but
+ * mappings are paged through vop_read and vop_write a page at a time,
+ * which the devices with a block size don't all take, so none of them
+ * can be mapped for now.
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v, int prot)
 {
 	(void)v;
-	return ENOSYS;
+	(void)prot;
+	return ENODEV;
 }
 
 /*
@@ -372,3 +375,15 @@ dev_create_vnode(struct device *dev)
 
 	return v;
 }
+
+/*
+ * Return the device a vnode stands for, if it is one of ours.
+ */
+struct device *
+dev_getdevice(struct vnode *v)
+{
+	if (v->vn_ops != &dev_vnode_ops) {
+		return NULL;
+	}
+	return v->vn_data;
+}
@@ -36,57 +36,245 @@
 #include <vm.h>
 #include <coremap.h>
 #include <page_table.h>
+#include <page_file.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <stat.h>
 
 #include <spl.h>
 #include <mips/tlb.h>
 
+/* Pages per TLB shootdown, see as_shootdown_range */
+#define AS_SHOOTDOWN_BATCH 16
+
+/* Past this many batches, all of the entries of the address space go */
+#define AS_SHOOTDOWN_MAX_BATCHES 4
+
 // ~~~~~ Static Functions ~~~~~~~
 
 /*
- * Writes vpage:PPAGE_INVALID, entry into page table. If an entry for vpage
- * exists, it overwrites it, else, it is made.
- * Called by as_define_stack and as_define_region.
+ * Returns the number of regions that start at or below vaddr, so the
+ * region holding vaddr, if any, is the one before that index.
  */
 static
+unsigned
+as_region_index(const struct addrspace* as, vaddr_t vaddr)
+{
+        unsigned low = 0;
+        unsigned high = as->as_nregions;
+
+        while (low < high) {
+                const unsigned mid = low + (high - low) / 2;
+                if (as->as_regions[mid].ar_start <= vaddr) {
+                        low = mid + 1;
+                }
+                else {
+                        high = mid;
+                }
+        }
+        return low;
+}
+
+/*
+ * Adds the region [start, end) in its place in the sorted array, growing
+ * the array if need be. Fails with EINVAL if it overlaps another region,
+ * or starts where another does; the heap may be empty for a while.
+ */
+static
+int
+as_insert_region(struct addrspace* as, vaddr_t start, vaddr_t end,
+                 unsigned perms, unsigned kind)
+{
+        KASSERT((start & PAGE_FRAME) == start && (end & PAGE_FRAME) == end);
+        KASSERT(start <= end && end <= USERSPACETOP);
+
+        const unsigned index = as_region_index(as, start);
+
+        if (index > 0) {
+                const struct as_region* prev = as->as_regions + index - 1;
+                if (prev->ar_start == start || prev->ar_end > start) {
+                        return EINVAL;
+                }
+        }
+        if (index < as->as_nregions && as->as_regions[index].ar_start < end) {
+                return EINVAL;
+        }
+
+        if (as->as_nregions == as->as_maxregions) {
+                const unsigned max = as->as_maxregions == 0 ? 8 : 2 * as->as_maxregions;
+                struct as_region* regions = kmalloc(max * sizeof(struct as_region));
+                if (regions == NULL) {
+                        return ENOMEM;
+                }
+                if (as->as_regions != NULL) {
+                        memcpy(regions, as->as_regions,
+                               as->as_nregions * sizeof(struct as_region));
+                        kfree(as->as_regions);
+                }
+                as->as_regions = regions;
+                as->as_maxregions = max;
+        }
+
+        memmove(as->as_regions + index + 1, as->as_regions + index,
+                (as->as_nregions - index) * sizeof(struct as_region));
+
+        struct as_region* region = as->as_regions + index;
+        region->ar_start = start;
+        region->ar_end = end;
+        region->ar_perms = perms;
+        region->ar_kind = kind;
+        region->ar_segment = 0;
+        region->ar_vnode = NULL;
+        region->ar_offset = 0;
+        region->ar_shared = false;
+        as->as_nregions += 1;
+
+        DEBUG(DB_VM, "vm: region 0x%08x-0x%08x perms %u kind %u\n",
+              start, end, perms, kind);
+        return 0;
+}
+
+/*
+ * Returns the index of the first region that is not empty and overlaps
+ * [start, end), or as_nregions if there is none.
+ */
+static
+unsigned
+as_overlapping_region(const struct addrspace* as, vaddr_t start, vaddr_t end)
+{
+        unsigned index = as_region_index(as, start);
+
+        if (index > 0 && start < as->as_regions[index - 1].ar_end) {
+                return index - 1;
+        }
+        for (; index < as->as_nregions && as->as_regions[index].ar_start < end; ++index) {
+                if (as->as_regions[index].ar_start < as->as_regions[index].ar_end) {
+                        return index;
+                }
+        }
+        return as->as_nregions;
+}
+
+/* Takes the region at index out of the array */
+static
 void
-reserve_vpage(page_table* pt, vpage_t vpage)
+as_remove_region(struct addrspace* as, unsigned index)
 {
-        KASSERTM(!page_table_contains(pt, vpage),
-                 "Page table already contains an entry for %x", vpage);
+        KASSERT(index < as->as_nregions);
 
-        DEBUG(DB_VM, "vm: reserve vpage 0x%x\n", vpage);
+        memmove(as->as_regions + index, as->as_regions + index + 1,
+                (as->as_nregions - index - 1) * sizeof(struct as_region));
+        as->as_nregions -= 1;
+}
 
-        /*
-         * Write an invalid ppage:
-         * actual page frames are allocated when the memory is accessed
-         */
-        page_table_write(pt, vpage, PPAGE_INVALID);
+/* Where the page vpage of a mapped file is found in the file */
+static
+off_t
+as_file_offset(const struct as_region* region, vpage_t vpage)
+{
+        KASSERT(region->ar_kind == AS_REGION_FILE);
+        return region->ar_offset + (page_to_addr(vpage) - region->ar_start);
 }
 
+/*
+ * Reads a page of a mapped file into a frame. The part of the page past
+ * the end of the file is zero-filled.
+ */
+static
+int
+as_read_file_page(const struct as_region* region, vpage_t vpage, ppage_t ppage)
+{
+        char* kpage = (char*)PADDR_TO_KVADDR(page_to_addr(ppage));
+        bzero(kpage, PAGE_SIZE);
+
+        struct iovec iov;
+        struct uio ku;
+        uio_kinit(&iov, &ku, kpage, PAGE_SIZE, as_file_offset(region, vpage), UIO_READ);
+
+        return VOP_READ(region->ar_vnode, &ku);
+}
 
+/*
+ * Writes a page of a MAP_SHARED file back from its frame. Only the part
+ * up to the end of the file is written; mappings do not grow files.
+ */
 static
-ppage_t
-copy_to_new_page(ppage_t old_page)
+int
+as_write_file_page(const struct as_region* region, vpage_t vpage, ppage_t ppage)
 {
-        if (old_page == PPAGE_INVALID) {
-                return PPAGE_INVALID;
+        KASSERT(region->ar_shared);
+
+        struct stat st;
+        int result = VOP_STAT(region->ar_vnode, &st);
+        if (result) {
+                return result;
         }
 
-        const ppage_t new_page = claim_free_pages(1);
-        if (new_page == PPAGE_INVALID) {
-                return PPAGE_INVALID;
+        const off_t offset = as_file_offset(region, vpage);
+        if (offset >= st.st_size) {
+                return 0;
         }
+        const size_t len = st.st_size - offset < PAGE_SIZE ? st.st_size - offset : PAGE_SIZE;
+
+        struct iovec iov;
+        struct uio ku;
+        uio_kinit(&iov, &ku, (void*)PADDR_TO_KVADDR(page_to_addr(ppage)), len,
+                  offset, UIO_WRITE);
+
+        DEBUG(DB_VM, "vm: write back vpage 0x%x to offset %llu\n",
+              vpage, (unsigned long long)offset);
+
+        return VOP_WRITE(region->ar_vnode, &ku);
+}
 
-        const vaddr_t old_address = PADDR_TO_KVADDR(page_to_addr(old_page));
-        const vaddr_t new_address = PADDR_TO_KVADDR(page_to_addr(new_page));
+/* Passed through page_table_iterate to as_write_back_mapping */
+struct as_write_back {
+        const struct as_region* wb_region;
+        int wb_result;          /* The first error, if any */
+};
 
-        DEBUG(DB_VM, "vm: copy page 0x%x -> 0x%x\n", old_page, new_page);
+/*
+ * Writes a dirty resident page of a MAP_SHARED file back, and marks it
+ * clean. The caller has made sure no TLB maps the page writeable. A
+ * frame still shared with another address space stays dirty, as that one
+ * may write to it in the meantime. Errors are recorded, and the other
+ * pages are still written.
+ */
+static
+int
+as_write_back_mapping(vpage_t vpage, ppage_t* ppage, void* data)
+{
+        struct as_write_back* wb = data;
+
+        if (!PPAGE_IS_RESIDENT(*ppage) || !coremap_is_dirty(*ppage)) {
+                return 0;
+        }
 
-        memcpy((void*)new_address, (const void*)old_address, PAGE_SIZE);
+        const int result = as_write_file_page(wb->wb_region, vpage, *ppage);
+        if (result) {
+                if (wb->wb_result == 0) {
+                        wb->wb_result = result;
+                }
+                return 0;
+        }
+        if (!coremap_is_shared(*ppage)) {
+                coremap_clear_dirty(*ppage);
+        }
+        return 0;
+}
 
-        DEBUG(DB_VM, "vm: done copy page\n");
+/* Writes back all of a MAP_SHARED region, see as_write_back_mapping */
+static
+int
+as_write_back_region(struct addrspace* as, const struct as_region* region,
+                     vaddr_t start, vaddr_t end)
+{
+        struct as_write_back wb = { region, 0 };
 
-        return new_page;
+        page_table_iterate(&as->as_page_table, addr_to_page(start),
+                           addr_to_page(end - start), as_write_back_mapping, &wb);
+        return wb.wb_result;
 }
 
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -109,8 +297,532 @@ as_prepare_load(struct addrspace *as)
 int
 as_complete_load(struct addrspace *as)
 {
-	(void)as;
-	return 0;
+        KASSERT(as != NULL);
+
+        /* The heap starts out empty, right after the last region */
+        lock_acquire(as->as_lock);
+        const int result = as_insert_region(as, as->as_heap_start,
+                as->as_heap_start, AS_REGION_READ | AS_REGION_WRITE,
+                AS_REGION_HEAP);
+        lock_release(as->as_lock);
+
+	return result;
+}
+
+int
+as_define_segment(struct addrspace *as, struct vnode *v,
+                  off_t offset, vaddr_t vaddr,
+                  size_t memsize, size_t filesize,
+                  int executable)
+{
+        KASSERT(as != NULL);
+        KASSERT(filesize <= memsize);
+
+        if (as->as_nsegments == AS_MAX_SEGMENTS) {
+                kprintf("ELF: too many segments\n");
+                return ENOEXEC;
+        }
+
+        /* Nothing is copied through uiomove any more, so check this here */
+        if (vaddr + memsize < vaddr || vaddr + memsize > USERSPACETOP) {
+                return EFAULT;
+        }
+
+        struct as_segment* seg = as->as_segments + as->as_nsegments;
+        seg->seg_vaddr = vaddr;
+        seg->seg_memsize = memsize;
+        seg->seg_offset = offset;
+        seg->seg_filesize = filesize;
+        seg->seg_vnode = v;
+        seg->seg_executable = executable != 0;
+
+        /* Let the region of the segment find it, see as_segment_of */
+        const unsigned index = as_region_index(as, vaddr);
+        if (memsize > 0) {
+                KASSERT(index > 0 && vaddr < as->as_regions[index - 1].ar_end);
+                as->as_regions[index - 1].ar_kind = AS_REGION_SEGMENT;
+                as->as_regions[index - 1].ar_segment = as->as_nsegments;
+        }
+
+        VOP_INCREF(v);
+        as->as_nsegments += 1;
+
+        return 0;
+}
+
+/*
+ * The highest address the region below as_regions[index] may reach: the
+ * start of the region, but for the stack the limit it may grow down to,
+ * less the guard gap, and USERSPACETOP past the last region.
+ */
+static
+vaddr_t
+as_region_ceiling(const struct addrspace* as, unsigned index)
+{
+        if (index == as->as_nregions) {
+                return USERSPACETOP;
+        }
+        if (as->as_regions[index].ar_kind == AS_REGION_STACK) {
+                return as->as_stack_limit - VM_STACK_GUARD * PAGE_SIZE;
+        }
+        return as->as_regions[index].ar_start;
+}
+
+const struct as_region*
+as_region_of(const struct addrspace *as, vaddr_t vaddr)
+{
+        KASSERT(as != NULL);
+
+        const unsigned index = as_region_index(as, vaddr);
+        if (index == 0 || vaddr >= as->as_regions[index - 1].ar_end) {
+                return NULL;
+        }
+        return as->as_regions + index - 1;
+}
+
+int
+as_resize_region(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+        KASSERT(as != NULL);
+        KASSERT(lock_do_i_hold(as->as_lock));
+
+        const unsigned index = as_region_index(as, start);
+        KASSERT(index > 0 && as->as_regions[index - 1].ar_start == start);
+
+        if (end < start || (end & PAGE_FRAME) != end) {
+                return EINVAL;
+        }
+        if (end > as_region_ceiling(as, index)) {
+                return ENOMEM;
+        }
+
+        as->as_regions[index - 1].ar_end = end;
+        return 0;
+}
+
+void
+as_shootdown_range(struct addrspace *as, vpage_t first, unsigned npages)
+{
+        KASSERT(as != NULL);
+        KASSERT(lock_do_i_hold(as->as_lock));
+
+        if (npages > AS_SHOOTDOWN_BATCH * AS_SHOOTDOWN_MAX_BATCHES) {
+                /* Cheaper to drop all of our entries, see vm_tlbshootdown_as */
+                vm_tlbshootdown_as(as);
+                return;
+        }
+
+        vaddr_t vaddrs[AS_SHOOTDOWN_BATCH];
+        for (unsigned i = 0; i < npages; i += AS_SHOOTDOWN_BATCH) {
+
+                unsigned nbatch = 0;
+                for (unsigned j = i; j < npages && nbatch < AS_SHOOTDOWN_BATCH; ++j) {
+                        vaddrs[nbatch++] = page_to_addr(first + j);
+                }
+                vm_tlbshootdown_pages(as, vaddrs, nbatch);
+        }
+}
+
+/*
+ * Adds a region for mmap of len bytes, at the top of the highest gap
+ * that is large enough: right below the room kept for the stack at
+ * first, then below the previous mapping. The heap grows up towards
+ * them. Called with the address space lock held.
+ */
+static
+int
+as_insert_mapping(struct addrspace* as, size_t len, unsigned perms,
+                  unsigned kind, struct as_region** ret)
+{
+        KASSERT(lock_do_i_hold(as->as_lock));
+        KASSERT(len > 0);
+
+        if (len > USERSPACETOP) {
+                return ENOMEM;
+        }
+        const vaddr_t size = (len + PAGE_SIZE - 1) & PAGE_FRAME;
+
+        vaddr_t start = 0;
+        for (unsigned i = as->as_nregions + 1; i-- > 0; ) {
+                const vaddr_t high = as_region_ceiling(as, i);
+                const vaddr_t low = i > 0 ? as->as_regions[i - 1].ar_end : PAGE_SIZE;
+
+                if (high >= size && high - size >= low) {
+                        start = high - size;
+                        break;
+                }
+        }
+        if (start == 0) {
+                return ENOMEM;
+        }
+
+        const int result = as_insert_region(as, start, start + size, perms, kind);
+        if (result) {
+                return result;
+        }
+
+        *ret = as->as_regions + as_region_index(as, start) - 1;
+        return 0;
+}
+
+int
+as_map_file(struct addrspace *as, size_t len, unsigned perms,
+            struct vnode *vn, off_t offset, bool shared, vaddr_t *ret)
+{
+        KASSERT(as != NULL);
+
+        lock_acquire(as->as_lock);
+
+        struct as_region* region;
+        const int result = as_insert_mapping(as, len, perms, AS_REGION_FILE, &region);
+        if (result) {
+                lock_release(as->as_lock);
+                return result;
+        }
+
+        region->ar_vnode = vn;
+        region->ar_offset = offset;
+        region->ar_shared = shared;
+        VOP_INCREF(vn);
+        *ret = region->ar_start;
+
+        lock_release(as->as_lock);
+        return 0;
+}
+
+int
+as_map_anon(struct addrspace *as, size_t len, unsigned perms, vaddr_t *ret)
+{
+        KASSERT(as != NULL);
+
+        lock_acquire(as->as_lock);
+
+        struct as_region* region;
+        const int result = as_insert_mapping(as, len, perms, AS_REGION_MAPPED, &region);
+        if (result == 0) {
+                *ret = region->ar_start;
+        }
+
+        lock_release(as->as_lock);
+        return result;
+}
+
+/*
+ * Unmaps [start, end) of a mapping: writes back the dirty pages if it
+ * is a shared file, then gives up the frames and page file slots. Must
+ * be called before the region itself is changed.
+ */
+static
+void
+as_unmap_pages(struct addrspace* as, const struct as_region* region,
+               vaddr_t start, vaddr_t end)
+{
+        const vpage_t first = addr_to_page(start);
+        const unsigned npages = addr_to_page(end - start);
+
+        /* Nothing may write to the pages once they are being written back */
+        as_shootdown_range(as, first, npages);
+
+        if (region->ar_shared) {
+                as_write_back_region(as, region, start, end);
+        }
+
+        page_table_iterate(&as->as_page_table, first, npages, as_release_mapping, as);
+        page_table_remove_range(&as->as_page_table, first, npages);
+}
+
+int
+as_unmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+        KASSERT(as != NULL);
+
+        if ((vaddr & PAGE_FRAME) != vaddr || len == 0 ||
+            vaddr + len < vaddr || vaddr + len > USERSPACETOP) {
+                return EINVAL;
+        }
+        const vaddr_t start = vaddr;
+        const vaddr_t end = (vaddr + len + PAGE_SIZE - 1) & PAGE_FRAME;
+
+        lock_acquire(as->as_lock);
+
+        /* Only what mmap mapped may be unmapped, and nothing is unless all of it can be */
+        for (unsigned i = as_overlapping_region(as, start, end);
+             i < as->as_nregions && as->as_regions[i].ar_start < end; ++i) {
+                const unsigned kind = as->as_regions[i].ar_kind;
+                if (kind != AS_REGION_FILE && kind != AS_REGION_MAPPED &&
+                    as->as_regions[i].ar_start < as->as_regions[i].ar_end) {
+                        lock_release(as->as_lock);
+                        return EINVAL;
+                }
+        }
+
+        unsigned index;
+        vaddr_t next = start;
+        while (next < end &&
+               (index = as_overlapping_region(as, next, end)) < as->as_nregions) {
+
+                struct as_region* region = as->as_regions + index;
+                const vaddr_t from = max(next, region->ar_start);
+                const vaddr_t to = min(end, region->ar_end);
+
+                if (from > region->ar_start && to < region->ar_end) {
+                        /* A hole in the middle: the part after it becomes a region */
+                        const vaddr_t old_end = region->ar_end;
+                        region->ar_end = from;
+
+                        const int result = as_insert_region(as, to, old_end,
+                                region->ar_perms, region->ar_kind);
+                        if (result) {
+                                region->ar_end = old_end;
+                                lock_release(as->as_lock);
+                                return result;
+                        }
+
+                        /* The array may have moved */
+                        region = as->as_regions + index;
+                        struct as_region* tail = region + 1;
+                        tail->ar_vnode = region->ar_vnode;
+                        tail->ar_offset = region->ar_offset + (to - region->ar_start);
+                        tail->ar_shared = region->ar_shared;
+                        if (tail->ar_kind == AS_REGION_FILE) {
+                                VOP_INCREF(tail->ar_vnode);
+                        }
+
+                        as_unmap_pages(as, region, from, to);
+                }
+                else if (from == region->ar_start && to == region->ar_end) {
+                        as_unmap_pages(as, region, from, to);
+                        if (region->ar_kind == AS_REGION_FILE) {
+                                VOP_DECREF(region->ar_vnode);
+                        }
+                        as_remove_region(as, index);
+                }
+                else if (from == region->ar_start) {
+                        as_unmap_pages(as, region, from, to);
+                        region->ar_offset += to - from;
+                        region->ar_start = to;
+                }
+                else {
+                        as_unmap_pages(as, region, from, to);
+                        region->ar_end = from;
+                }
+
+                next = to;
+        }
+
+        lock_release(as->as_lock);
+        return 0;
+}
+
+int
+as_sync_file(struct addrspace *as, struct vnode *vn)
+{
+        KASSERT(as != NULL);
+
+        int result = 0;
+        bool shot_down = false;
+
+        lock_acquire(as->as_lock);
+
+        for (unsigned i = 0; i < as->as_nregions; ++i) {
+
+                const struct as_region* region = as->as_regions + i;
+                if (!region->ar_shared || region->ar_vnode != vn) {
+                        continue;
+                }
+
+                /* The pages become read-only, so the next write dirties them again */
+                if (!shot_down) {
+                        vm_tlbshootdown_as(as);
+                        shot_down = true;
+                }
+
+                const int err = as_write_back_region(as, region, region->ar_start,
+                                                     region->ar_end);
+                if (err && result == 0) {
+                        result = err;
+                }
+        }
+
+        lock_release(as->as_lock);
+        return result;
+}
+
+/*
+ * Returns the segment vpage is part of, or NULL.
+ */
+static
+const struct as_segment*
+as_segment_of(const struct addrspace *as, vpage_t vpage)
+{
+        const struct as_region* region = as_region_of(as, page_to_addr(vpage));
+        if (region == NULL || region->ar_kind != AS_REGION_SEGMENT) {
+                return NULL;
+        }
+        return as->as_segments + region->ar_segment;
+}
+
+int
+as_fill_page(struct addrspace *as, vpage_t vpage, ppage_t ppage)
+{
+        KASSERT(as != NULL);
+
+        const vaddr_t page_start = page_to_addr(vpage);
+        const vaddr_t page_end = page_start + PAGE_SIZE;
+
+        const struct as_region* region = as_region_of(as, page_start);
+        if (region != NULL && region->ar_kind == AS_REGION_FILE) {
+                return as_read_file_page(region, vpage, ppage);
+        }
+
+        const struct as_segment* seg = as_segment_of(as, vpage);
+        if (seg == NULL) {
+                /* Not part of a segment, e.g. the heap or the stack */
+                return 0;
+        }
+
+        char* kpage = (char*)PADDR_TO_KVADDR(page_to_addr(ppage));
+
+        /* The BSS and the parts of the page outside the segment */
+        bzero(kpage, PAGE_SIZE);
+
+        /* The part of the page that comes from the file, if any */
+        const vaddr_t file_start = max(page_start, seg->seg_vaddr);
+        const vaddr_t file_end = min(page_end, seg->seg_vaddr + seg->seg_filesize);
+        if (file_start >= file_end) {
+                return 0;
+        }
+
+        DEBUG(DB_EXEC, "ELF: Loading %u bytes to 0x%x\n",
+              file_end - file_start, file_start);
+
+        struct iovec iov;
+        struct uio ku;
+        uio_kinit(&iov, &ku, kpage + (file_start - page_start),
+                  file_end - file_start,
+                  seg->seg_offset + (file_start - seg->seg_vaddr),
+                  UIO_READ);
+
+        const int result = VOP_READ(seg->seg_vnode, &ku);
+        if (result) {
+                return result;
+        }
+        if (ku.uio_resid != 0) {
+                /* short read; problem with executable? */
+                kprintf("ELF: short read on segment - file truncated?\n");
+                return ENOEXEC;
+        }
+        return 0;
+}
+
+bool
+as_page_is_zero(struct addrspace *as, vpage_t vpage)
+{
+        KASSERT(as != NULL);
+
+        const struct as_region* region = as_region_of(as, page_to_addr(vpage));
+        if (region != NULL && region->ar_kind == AS_REGION_FILE) {
+                return false;
+        }
+
+        const struct as_segment* seg = as_segment_of(as, vpage);
+        if (seg == NULL) {
+                /* The heap or the stack */
+                return true;
+        }
+
+        /* The BSS, past the part of the segment that is in the file */
+        const vaddr_t page_start = page_to_addr(vpage);
+        return max(page_start, seg->seg_vaddr) >= seg->seg_vaddr + seg->seg_filesize;
+}
+
+void
+as_evict_pages(struct addrspace *as, struct as_victim *victims, unsigned nvictims)
+{
+        KASSERT(as != NULL);
+        KASSERT(lock_do_i_hold(as->as_lock));
+        KASSERT(nvictims > 0 && nvictims <= PF_BATCH_MAX);
+
+        page_table* pt = &as->as_page_table;
+
+        /* The victims that must be written out */
+        const void* srcs[PF_BATCH_MAX];
+        struct as_victim* dirty[PF_BATCH_MAX];
+        unsigned ndirty = 0;
+
+        /* No cpu may write to the frames once they are being written out */
+        vaddr_t vaddrs[PF_BATCH_MAX];
+        for (unsigned i = 0; i < nvictims; ++i) {
+                KASSERT(page_table_read(pt, victims[i].av_vpage) == victims[i].av_ppage);
+                vaddrs[i] = page_to_addr(victims[i].av_vpage);
+        }
+        vm_tlbshootdown_pages(as, vaddrs, nvictims);
+
+        for (unsigned i = 0; i < nvictims; ++i) {
+
+                struct as_victim* v = victims + i;
+
+                v->av_evicted = false;
+                v->av_written = false;
+
+                const struct as_region* region = as_region_of(as, vaddrs[i]);
+                KASSERT(region != NULL);
+
+                if (region->ar_shared) {
+                        /* The file is where the pages of a shared mapping live */
+                        if (v->av_dirty &&
+                            as_write_file_page(region, v->av_vpage, v->av_ppage)) {
+                                continue;
+                        }
+                        page_table_write(pt, v->av_vpage, PPAGE_INVALID);
+                        v->av_evicted = true;
+                        continue;
+                }
+                if (!v->av_dirty && v->av_swap_copy != PF_INVALID) {
+                        /* The copy read in from the page file is still good */
+                        page_table_write(pt, v->av_vpage, PPAGE_SWAPPED(v->av_swap_copy));
+                        v->av_evicted = true;
+                        continue;
+                }
+                if (!v->av_dirty && (region->ar_kind == AS_REGION_SEGMENT ||
+                                     region->ar_kind == AS_REGION_FILE)) {
+                        /* as_fill_page will read it from the file again */
+                        page_table_write(pt, v->av_vpage, PPAGE_INVALID);
+                        v->av_evicted = true;
+                        continue;
+                }
+
+                srcs[ndirty] = (const void*)PADDR_TO_KVADDR(page_to_addr(v->av_ppage));
+                dirty[ndirty] = v;
+                ++ndirty;
+        }
+
+        if (ndirty == 0) {
+                return;
+        }
+
+        /* Write them out in one go, or one at a time if there is no room for that */
+        const pfid first = page_file_write_batch(srcs, ndirty);
+
+        for (unsigned i = 0; i < ndirty; ++i) {
+
+                struct as_victim* v = dirty[i];
+
+                pfid index = first + i;
+                if (first == PF_INVALID) {
+                        index = ndirty > 1 ? page_file_write(srcs[i]) : PF_INVALID;
+                        if (index == PF_INVALID) {
+                                continue;
+                        }
+                }
+
+                DEBUG(DB_VM, "vm: evict vpage 0x%x ppage 0x%x -> pfid %d\n",
+                      v->av_vpage, v->av_ppage, index);
+
+                page_table_write(pt, v->av_vpage, PPAGE_SWAPPED(index));
+                v->av_evicted = true;
+                v->av_written = true;
+        }
 }
 
 int
@@ -118,15 +830,27 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
         DEBUG(DB_VM, "vm: as_define_stack()\n");
 
-        page_table* pt = &as->as_page_table;
+        lock_acquire(as->as_lock);
 
-        const vpage_t stack_top = addr_to_page(USERSTACK);
-        const vpage_t stack_bottom = stack_top - STACKPAGES;
+        /* Keep the guard gap clear of what was loaded, at the cost of room */
+        vaddr_t limit = USERSTACK - vm_get_stack_limit() * PAGE_SIZE;
+        if (as->as_nregions > 0) {
+                limit = max(limit, as->as_regions[as->as_nregions - 1].ar_end +
+                            VM_STACK_GUARD * PAGE_SIZE);
+        }
+        if (limit > USERSTACK - STACKPAGES * PAGE_SIZE) {
+                lock_release(as->as_lock);
+                return ENOMEM;
+        }
+        as->as_stack_limit = limit;
 
-        /* Reserve virtual pages for the stack */
-        for (vpage_t vpage = stack_top; vpage > stack_bottom; --vpage) {
+        const int result = as_insert_region(as,
+                USERSTACK - STACKPAGES * PAGE_SIZE, USERSTACK,
+                AS_REGION_READ | AS_REGION_WRITE, AS_REGION_STACK);
+        lock_release(as->as_lock);
 
-                reserve_vpage(pt, vpage);
+        if (result) {
+                return result;
         }
 
 	*stackptr = USERSTACK;
@@ -135,46 +859,147 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+const struct as_region*
+as_grow_stack(struct addrspace *as, vaddr_t vaddr)
+{
+        KASSERT(as != NULL);
+        KASSERT(lock_do_i_hold(as->as_lock));
+
+        /* The stack is the highest region */
+        if (as->as_nregions == 0) {
+                return NULL;
+        }
+        struct as_region* stack = as->as_regions + as->as_nregions - 1;
+        if (stack->ar_kind != AS_REGION_STACK || vaddr >= stack->ar_start ||
+            vaddr < as->as_stack_limit ||
+            stack->ar_start - vaddr > VM_STACK_REACH * PAGE_SIZE) {
+                return NULL;
+        }
+
+        /* Nothing else is placed above the guard gap, see as_region_ceiling */
+        const vaddr_t start = vaddr & PAGE_FRAME;
+        KASSERT(as->as_nregions == 1 ||
+                as->as_regions[as->as_nregions - 2].ar_end <= start);
+
+        DEBUG(DB_VM, "vm: stack grows from 0x%08x to 0x%08x\n",
+              stack->ar_start, start);
+
+        stack->ar_start = start;
+        return stack;
+}
+
+/* The address spaces as_copy copies from and to */
+struct as_copy {
+        struct addrspace* ac_old;
+        struct addrspace* ac_new;
+};
+
+/*
+ * Enters a mapping of the old address space into the page table of the
+ * new one, both passed in data. Called by as_copy for each mapping.
+ */
+static
+int
+as_copy_mapping(vpage_t vpage, ppage_t* ppage, void* data)
+{
+        struct as_copy* copy = data;
+        page_table* new_pt = &copy->ac_new->as_page_table;
+        ppage_t new_ppage = *ppage;
+
+        if (PPAGE_IS_RESIDENT(new_ppage)) {
+                /*
+                 * Share the frame copy-on-write. vm_fault maps shared
+                 * frames read-only, and copies them on the first write.
+                 */
+                coremap_share(new_ppage, copy->ac_old, copy->ac_new, vpage);
+        }
+        else if (PPAGE_IS_SWAPPED(new_ppage)) {
+                /* Each page file slot has a single owner */
+                const pfid copy = page_file_copy(PPAGE_TO_PFID(new_ppage));
+                if (copy == PF_INVALID) {
+                        return ENOMEM;
+                }
+                new_ppage = PPAGE_SWAPPED(copy);
+        }
+
+        const int result = page_table_write(new_pt, vpage, new_ppage);
+        if (result) {
+                /* Undo the share or the copy; as_copy destroys the rest */
+                if (PPAGE_IS_RESIDENT(new_ppage)) {
+                        coremap_decref_owner(new_ppage, copy->ac_new);
+                }
+                else if (PPAGE_IS_SWAPPED(new_ppage)) {
+                        page_file_free(PPAGE_TO_PFID(new_ppage));
+                }
+        }
+        return result;
+}
+
 int
 as_copy(struct addrspace* old, struct addrspace** ret)
 {
         DEBUG(DB_VM, "vm: as_copy()\n");
 
-        *ret = as_create();
-        if (*ret == NULL) {
+        struct addrspace* new = as_create();
+        if (new == NULL) {
+                *ret = NULL;
                 return ENOMEM;
         }
+        *ret = new;
+
+        /* Keep the pages of the old address space from being evicted */
+        lock_acquire(old->as_lock);
 
         // copy the heap boundaries
         (*ret)->as_heap_start = old->as_heap_start;
         (*ret)->as_heap_end = old->as_heap_end;
+        (*ret)->as_stack_limit = old->as_stack_limit;
 
-        page_table* new_pt = &(*ret)->as_page_table;
-
-        const page_table* old_pt = &old->as_page_table;
-        const page_mapping* old_mappings = old_pt->pt_mappings;
-        const unsigned old_capacity = old_pt->pt_capacity;
-
-        for (unsigned i = 0; i < old_capacity; ++i) {
-
-                const page_mapping* old_mapping = old_mappings + i;
+        // share the executable segments
+        for (unsigned i = 0; i < old->as_nsegments; ++i) {
+                (*ret)->as_segments[i] = old->as_segments[i];
+                VOP_INCREF(old->as_segments[i].seg_vnode);
+        }
+        (*ret)->as_nsegments = old->as_nsegments;
 
-                if (!page_mapping_is_valid(old_mapping)) {
-                        continue;
+        // and the regions
+        if (old->as_nregions > 0) {
+                new->as_regions = kmalloc(old->as_nregions * sizeof(struct as_region));
+                if (new->as_regions == NULL) {
+                        lock_release(old->as_lock);
+                        as_destroy(new);
+                        *ret = NULL;
+                        return ENOMEM;
                 }
+                memcpy(new->as_regions, old->as_regions,
+                       old->as_nregions * sizeof(struct as_region));
+                new->as_nregions = old->as_nregions;
+                new->as_maxregions = old->as_nregions;
 
-                const vpage_t old_vpage = old_mapping->pm_vpage;
-                const ppage_t old_ppage = old_mapping->pm_ppage;
+                for (unsigned i = 0; i < new->as_nregions; ++i) {
+                        if (new->as_regions[i].ar_kind == AS_REGION_FILE) {
+                                VOP_INCREF(new->as_regions[i].ar_vnode);
+                        }
+                }
+        }
 
-                const ppage_t new_ppage = copy_to_new_page(old_ppage);
+        struct as_copy copy = { old, new };
+        int result = page_table_iterate(&old->as_page_table, 0, PT_VPAGE_LIMIT,
+                                        as_copy_mapping, &copy);
+        if (result) {
+                lock_release(old->as_lock);
+                as_destroy(new);
+                *ret = NULL;
+                return result;
+        }
 
-                /*
-                 * TODO: if the old page is valid and the new page is invalid
-                 * then we have run out of pages
-                 */
+        /*
+         * The parent may still have writeable TLB entries for the frames
+         * that are now shared, here and on any cpu it ran on before.
+         */
+        vm_tlbshootdown_as(old);
 
-                page_table_write(new_pt, old_vpage, new_ppage);
-        }
+        lock_release(old->as_lock);
 
         DEBUG(DB_VM, "vm: as_copy() done\n");
 
@@ -187,9 +1012,9 @@ as_copy(struct addrspace* old, struct addrspace** ret)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. vm_fault
+ * refuses writes to regions that are not writeable; the TLB has no way
+ * to refuse execution, so EXECUTABLE is only recorded.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t size,
@@ -206,35 +1031,38 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t size,
               ")\n",
               vaddr, size, readable, writeable, executable);
 
-	/* Not using these yet - all pages are read-write */
-	(void)readable;
-	(void)writeable;
-	(void)executable;
+        if (size == 0) {
+                return 0;
+        }
+        if (vaddr + size < vaddr || vaddr + size > USERSPACETOP) {
+                return EFAULT;
+        }
 
-        page_table* pt = &as->as_page_table;
+        const unsigned perms = (readable ? AS_REGION_READ : 0) |
+                (writeable ? AS_REGION_WRITE : 0) |
+                (executable ? AS_REGION_EXEC : 0);
 
-        const vaddr_t vaddr_max = vaddr + size - 1;
+        /* Whole pages; no page table entries until the pages are touched */
+        const vaddr_t start = vaddr & PAGE_FRAME;
+        const vaddr_t end = (vaddr + size + PAGE_SIZE - 1) & PAGE_FRAME;
 
-        const vpage_t vpage_min = addr_to_page(vaddr);
-        const vpage_t vpage_max = addr_to_page(vaddr_max);
+        lock_acquire(as->as_lock);
 
-        /* Reserve virtual pages for the region */
-        for (vpage_t vpage = vpage_min; vpage <= vpage_max; ++vpage) {
-                reserve_vpage(pt, vpage);
-        }
+        const int result = as_insert_region(as, start, end, perms, AS_REGION_ANON);
 
         /* check if this region extends past our current heap start, if so, move */
         /* the heap start further up, we can do this because regions are */
         /* never defined when the heap is in use */
-        while ( vaddr_max >= as->as_heap_start  ) {
-                as->as_heap_start += PAGE_SIZE;
+        if (result == 0 && end > as->as_heap_start) {
+                as->as_heap_start = end;
                 as->as_heap_end = as->as_heap_start;
         }
 
+        lock_release(as->as_lock);
 
         DEBUG(DB_VM, "vm: as_define_region() done\n");
 
-        return 0;
+        return result;
 }
 struct addrspace *
 as_create(void)
@@ -246,9 +1074,14 @@ as_create(void)
 		return NULL;
 	}
 
+        as->as_lock = lock_create("addrspace");
+        if (as->as_lock == NULL) {
+                kfree(as);
+                return NULL;
+        }
 
         /* My best guess for now of a good initial capacity */
-        page_table_init_with_capacity(&as->as_page_table, 32);
+        page_table_init_default(&as->as_page_table, 32);
 
         /* the heap starts at 0, and if any region is defined (excluding the */
         /* stack) the heap start is moved to the next free page */
@@ -256,15 +1089,104 @@ as_create(void)
         as->as_heap_start = 0;
         as->as_heap_end = as->as_heap_start;
 
+        /* No stack yet, see as_define_stack */
+        as->as_stack_limit = USERSTACK;
+
+        as->as_nsegments = 0;
+
+        as->as_regions = NULL;
+        as->as_nregions = 0;
+        as->as_maxregions = 0;
+
+        /* No ASID on any cpu yet */
+        for (unsigned i = 0; i < MAXCPUS; ++i) {
+                as->as_asid[i] = 0;
+                as->as_asid_generation[i] = 0;
+        }
+        as->as_cpus = 0;
+
+        as->as_tlb_misses = 0;
+        as->as_soft_misses = 0;
+        as->as_preloaded = 0;
+        as->as_ra_next = VPAGE_INVALID;
+        as->as_ra_window = 0;
+        as->as_ra_issued = 0;
+        as->as_ra_used = 0;
+
         DEBUG(DB_VM, "vm: as_create() done\n");
 
 	return as;
 }
 
+int
+as_release_mapping(vpage_t vpage, ppage_t* ppage, void* data)
+{
+        (void)vpage;
+        struct addrspace* as = data;
+
+        if (PPAGE_IS_RESIDENT(*ppage)) {
+                coremap_decref_owner(*ppage, as);
+        }
+        else if (PPAGE_IS_SWAPPED(*ppage)) {
+                page_file_free(PPAGE_TO_PFID(*ppage));
+        }
+        *ppage = PPAGE_INVALID;
+        return 0;
+}
+
 void
 as_destroy(struct addrspace *as)
 {
-        /* TODO: free the used page frames! */
+        if (as == NULL) {
+                return;
+        }
+
+        /*
+         * Drop our reference to each resident frame. Frames still shared
+         * copy-on-write with another address space stay with it. Holding
+         * the lock keeps the clock from evicting the frames meanwhile.
+         */
+        lock_acquire(as->as_lock);
+
+        /* No thread runs in here any more to write to the pages meanwhile */
+        for (unsigned i = 0; i < as->as_nregions; ++i) {
+                const struct as_region* region = as->as_regions + i;
+                if (region->ar_shared) {
+                        as_write_back_region(as, region, region->ar_start,
+                                             region->ar_end);
+                }
+        }
+
+        page_table_iterate(&as->as_page_table, 0, PT_VPAGE_LIMIT,
+                           as_release_mapping, as);
+
+        DEBUG(DB_VM, "vm: as %p: %u TLB misses, %u on resident pages, "
+              "%u entries preloaded around them, at most %u pages resident\n",
+              as, as->as_tlb_misses, as->as_soft_misses, as->as_preloaded,
+              page_table_resident_max(&as->as_page_table));
+
+        /* Every frame and page file slot went back with the mappings */
+        KASSERT(page_table_resident(&as->as_page_table) == 0);
+        KASSERT(page_table_swapped(&as->as_page_table) == 0);
+
+        lock_release(as->as_lock);
+        lock_destroy(as->as_lock);
+
+        /* Cpus that still have our ASID loaded must not refer to us */
+        vm_forget(as);
+
+        for (unsigned i = 0; i < as->as_nsegments; ++i) {
+                VOP_DECREF(as->as_segments[i].seg_vnode);
+        }
+        for (unsigned i = 0; i < as->as_nregions; ++i) {
+                if (as->as_regions[i].ar_kind == AS_REGION_FILE) {
+                        VOP_DECREF(as->as_regions[i].ar_vnode);
+                }
+        }
+
+        if (as->as_regions != NULL) {
+                kfree(as->as_regions);
+        }
         page_table_cleanup(&as->as_page_table);
 	kfree(as);
 }
@@ -272,29 +1194,21 @@ as_destroy(struct addrspace *as)
 void
 as_activate(void)
 {
+        struct addrspace* as = proc_getas();
+        if (as == NULL) {
+                /*
+                 * Kernel thread without an address space; leave the
+                 * prior address space in place.
+                 */
+                return;
+        }
+
         /*
-         * TLB PID Note 2
-         * Although I am setting and would like to rely on the PID field
-         * in the TLB EHI word, it does not appear to work. For this
-         * reason I am falling back on clearing the TLB after every
-         * process switch (as did DUMBVM).
-         *
-         * Documentation:
-         *
-         * Question on piazza (as to why it doesn't work):
-         *     https://piazza.com/class/jlpfhk5mesk6s0?cid=1143
-         *
-         * See TLB PID Note 1.
+         * TLB entries are tagged with the ASID of their address space, so
+         * switching to another one, or back to the same one, does not
+         * flush the TLB. See vm_activate.
          */
-
-	const int spl = splhigh();
-
-	/* Disable interrupts on this CPU while clearing the TLB. */
-	for (int i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
+        vm_activate(as);
 }
 
 void
@@ -3,17 +3,84 @@
 #include <spl.h>
 #include <proc.h>
 #include <current.h>
+#include <cpu.h>
+#include <platform/maxcpus.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <page_table.h>
 
 #include <vm.h>
 #include <coremap.h>
+#include <page_file.h>
+#include <pageout.h>
+#include <clock.h>
 
 #include <spinlock.h>
+#include <wchan.h>
+#include <synch.h>
+
+/*
+ * The coremap doubles as a binary buddy allocator for page frames.
+ *
+ * Page frames are grouped into blocks of 2^order pages, aligned to their
+ * size (relative to the first managed page frame). Each free block is kept
+ * on the free list for its order; the list links live in the coremap entry
+ * of the first page of the block. Allocating takes the smallest block that
+ * is large enough and splits it, freeing merges a block with its buddy for
+ * as long as the buddy is free as well. Both are O(log n).
+ *
+ * Requests that are not a power of two are rounded up to the next block,
+ * and the unused tail of the block is handed straight back to the free
+ * lists, so nothing is wasted.
+ */
+
+#define CME_NONE -1 /* End of a free list */
 
 typedef struct {
         pid_t cme_pid;
+
+        /* First page of a claimed run: the number of pages claimed. 0 otherwise */
+        unsigned cme_npages;
+
+        /* Number of page table entries mapping this frame (copy-on-write) */
+        unsigned cme_refcount;
+
+        /*
+         * The address space and virtual page mapping this frame, if it is a
+         * user frame that may be evicted. NULL for kernel and free frames,
+         * for shared frames other than fork pairs, and for frames being
+         * evicted.
+         */
+        struct addrspace* cme_as;
+        vpage_t cme_vpage;
+
+        /*
+         * A fork pair: the other address space mapping the frame at
+         * cme_vpage, which it shares copy-on-write with cme_as and nothing
+         * else. NULL unless cme_refcount is 2, see coremap_share.
+         */
+        struct addrspace* cme_sharer;
+
+        /* Was the frame used since the clock hand last passed it? */
+        bool cme_referenced;
+
+        /*
+         * Was the frame written to since it was filled? Frames are mapped
+         * read-only until they are, see vm_fault.
+         */
+        bool cme_dirty;
+
+        /* A page file slot holding the same contents, if clean. Owned */
+        pfid cme_swap_copy;
+
+        /* Read in ahead of a fault, and not used since; see vm_fault */
+        bool cme_readahead;
+
+        /* First page of a free block: its order and free list links */
+        bool cme_free;
+        unsigned cme_order;
+        ppage_t cme_next;
+        ppage_t cme_prev;
 } core_map_entry;
 
 
@@ -22,11 +89,260 @@ static core_map_entry* core_map = NULL;
 static ppage_t coremap_first_page = 0; /* Index of the first page frame available */
 static ppage_t coremap_last_page = 0;  /* One past the last page frame available */
 
+/* Heads of the free lists, one for each block order */
+static ppage_t free_list[COREMAP_ORDERS];
+static unsigned free_list_length[COREMAP_ORDERS];
+static size_t free_page_count = 0;
+
 /*
  * Wrap ram_stealmem in a spinlock.
  */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
+/*
+ * Per-CPU magazines of free single page frames.
+ *
+ * Single page claims and frees go to the magazine of the current CPU, which
+ * is refilled from (or drained to) the buddy allocator MAGAZINE_BATCH pages
+ * at a time. Only refills and drains take stealmem_lock.
+ *
+ * Each magazine has its own spinlock so that a CPU which finds the buddy
+ * allocator empty can take back the pages cached by the other CPUs. The
+ * lock is uncontended otherwise. Lock order: magazine, then stealmem_lock.
+ *
+ * Pages in a magazine are claimed as far as the buddy allocator is concerned.
+ */
+#define MAGAZINE_SIZE 32
+#define MAGAZINE_BATCH 16
+
+struct page_magazine {
+        struct spinlock pm_lock;
+        ppage_t pm_pages[MAGAZINE_SIZE]; /* Indexes into the core_map */
+        unsigned pm_count;
+
+        /* Statistics */
+        unsigned pm_hits;    /* Claims served from the magazine */
+        unsigned pm_misses;  /* Claims that needed a refill first */
+        unsigned pm_refills; /* Batches taken from the buddy allocator */
+        unsigned pm_drains;  /* Batches given back to the buddy allocator */
+};
+
+static struct page_magazine magazines[MAXCPUS];
+
+/*
+ * Protects the reference counts and owners of claimed frames, and the
+ * clock hand.
+ */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Page replacement uses the clock algorithm. The hand sweeps over the
+ * coremap, giving a second chance to frames that were referenced since it
+ * last passed them and evicting the first one that was not.
+ */
+static ppage_t clock_hand = 0; /* Index into the core_map */
+
+/* Statistics */
+static unsigned clean_evictions = 0; /* Evictions without I/O */
+static unsigned dirty_evictions = 0; /* Evictions that wrote the page out */
+static unsigned eviction_failures = 0;
+static unsigned pair_evictions = 0;  /* Fork pairs evicted from both sides */
+static unsigned direct_reclaims = 0; /* Evictions by faulting threads */
+static unsigned readahead_pages = 0;  /* Frames filled ahead of a fault */
+static unsigned readahead_used = 0;   /* ... that were used afterwards */
+static unsigned readahead_wasted = 0; /* ... that were let go unused */
+
+/*
+ * A frame of zeros, mapped read-only at every anonymous page that has
+ * been read but never written. We hold a reference to it, so it always
+ * looks shared: it is never evicted, and the first write to one of its
+ * mappings takes a private copy through the copy-on-write path.
+ * Its statistics are protected by coremap_lock.
+ */
+static ppage_t zero_page = PPAGE_INVALID;
+static unsigned zero_page_maps = 0;   /* Read faults it served */
+static unsigned zero_page_copies = 0; /* Mappings broken by a write */
+
+/*
+ * Frames zeroed ahead of time, so that the first touch of an anonymous
+ * page need not zero one. The prezero thread fills the pool only while
+ * its cpu has nothing else to run and memory is plentiful, and a claim
+ * that finds no free frame takes one back before evicting anything.
+ * Between fills the thread sleeps on zero_pool_wchan, and claims wake it
+ * once the pool is half empty, if memory is plentiful by then. The pool, and the statistics below, are
+ * protected by zero_pool_lock.
+ */
+#define ZERO_POOL_SIZE 32
+
+static struct spinlock zero_pool_lock = SPINLOCK_INITIALIZER;
+static ppage_t zero_pool[ZERO_POOL_SIZE];
+static unsigned zero_pool_count = 0;
+static struct wchan* zero_pool_wchan = NULL;
+static bool zero_pool_sleeping = false;
+
+static unsigned zero_pool_hits = 0;      /* Zeroed frames taken from the pool */
+static unsigned zero_pool_empty = 0;     /* Claims that found it empty */
+static unsigned zero_pool_filled = 0;    /* Frames zeroed ahead of time */
+static unsigned zero_pool_reclaimed = 0; /* Taken back for lack of free frames */
+
+/*
+ * Time spent in faults on anonymous pages, from the pool [1] or not [0].
+ * Timing takes two clock reads per fault, so it is off unless turned on
+ * with coremap_set_zero_timing. Each cpu counts in its own entry, with
+ * interrupts off; coremap_printstats adds them up.
+ */
+struct zero_fault_stats {
+        struct timespec zf_time[2];
+        unsigned zf_faults[2];
+};
+
+static struct zero_fault_stats zero_fault_stats[MAXCPUS];
+static volatile bool zero_fault_timing = false;
+
+/* How far ahead of the clock hand to look for pages to cluster */
+#define COREMAP_CLUSTER_SCAN 64
+
+/* The magazine of the current CPU. The boot CPU's is used until curcpu exists */
+static
+struct page_magazine*
+magazine_of_curcpu(void)
+{
+        return magazines + (CURCPU_EXISTS() ? curcpu->c_number : 0);
+}
+
+// ~~~~~ Buddy Allocator ~~~~~~~
+/* All of these must be called with stealmem_lock held */
+
+/* The smallest order with 2^order >= npages */
+static
+unsigned
+order_for_pages(unsigned npages)
+{
+        unsigned order = 0;
+        while ((1U << order) < npages) {
+                ++order;
+        }
+        return order;
+}
+
+static
+void
+free_list_push(ppage_t i, unsigned order)
+{
+        core_map_entry* cme = core_map + i;
+
+        cme->cme_free = true;
+        cme->cme_order = order;
+        cme->cme_prev = CME_NONE;
+        cme->cme_next = free_list[order];
+
+        if (free_list[order] != CME_NONE) {
+                core_map[free_list[order]].cme_prev = i;
+        }
+        free_list[order] = i;
+        free_list_length[order] += 1;
+        free_page_count += 1U << order;
+}
+
+static
+void
+free_list_remove(ppage_t i)
+{
+        core_map_entry* cme = core_map + i;
+        const unsigned order = cme->cme_order;
+
+        KASSERT(cme->cme_free);
+
+        if (cme->cme_prev != CME_NONE) {
+                core_map[cme->cme_prev].cme_next = cme->cme_next;
+        }
+        else {
+                free_list[order] = cme->cme_next;
+        }
+        if (cme->cme_next != CME_NONE) {
+                core_map[cme->cme_next].cme_prev = cme->cme_prev;
+        }
+
+        cme->cme_free = false;
+        free_list_length[order] -= 1;
+        free_page_count -= 1U << order;
+}
+
+/*
+ * Takes a block of 2^order pages off the free lists, splitting a larger
+ * block if need be. Returns CME_NONE if there is no large enough block.
+ */
+static
+ppage_t
+buddy_alloc_block(unsigned order)
+{
+        unsigned k = order;
+        while (k < COREMAP_ORDERS && free_list[k] == CME_NONE) {
+                ++k;
+        }
+        if (k == COREMAP_ORDERS) {
+                return CME_NONE;
+        }
+
+        const ppage_t i = free_list[k];
+        free_list_remove(i);
+
+        /* Give back the upper halves until the block is the right size */
+        while (k > order) {
+                --k;
+                free_list_push(i + (1 << k), k);
+        }
+        return i;
+}
+
+/*
+ * Puts a block of 2^order pages back on the free lists, merging it with its
+ * buddy for as long as the buddy is free and of the same order.
+ */
+static
+void
+buddy_free_block(ppage_t i, unsigned order)
+{
+        const ppage_t npages = hardware_pages_available();
+
+        while (order + 1 < COREMAP_ORDERS) {
+                const ppage_t buddy = i ^ (1 << order);
+
+                if (buddy >= npages ||
+                    !core_map[buddy].cme_free ||
+                    core_map[buddy].cme_order != order) {
+                        break;
+                }
+                free_list_remove(buddy);
+                i = min(i, buddy);
+                ++order;
+        }
+        free_list_push(i, order);
+}
+
+/*
+ * Frees the pages [begin, end) as the largest aligned blocks that fit.
+ */
+static
+void
+buddy_free_range(ppage_t begin, ppage_t end)
+{
+        while (begin < end) {
+                unsigned order = 0;
+                while (order + 1 < COREMAP_ORDERS &&
+                       (begin & ((2 << order) - 1)) == 0 &&
+                       begin + (2 << order) <= end) {
+                        ++order;
+                }
+                buddy_free_block(begin, order);
+                begin += 1 << order;
+        }
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+static ppage_t buddy_claim(unsigned npages);
+
 void coremap_bootstrap(void) {
         /* On entry, there is no VM yet, so we cannot call kmalloc. */
         /* Instead, we use ram_stealmem. */
@@ -61,12 +377,49 @@ void coremap_bootstrap(void) {
         DEBUG(DB_VM, "coremap:  %p\n", core_map);
         DEBUG(DB_VM, "&coremap: %p\n", &core_map);
 
-        for (ppage_t i = 0; i < coremap_pages_required; ++i) {
-                core_map[i].cme_pid = PID_KERN;
+        for (unsigned order = 0; order < COREMAP_ORDERS; ++order) {
+                free_list[order] = CME_NONE;
+                free_list_length[order] = 0;
         }
-        for (ppage_t i = coremap_pages_required; i < num_hardware_pages; ++i) {
-                core_map[i].cme_pid = PID_INVALID;
+
+        for (ppage_t i = 0; i < num_hardware_pages; ++i) {
+                core_map[i].cme_pid = i < coremap_pages_required ? PID_KERN : PID_INVALID;
+                core_map[i].cme_npages = 0;
+                core_map[i].cme_refcount = 0;
+                core_map[i].cme_as = NULL;
+                core_map[i].cme_vpage = VPAGE_INVALID;
+                core_map[i].cme_sharer = NULL;
+                core_map[i].cme_referenced = false;
+                core_map[i].cme_dirty = false;
+                core_map[i].cme_swap_copy = PF_INVALID;
+                core_map[i].cme_readahead = false;
+                core_map[i].cme_free = false;
+                core_map[i].cme_order = 0;
+                core_map[i].cme_next = CME_NONE;
+                core_map[i].cme_prev = CME_NONE;
+        }
+        for (unsigned i = 0; i < MAXCPUS; ++i) {
+                spinlock_init(&magazines[i].pm_lock);
+                magazines[i].pm_count = 0;
+                magazines[i].pm_hits = 0;
+                magazines[i].pm_misses = 0;
+                magazines[i].pm_refills = 0;
+                magazines[i].pm_drains = 0;
         }
+
+        /* The coremap's own pages are never freed */
+        core_map[0].cme_npages = coremap_pages_required;
+
+        buddy_free_range(coremap_pages_required, num_hardware_pages);
+
+        /* Too early for the magazines, take the zero page from the buddies */
+        const ppage_t zero_index = buddy_claim(1);
+        KASSERT(zero_index != CME_NONE);
+        core_map[zero_index].cme_refcount = 1;
+        zero_page = zero_index + coremap_first_page;
+        bzero((void*)PADDR_TO_KVADDR(page_to_addr(zero_page)), PAGE_SIZE);
+
+	DEBUG(DB_VM, "Free pages:  %zu\n", free_page_count);
 }
 
 /* The number of hardware pages available to the vm system */
@@ -104,6 +457,9 @@ vaddr_t
 alloc_kpages(unsigned npages)
 {
         const paddr_t pa = getppages(npages);
+        if (pa == 0) {
+                return 0;
+        }
 
 	return PADDR_TO_KVADDR(pa);
 }
@@ -115,52 +471,1109 @@ alloc_kpages(unsigned npages)
 void
 free_kpages(vaddr_t vaddr)
 {
-        const ppage_t page = addr_to_page(KVADDR_TO_PADDR(vaddr));
+        free_pages(addr_to_page(KVADDR_TO_PADDR(vaddr)));
+}
 
-        spinlock_acquire(&stealmem_lock);
-        core_map[page - coremap_first_page].cme_pid = PID_INVALID;
-        spinlock_release(&stealmem_lock);
+/*
+ * Claims pages from the buddy allocator. Called with stealmem_lock held.
+ * Returns an index into the core_map, or CME_NONE.
+ */
+static
+ppage_t
+buddy_claim(unsigned npages)
+{
+        const unsigned order = order_for_pages(npages);
+        if (order >= COREMAP_ORDERS) {
+                return CME_NONE;
+        }
+
+        const ppage_t first_free_index = buddy_alloc_block(order);
+
+        if (first_free_index == CME_NONE) {
+                return CME_NONE;
+        }
+
+        const ppage_t imax = first_free_index + npages;
+        for (ppage_t i = first_free_index; i < imax; ++i) {
+                core_map[i].cme_pid = PID_KERN;
+        }
+        core_map[first_free_index].cme_npages = npages;
+
+        /* Return the part of the block that was not asked for */
+        buddy_free_range(imax, first_free_index + (1 << order));
+
+        return first_free_index;
+}
+
+/*
+ * Frees pages claimed with buddy_claim. Called with stealmem_lock held.
+ */
+static
+void
+buddy_release(ppage_t first)
+{
+        const unsigned npages = core_map[first].cme_npages;
+        KASSERTM(npages > 0, "ppage 0x%x was not claimed", first + coremap_first_page);
+
+        core_map[first].cme_npages = 0;
+        for (ppage_t i = first; i < first + (ppage_t)npages; ++i) {
+                core_map[i].cme_pid = PID_INVALID;
+        }
+        buddy_free_range(first, first + npages);
+}
+
+/*
+ * Gives every page cached in every magazine back to the buddy allocator.
+ * Used when the buddy allocator alone cannot satisfy a claim.
+ */
+static
+void
+magazines_drain_all(void)
+{
+        for (unsigned c = 0; c < MAXCPUS; ++c) {
+                struct page_magazine* mag = magazines + c;
+
+                spinlock_acquire(&mag->pm_lock);
+                if (mag->pm_count > 0) {
+                        spinlock_acquire(&stealmem_lock);
+                        while (mag->pm_count > 0) {
+                                buddy_release(mag->pm_pages[--mag->pm_count]);
+                        }
+                        spinlock_release(&stealmem_lock);
+                        mag->pm_drains += 1;
+                }
+                spinlock_release(&mag->pm_lock);
+        }
 }
 
-page_t
-find_free_coremap_entries(unsigned npages)
+/*
+ * Claims a single page through the current CPU's magazine.
+ */
+static
+ppage_t
+magazine_claim(void)
 {
-        const ppage_t imax = hardware_pages_available() - npages + 1;
-        for (ppage_t i = 0; i < imax; ++i) {
+        struct page_magazine* mag = magazine_of_curcpu();
+
+        spinlock_acquire(&mag->pm_lock);
 
-                const ppage_t jmax = i + npages;
-                for (ppage_t j = i; j < jmax; ++j) {
+        if (mag->pm_count > 0) {
+                mag->pm_hits += 1;
+        }
+        else {
+                mag->pm_misses += 1;
 
-                        if (core_map[j].cme_pid != PID_INVALID) {
-                                goto try_next;
+                spinlock_acquire(&stealmem_lock);
+                while (mag->pm_count < MAGAZINE_BATCH) {
+                        const ppage_t i = buddy_claim(1);
+                        if (i == CME_NONE) {
+                                break;
                         }
+                        mag->pm_pages[mag->pm_count++] = i;
+                }
+                spinlock_release(&stealmem_lock);
+
+                if (mag->pm_count == 0) {
+                        spinlock_release(&mag->pm_lock);
+                        return CME_NONE;
+                }
+                mag->pm_refills += 1;
+        }
+
+        const ppage_t i = mag->pm_pages[--mag->pm_count];
+
+        spinlock_release(&mag->pm_lock);
+
+        return i;
+}
+
+/*
+ * Frees a single page to the current CPU's magazine.
+ */
+static
+void
+magazine_release(ppage_t i)
+{
+        struct page_magazine* mag = magazine_of_curcpu();
+
+        spinlock_acquire(&mag->pm_lock);
+
+        if (mag->pm_count == MAGAZINE_SIZE) {
+                /* Full: give the oldest half back to the buddy allocator */
+                mag->pm_drains += 1;
+
+                spinlock_acquire(&stealmem_lock);
+                for (unsigned j = 0; j < MAGAZINE_BATCH; ++j) {
+                        buddy_release(mag->pm_pages[j]);
                 }
-                return i;
+                spinlock_release(&stealmem_lock);
 
-        try_next:
-                continue;
+                mag->pm_count -= MAGAZINE_BATCH;
+                memmove(mag->pm_pages, mag->pm_pages + MAGAZINE_BATCH,
+                        mag->pm_count * sizeof(ppage_t));
         }
-        return PPAGE_INVALID;
+        mag->pm_pages[mag->pm_count++] = i;
+
+        spinlock_release(&mag->pm_lock);
 }
 
 ppage_t
 claim_free_pages(unsigned npages)
 {
+        KASSERT(npages > 0);
+
+        if (npages == 1) {
+                ppage_t i = magazine_claim();
+                if (i == CME_NONE) {
+                        /* Free pages may be sitting in other CPUs' magazines */
+                        magazines_drain_all();
+                        i = magazine_claim();
+                }
+                if (i == CME_NONE) {
+                        pageout_check(0);
+                        return PPAGE_INVALID;
+                }
+                core_map[i].cme_refcount = 1;
+                core_map[i].cme_dirty = false;
+
+                /*
+                 * Count the pages in the magazines too, as the daemon does
+                 * when it decides to stop, or pages cached there could keep
+                 * waking it up for nothing.
+                 */
+                pageout_check(coremap_free_page_count());
+                return i + coremap_first_page;
+        }
+
 	spinlock_acquire(&stealmem_lock);
+        ppage_t first_free_index = buddy_claim(npages);
+	spinlock_release(&stealmem_lock);
 
-        const page_t first_free_index = find_free_coremap_entries(npages);
+        if (first_free_index == CME_NONE) {
+                magazines_drain_all();
 
-        if (first_free_index == PPAGE_INVALID) {
+                spinlock_acquire(&stealmem_lock);
+                first_free_index = buddy_claim(npages);
                 spinlock_release(&stealmem_lock);
+
+                if (first_free_index == CME_NONE) {
+                        return PPAGE_INVALID;
+                }
+        }
+        core_map[first_free_index].cme_refcount = 1;
+        pageout_check(coremap_free_page_count());
+
+	return first_free_index + coremap_first_page;
+}
+
+void
+free_pages(ppage_t ppage)
+{
+        const ppage_t first = ppage - coremap_first_page;
+
+        KASSERT(first >= 0 && (size_t)first < hardware_pages_available());
+
+        /* The entry belongs to the caller until it is released */
+        core_map[first].cme_refcount = 0;
+        core_map[first].cme_as = NULL;
+        core_map[first].cme_sharer = NULL;
+        pageout_progress();
+        if (core_map[first].cme_npages == 1) {
+                magazine_release(first);
+                return;
+        }
+
+        spinlock_acquire(&stealmem_lock);
+        buddy_release(first);
+        spinlock_release(&stealmem_lock);
+}
+
+static
+core_map_entry*
+coremap_entry(ppage_t ppage)
+{
+        const ppage_t i = ppage - coremap_first_page;
+
+        KASSERT(i >= 0 && (size_t)i < hardware_pages_available());
+        KASSERTM(core_map[i].cme_npages == 1,
+                 "ppage 0x%x is not a claimed single page", ppage);
+
+        return core_map + i;
+}
+
+void
+coremap_incref(ppage_t ppage)
+{
+        core_map_entry* cme = coremap_entry(ppage);
+
+        spinlock_acquire(&coremap_lock);
+        KASSERT(cme->cme_refcount > 0);
+        cme->cme_refcount += 1;
+        /* Shared frames other than fork pairs are not evicted */
+        cme->cme_as = NULL;
+        cme->cme_sharer = NULL;
+        spinlock_release(&coremap_lock);
+}
+
+void
+coremap_share(ppage_t ppage, struct addrspace* as, struct addrspace* other,
+              vpage_t vpage)
+{
+        core_map_entry* cme = coremap_entry(ppage);
+
+        spinlock_acquire(&coremap_lock);
+        KASSERT(cme->cme_refcount > 0);
+        cme->cme_refcount += 1;
+        if (cme->cme_refcount == 2) {
+                cme->cme_as = as;
+                cme->cme_vpage = vpage;
+                cme->cme_sharer = other;
+                pageout_progress();
+        }
+        else {
+                cme->cme_as = NULL;
+                cme->cme_sharer = NULL;
+        }
+        spinlock_release(&coremap_lock);
+}
+
+/*
+ * Drops a reference to the frame, held by a mapping in as if as is not
+ * NULL. See coremap_decref and coremap_decref_owner.
+ */
+static
+void
+coremap_drop(ppage_t ppage, struct addrspace* as)
+{
+        core_map_entry* cme = coremap_entry(ppage);
+
+        spinlock_acquire(&coremap_lock);
+        KASSERT(cme->cme_refcount > 0);
+        cme->cme_refcount -= 1;
+        if (cme->cme_sharer != NULL) {
+                /* The pair breaks up; the side that stays keeps the frame */
+                struct addrspace* stays = NULL;
+                if (as == cme->cme_as) {
+                        stays = cme->cme_sharer;
+                }
+                else if (as == cme->cme_sharer) {
+                        stays = cme->cme_as;
+                }
+                cme->cme_as = stays;
+                cme->cme_sharer = NULL;
+        }
+        const bool unreferenced = cme->cme_refcount == 0;
+        pfid swap_copy = PF_INVALID;
+        if (unreferenced) {
+                cme->cme_as = NULL;
+                swap_copy = cme->cme_swap_copy;
+                cme->cme_swap_copy = PF_INVALID;
+                if (cme->cme_readahead) {
+                        cme->cme_readahead = false;
+                        readahead_wasted += 1;
+                }
+        }
+        spinlock_release(&coremap_lock);
+
+        if (swap_copy != PF_INVALID) {
+                page_file_free(swap_copy);
+        }
+        if (unreferenced) {
+                free_pages(ppage);
+        }
+}
+
+void
+coremap_decref(ppage_t ppage)
+{
+        coremap_drop(ppage, NULL);
+}
+
+void
+coremap_decref_owner(ppage_t ppage, struct addrspace* as)
+{
+        KASSERT(as != NULL);
+        coremap_drop(ppage, as);
+}
+
+bool
+coremap_is_shared(ppage_t ppage)
+{
+        core_map_entry* cme = coremap_entry(ppage);
+
+        spinlock_acquire(&coremap_lock);
+        const bool shared = cme->cme_refcount > 1;
+        spinlock_release(&coremap_lock);
+
+        return shared;
+}
+
+bool
+coremap_is_dirty(ppage_t ppage)
+{
+        core_map_entry* cme = coremap_entry(ppage);
+
+        spinlock_acquire(&coremap_lock);
+        const bool dirty = cme->cme_dirty;
+        spinlock_release(&coremap_lock);
+
+        return dirty;
+}
+
+void
+coremap_set_dirty(ppage_t ppage)
+{
+        core_map_entry* cme = coremap_entry(ppage);
+
+        spinlock_acquire(&coremap_lock);
+        /* Only the frames of a MAP_SHARED file are written while shared */
+        KASSERT(cme->cme_refcount > 0);
+        cme->cme_dirty = true;
+        /* The copy in the page file is stale now */
+        const pfid swap_copy = cme->cme_swap_copy;
+        cme->cme_swap_copy = PF_INVALID;
+        spinlock_release(&coremap_lock);
+
+        if (swap_copy != PF_INVALID) {
+                page_file_free(swap_copy);
+        }
+}
+
+void
+coremap_clear_dirty(ppage_t ppage)
+{
+        core_map_entry* cme = coremap_entry(ppage);
+
+        spinlock_acquire(&coremap_lock);
+        KASSERT(cme->cme_swap_copy == PF_INVALID);
+        cme->cme_dirty = false;
+        spinlock_release(&coremap_lock);
+}
+
+void
+coremap_set_swap_copy(ppage_t ppage, pfid index)
+{
+        core_map_entry* cme = coremap_entry(ppage);
+
+        spinlock_acquire(&coremap_lock);
+        KASSERT(cme->cme_swap_copy == PF_INVALID);
+        KASSERT(!cme->cme_dirty);
+        cme->cme_swap_copy = index;
+        spinlock_release(&coremap_lock);
+}
+
+void
+coremap_set_readahead(ppage_t ppage)
+{
+        core_map_entry* cme = coremap_entry(ppage);
+
+        spinlock_acquire(&coremap_lock);
+        KASSERT(cme->cme_refcount == 1);
+        cme->cme_readahead = true;
+        /* Unused, it is the first to go */
+        cme->cme_referenced = false;
+        readahead_pages += 1;
+        spinlock_release(&coremap_lock);
+}
+
+bool
+coremap_is_readahead(ppage_t ppage)
+{
+        core_map_entry* cme = coremap_entry(ppage);
+
+        spinlock_acquire(&coremap_lock);
+        const bool readahead = cme->cme_readahead;
+        spinlock_release(&coremap_lock);
+
+        return readahead;
+}
+
+bool
+coremap_take_readahead(ppage_t ppage)
+{
+        core_map_entry* cme = coremap_entry(ppage);
+
+        spinlock_acquire(&coremap_lock);
+        const bool readahead = cme->cme_readahead;
+        if (readahead) {
+                cme->cme_readahead = false;
+                readahead_used += 1;
+        }
+        spinlock_release(&coremap_lock);
+
+        return readahead;
+}
+
+void
+coremap_set_owner(ppage_t ppage, struct addrspace* as, vpage_t vpage)
+{
+        core_map_entry* cme = coremap_entry(ppage);
+
+        spinlock_acquire(&coremap_lock);
+        if (cme->cme_refcount == 1) {
+                if (cme->cme_as == NULL) {
+                        /* Evictable from now on */
+                        pageout_progress();
+                }
+                cme->cme_as = as;
+                cme->cme_vpage = vpage;
+        }
+        cme->cme_referenced = true;
+        spinlock_release(&coremap_lock);
+}
+
+/*
+ * Hands a frame to as_evict_pages. Called with coremap_lock held.
+ */
+static
+void
+coremap_take_victim(ppage_t i, struct as_victim* victim)
+{
+        core_map_entry* cme = core_map + i;
+
+        /*
+         * The frame cannot become dirty meanwhile: only vm_fault maps it
+         * writeable, and it needs the address space lock we hold.
+         */
+        victim->av_vpage = cme->cme_vpage;
+        victim->av_ppage = i + coremap_first_page;
+        victim->av_dirty = cme->cme_dirty;
+        victim->av_swap_copy = cme->cme_swap_copy;
+        cme->cme_as = NULL;
+}
+
+/*
+ * Evicts a fork pair, taken by coremap_evict with both address space
+ * locks, from both sides, which it then releases. Each side needs a copy
+ * of its own, as page file slots have a single owner: the first takes
+ * the swap copy, if there is one, and the second is written out unless
+ * it can be read from its file again. Returns 1 and stores the frame in
+ * ppage, if it is free. If only the first side could be evicted, the
+ * frame stays with the second.
+ */
+static
+unsigned
+coremap_evict_pair(struct as_victim* first, struct addrspace* as,
+                   struct addrspace* sharer, ppage_t* ppage)
+{
+        struct as_victim second = *first;
+        second.av_dirty = first->av_dirty || first->av_swap_copy != PF_INVALID;
+        second.av_swap_copy = PF_INVALID;
+        second.av_evicted = false;
+
+        as_evict_pages(as, first, 1);
+        if (first->av_evicted) {
+                as_evict_pages(sharer, &second, 1);
+        }
+
+        spinlock_acquire(&coremap_lock);
+
+        core_map_entry* cme = core_map + (first->av_ppage - coremap_first_page);
+
+        if (!first->av_evicted) {
+                /* Put it back, the page file is full */
+                cme->cme_as = as;
+                cme->cme_sharer = sharer;
+                eviction_failures += 1;
+        }
+        else {
+                /* The first side's reference and swap copy are gone */
+                cme->cme_refcount = 1;
+                if (!first->av_dirty && first->av_swap_copy != PF_INVALID) {
+                        cme->cme_swap_copy = PF_INVALID;
+                }
+                if (first->av_written) {
+                        dirty_evictions += 1;
+                }
+                else {
+                        clean_evictions += 1;
+                }
+
+                if (!second.av_evicted) {
+                        cme->cme_as = sharer;
+                        eviction_failures += 1;
+                }
+                else {
+                        cme->cme_dirty = false;
+                        if (cme->cme_readahead) {
+                                cme->cme_readahead = false;
+                                readahead_wasted += 1;
+                        }
+                        if (second.av_written) {
+                                dirty_evictions += 1;
+                        }
+                        else {
+                                clean_evictions += 1;
+                        }
+                        pair_evictions += 1;
+                }
+        }
+
+        spinlock_release(&coremap_lock);
+
+        lock_release(sharer->as_lock);
+        lock_release(as->as_lock);
+
+        if (!second.av_evicted) {
+                return 0;
+        }
+        *ppage = first->av_ppage;
+        return 1;
+}
+
+/*
+ * Can the fork pair of the frame be evicted? Both address space locks are
+ * taken if so. Not if either is ours: our caller may be in the middle of
+ * copying the frame in vm_fault. Nor if it is in a MAP_SHARED mapping,
+ * where both sides must keep seeing the same frame. Called with
+ * coremap_lock held.
+ */
+static
+bool
+coremap_lock_pair(const core_map_entry* cme)
+{
+        struct addrspace* as = cme->cme_as;
+        struct addrspace* sharer = cme->cme_sharer;
+
+        if (lock_do_i_hold(as->as_lock) || lock_do_i_hold(sharer->as_lock)) {
+                return false;
+        }
+        if (!lock_tryacquire(as->as_lock)) {
+                return false;
+        }
+        if (!lock_tryacquire(sharer->as_lock)) {
+                lock_release(as->as_lock);
+                return false;
+        }
+
+        const vaddr_t vaddr = page_to_addr(cme->cme_vpage);
+        const struct as_region* region = as_region_of(as, vaddr);
+        const struct as_region* sharer_region = as_region_of(sharer, vaddr);
+        KASSERT(region != NULL && sharer_region != NULL);
+
+        if (region->ar_shared || sharer_region->ar_shared) {
+                lock_release(sharer->as_lock);
+                lock_release(as->as_lock);
+                return false;
+        }
+        return true;
+}
+
+/*
+ * Chooses victims with the clock algorithm and evicts them.
+ * The first victim is the first frame the hand finds unreferenced. Up to
+ * max - 1 more are taken from the frames of the same address space in the
+ * next COREMAP_CLUSTER_SCAN entries, so that they can be written out in a
+ * single clustered write. A fork pair is evicted on its own, from both
+ * address spaces, see coremap_evict_pair.
+ * Stores the evicted frames, which then belong to the caller, in ppages,
+ * and returns how many there are.
+ *
+ * The owner's address space lock is only tried, never waited for, so that
+ * the lock order of address spaces does not matter here; the caller may
+ * hold its own. Holding that lock keeps the owner from being destroyed, as
+ * as_destroy clears the owner of every frame before giving it up.
+ */
+static
+unsigned
+coremap_evict(ppage_t* ppages, unsigned max)
+{
+        KASSERT(max > 0 && max <= PF_BATCH_MAX);
+
+        const ppage_t npages = hardware_pages_available();
+
+        struct as_victim victims[PF_BATCH_MAX];
+        unsigned nvictims = 0;
+        struct addrspace* as = NULL;
+        bool acquired = false;
+
+        spinlock_acquire(&coremap_lock);
+
+        /* Two sweeps: the first may only be clearing referenced bits */
+        for (ppage_t scanned = 0; scanned < 2 * npages; ++scanned) {
+                const ppage_t i = clock_hand;
+                clock_hand = (clock_hand + 1) % npages;
+
+                core_map_entry* cme = core_map + i;
+
+                const bool pair = cme->cme_sharer != NULL;
+                if (cme->cme_as == NULL || cme->cme_refcount != (pair ? 2u : 1u)) {
+                        continue;
+                }
+                if (cme->cme_referenced) {
+                        cme->cme_referenced = false;
+                        continue;
+                }
+
+                if (pair) {
+                        if (!coremap_lock_pair(cme)) {
+                                continue;
+                        }
+                        struct addrspace* sharer = cme->cme_sharer;
+                        as = cme->cme_as;
+                        coremap_take_victim(i, victims);
+                        cme->cme_sharer = NULL;
+                        spinlock_release(&coremap_lock);
+
+                        return coremap_evict_pair(victims, as, sharer, ppages);
+                }
+
+                if (!lock_do_i_hold(cme->cme_as->as_lock)) {
+                        if (!lock_tryacquire(cme->cme_as->as_lock)) {
+                                continue;
+                        }
+                        acquired = true;
+                }
+
+                as = cme->cme_as;
+                coremap_take_victim(i, victims + nvictims++);
+                break;
+        }
+
+        if (as == NULL) {
+                eviction_failures += 1;
+                spinlock_release(&coremap_lock);
+                return 0;
+        }
+
+        /* Cluster: more idle pages of the same address space, just ahead */
+        for (ppage_t ahead = 0; ahead < COREMAP_CLUSTER_SCAN && nvictims < max; ++ahead) {
+                const ppage_t i = (clock_hand + ahead) % npages;
+
+                core_map_entry* cme = core_map + i;
+
+                if (cme->cme_as == as && cme->cme_refcount == 1 && !cme->cme_referenced) {
+                        coremap_take_victim(i, victims + nvictims++);
+                }
+        }
+
+        spinlock_release(&coremap_lock);
+
+        as_evict_pages(as, victims, nvictims);
+
+        unsigned nevicted = 0;
+
+        spinlock_acquire(&coremap_lock);
+        for (unsigned v = 0; v < nvictims; ++v) {
+
+                core_map_entry* cme = core_map + (victims[v].av_ppage - coremap_first_page);
+
+                if (!victims[v].av_evicted) {
+                        /* Put it back, the page file is full */
+                        cme->cme_as = as;
+                        eviction_failures += 1;
+                        continue;
+                }
+
+                /* The page table owns the swap copy now, if it was used */
+                if (!victims[v].av_dirty && victims[v].av_swap_copy != PF_INVALID) {
+                        cme->cme_swap_copy = PF_INVALID;
+                }
+                cme->cme_dirty = false;
+                if (cme->cme_readahead) {
+                        cme->cme_readahead = false;
+                        readahead_wasted += 1;
+                }
+
+                if (victims[v].av_written) {
+                        dirty_evictions += 1;
+                }
+                else {
+                        clean_evictions += 1;
+                }
+                ppages[nevicted++] = victims[v].av_ppage;
+        }
+        spinlock_release(&coremap_lock);
+
+        if (acquired) {
+                lock_release(as->as_lock);
+        }
+        return nevicted;
+}
+
+/*
+ * Takes a frame out of the zero pool. Returns PPAGE_INVALID if it is
+ * empty. Called with zero_pool_lock held.
+ */
+static
+ppage_t
+zero_pool_take(void)
+{
+        KASSERT(spinlock_do_i_hold(&zero_pool_lock));
+
+        if (zero_pool_count == 0) {
                 return PPAGE_INVALID;
         }
+        return zero_pool[--zero_pool_count];
+}
 
-        const page_t imax = first_free_index + npages;
-        for (page_t i = first_free_index; i < imax; ++i) {
-                core_map[i].cme_pid = PID_KERN;
+ppage_t
+claim_user_page(void)
+{
+        ppage_t ppage = claim_free_pages(1);
+        if (ppage != PPAGE_INVALID) {
+                return ppage;
         }
 
-	spinlock_release(&stealmem_lock);
+        /* Zeroing ahead of time is not worth an eviction */
+        spinlock_acquire(&zero_pool_lock);
+        ppage = zero_pool_take();
+        if (ppage != PPAGE_INVALID) {
+                zero_pool_reclaimed += 1;
+        }
+        spinlock_release(&zero_pool_lock);
 
-	return first_free_index + coremap_first_page;
+        if (ppage != PPAGE_INVALID) {
+                return ppage;
+        }
+
+        KASSERT(curthread->t_in_interrupt == false);
+        KASSERT(curcpu->c_spinlocks == 0);
+
+        /* The pageout daemon did not keep up, evict a page ourselves */
+        spinlock_acquire(&coremap_lock);
+        direct_reclaims += 1;
+        spinlock_release(&coremap_lock);
+
+        return coremap_evict(&ppage, 1) == 1 ? ppage : PPAGE_INVALID;
+}
+
+ppage_t
+claim_zeroed_user_page(bool* pooled)
+{
+        spinlock_acquire(&zero_pool_lock);
+        ppage_t ppage = zero_pool_take();
+        if (ppage != PPAGE_INVALID) {
+                zero_pool_hits += 1;
+        }
+        else {
+                zero_pool_empty += 1;
+        }
+        const bool refill = zero_pool_sleeping && zero_pool_count < ZERO_POOL_SIZE / 2;
+        spinlock_release(&zero_pool_lock);
+
+        /*
+         * The prezero thread would only go back to sleep while memory is
+         * short, so don't wake it for nothing on every fault then.
+         */
+        if (refill && pageout_memory_is_plentiful(coremap_free_page_count())) {
+                spinlock_acquire(&zero_pool_lock);
+                if (zero_pool_sleeping) {
+                        zero_pool_sleeping = false;
+                        wchan_wakeone(zero_pool_wchan, &zero_pool_lock);
+                }
+                spinlock_release(&zero_pool_lock);
+        }
+
+        *pooled = ppage != PPAGE_INVALID;
+        if (*pooled) {
+                return ppage;
+        }
+
+        ppage = claim_user_page();
+        if (ppage != PPAGE_INVALID) {
+                bzero((void*)PADDR_TO_KVADDR(page_to_addr(ppage)), PAGE_SIZE);
+        }
+        return ppage;
+}
+
+/*
+ * Zeroes a free frame for the pool, if it is not full and memory is
+ * plentiful. Returns whether it did, in which case there may be more to
+ * do.
+ */
+static
+bool
+coremap_prezero_page(void)
+{
+        spinlock_acquire(&zero_pool_lock);
+        const bool full = zero_pool_count == ZERO_POOL_SIZE;
+        spinlock_release(&zero_pool_lock);
+
+        if (full || !pageout_memory_is_plentiful(coremap_free_page_count())) {
+                return false;
+        }
+
+        ppage_t ppage = claim_free_pages(1);
+        if (ppage == PPAGE_INVALID) {
+                return false;
+        }
+        bzero((void*)PADDR_TO_KVADDR(page_to_addr(ppage)), PAGE_SIZE);
+
+        /* Only this thread fills the pool, so there is still room */
+        spinlock_acquire(&zero_pool_lock);
+        KASSERT(zero_pool_count < ZERO_POOL_SIZE);
+        zero_pool[zero_pool_count++] = ppage;
+        zero_pool_filled += 1;
+        spinlock_release(&zero_pool_lock);
+
+        return true;
+}
+
+/*
+ * The prezero thread. There are no thread priorities, so it gives way by
+ * hand: it yields whenever another thread is ready to run on its cpu, and
+ * only zeroes a page when none is.
+ */
+static
+void
+coremap_prezero_thread(void* unused1, unsigned long unused2)
+{
+        (void)unused1;
+        (void)unused2;
+
+        for (;;) {
+                if (thread_others_ready()) {
+                        thread_yield();
+                        continue;
+                }
+                if (coremap_prezero_page()) {
+                        continue;
+                }
+
+                /* Full, or memory is short: wait for claims to drain it */
+                spinlock_acquire(&zero_pool_lock);
+                zero_pool_sleeping = true;
+                wchan_sleep(zero_pool_wchan, &zero_pool_lock);
+                spinlock_release(&zero_pool_lock);
+        }
+}
+
+void
+coremap_prezero_bootstrap(void)
+{
+        zero_pool_wchan = wchan_create("zeropool");
+        if (zero_pool_wchan == NULL) {
+                panic("coremap: Could not create wait channel\n");
+        }
+
+        const int error = thread_fork("prezero", NULL, coremap_prezero_thread, NULL, 0);
+        if (error) {
+                panic("coremap: Could not start the prezero thread: %s\n", strerror(error));
+        }
+}
+
+bool
+coremap_zero_timing(void)
+{
+        return zero_fault_timing;
+}
+
+void
+coremap_set_zero_timing(bool on)
+{
+        zero_fault_timing = on;
+}
+
+void
+coremap_account_zero_fault(bool pooled, const struct timespec* duration)
+{
+        const int spl = splhigh();
+        struct zero_fault_stats* stats = zero_fault_stats + curcpu->c_number;
+        timespec_add(&stats->zf_time[pooled], duration, &stats->zf_time[pooled]);
+        stats->zf_faults[pooled] += 1;
+        splx(spl);
+}
+
+unsigned
+coremap_reclaim(unsigned npages)
+{
+        unsigned reclaimed = 0;
+
+        while (reclaimed < npages) {
+                ppage_t ppages[PF_BATCH_MAX];
+
+                const unsigned n = coremap_evict(ppages, min(npages - reclaimed, PF_BATCH_MAX));
+                if (n == 0) {
+                        break;
+                }
+                for (unsigned i = 0; i < n; ++i) {
+                        coremap_decref(ppages[i]);
+                }
+                reclaimed += n;
+        }
+        return reclaimed;
+}
+
+size_t
+coremap_free_page_count(void)
+{
+        spinlock_acquire(&stealmem_lock);
+        size_t nfree = free_page_count;
+        spinlock_release(&stealmem_lock);
+
+        for (unsigned c = 0; c < MAXCPUS; ++c) {
+                /* Good enough without the magazine locks */
+                nfree += magazines[c].pm_count;
+        }
+        return nfree;
+}
+
+ppage_t
+coremap_map_zero_page(void)
+{
+        coremap_incref(zero_page);
+
+        spinlock_acquire(&coremap_lock);
+        zero_page_maps += 1;
+        spinlock_release(&coremap_lock);
+
+        return zero_page;
+}
+
+ppage_t
+copy_to_new_page(ppage_t old_page)
+{
+        if (old_page == PPAGE_INVALID) {
+                return PPAGE_INVALID;
+        }
+
+        const ppage_t new_page = claim_user_page();
+        if (new_page == PPAGE_INVALID) {
+                return PPAGE_INVALID;
+        }
+
+        const vaddr_t old_address = PADDR_TO_KVADDR(page_to_addr(old_page));
+        const vaddr_t new_address = PADDR_TO_KVADDR(page_to_addr(new_page));
+
+        if (old_page == zero_page) {
+                /* No need to read the zeros */
+                bzero((void*)new_address, PAGE_SIZE);
+
+                spinlock_acquire(&coremap_lock);
+                zero_page_copies += 1;
+                spinlock_release(&coremap_lock);
+                return new_page;
+        }
+
+        DEBUG(DB_VM, "vm: copy page 0x%x -> 0x%x\n", old_page, new_page);
+
+        memcpy((void*)new_address, (const void*)old_address, PAGE_SIZE);
+
+        DEBUG(DB_VM, "vm: done copy page\n");
+
+        return new_page;
+}
+
+void
+coremap_printstats(void)
+{
+        unsigned lengths[COREMAP_ORDERS];
+        size_t nfree;
+
+        /* Take a snapshot, kprintf is too slow to call with the lock held */
+        spinlock_acquire(&stealmem_lock);
+        for (unsigned order = 0; order < COREMAP_ORDERS; ++order) {
+                lengths[order] = free_list_length[order];
+        }
+        nfree = free_page_count;
+        spinlock_release(&stealmem_lock);
+
+        size_t largest_block = 0;
+        unsigned free_blocks = 0;
+        for (unsigned order = 0; order < COREMAP_ORDERS; ++order) {
+                if (lengths[order] > 0) {
+                        largest_block = 1U << order;
+                }
+                free_blocks += lengths[order];
+        }
+
+        kprintf("Coremap: %zu pages, %zu free in %u blocks, largest free block %zu pages\n",
+                hardware_pages_available(), nfree, free_blocks, largest_block);
+
+        /*
+         * External fragmentation: the share of free memory that cannot be
+         * handed out as part of the largest free block.
+         */
+        kprintf("External fragmentation: %zu%%\n",
+                nfree == 0 ? 0 : 100 - (100 * largest_block) / nfree);
+
+        kprintf("    order     pages   free blocks\n");
+        for (unsigned order = 0; order < COREMAP_ORDERS; ++order) {
+                if (lengths[order] == 0) {
+                        continue;
+                }
+                kprintf("    %5u  %8u  %12u\n", order, 1U << order, lengths[order]);
+        }
+
+        spinlock_acquire(&coremap_lock);
+        const unsigned clean = clean_evictions;
+        const unsigned dirty = dirty_evictions;
+        const unsigned failed = eviction_failures;
+        const unsigned pairs = pair_evictions;
+        const unsigned direct = direct_reclaims;
+        const unsigned ra_pages = readahead_pages;
+        const unsigned ra_used = readahead_used;
+        const unsigned ra_wasted = readahead_wasted;
+        /* Each mapping of the zero page is a frame saved */
+        const unsigned zero_mapped = core_map[zero_page - coremap_first_page].cme_refcount - 1;
+        const unsigned zero_maps = zero_page_maps;
+        const unsigned zero_copies = zero_page_copies;
+        spinlock_release(&coremap_lock);
+
+        kprintf("Evictions: %u clean (no I/O), %u dirty (written out), %u failed, "
+                "%u frames freed from fork pairs\n", clean, dirty, failed, pairs);
+        kprintf("Direct reclaims by faulting threads: %u\n", direct);
+        kprintf("Swap-in readahead: %u pages read ahead, %u used, %u wasted, "
+                "%u not used yet\n", ra_pages, ra_used, ra_wasted,
+                ra_pages - ra_used - ra_wasted);
+        spinlock_acquire(&zero_pool_lock);
+        const unsigned pool_count = zero_pool_count;
+        const unsigned pool_hits = zero_pool_hits;
+        const unsigned pool_empty = zero_pool_empty;
+        const unsigned pool_filled = zero_pool_filled;
+        const unsigned pool_reclaimed = zero_pool_reclaimed;
+        spinlock_release(&zero_pool_lock);
+
+        /* Racy against the cpus still counting, which is fine for this */
+        struct timespec fault_time[2] = { { 0, 0 }, { 0, 0 } };
+        unsigned faults[2] = { 0, 0 };
+        for (unsigned c = 0; c < MAXCPUS; ++c) {
+                const struct zero_fault_stats* stats = zero_fault_stats + c;
+                for (unsigned pooled = 0; pooled < 2; ++pooled) {
+                        timespec_add(&fault_time[pooled], &stats->zf_time[pooled],
+                                     &fault_time[pooled]);
+                        faults[pooled] += stats->zf_faults[pooled];
+                }
+        }
+
+        kprintf("Zero pool: %u/%u frames, %u zeroed ahead, %u hits, %u found empty, "
+                "%u taken back\n", pool_count, ZERO_POOL_SIZE, pool_filled,
+                pool_hits, pool_empty, pool_reclaimed);
+        if (!zero_fault_timing) {
+                kprintf("    anonymous fault timing is off, see cm timing on\n");
+        }
+        for (unsigned pooled = 0; pooled < 2 && zero_fault_timing; ++pooled) {
+                /* In microseconds, which overflows after an hour of faults */
+                const unsigned usecs = fault_time[pooled].tv_sec * 1000000
+                        + fault_time[pooled].tv_nsec / 1000;
+                const unsigned n = faults[pooled] == 0 ? 1 : faults[pooled];
+                kprintf("    anonymous faults %s the pool: %u, %u.%02u us on average\n",
+                        pooled ? "served by" : "zeroing without",
+                        faults[pooled], usecs / n, ((usecs % n) * 100) / n);
+        }
+        kprintf("Zero page: %u mappings now (frames saved), %u read faults served, "
+                "%u copied on first write\n", zero_mapped, zero_maps, zero_copies);
+
+        kprintf("Per-CPU page magazines:\n");
+        kprintf("    cpu  cached      hits    misses  hit rate   refills    drains\n");
+        for (unsigned c = 0; c < MAXCPUS; ++c) {
+                struct page_magazine* mag = magazines + c;
+
+                spinlock_acquire(&mag->pm_lock);
+                const unsigned count = mag->pm_count;
+                const unsigned hits = mag->pm_hits;
+                const unsigned misses = mag->pm_misses;
+                const unsigned refills = mag->pm_refills;
+                const unsigned drains = mag->pm_drains;
+                spinlock_release(&mag->pm_lock);
+
+                if (hits + misses + drains == 0) {
+                        continue;
+                }
+                kprintf("    %3u  %6u  %8u  %8u  %7u%%  %8u  %8u\n",
+                        c, count, hits, misses,
+                        (100 * hits) / (hits + misses == 0 ? 1 : hits + misses),
+                        refills, drains);
+        }
 }
@@ -1,6 +1,8 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
 #include <page_file.h>
+#include <swap_cache.h>
 #include <lib.h>
 #include <stat.h>
 #include <vfs.h>
@@ -8,49 +10,294 @@
 #include <kern/iovec.h>
 #include <uio.h>
 #include <vm.h>
+#include <spinlock.h>
+#include <device.h>
+#include "opt-swapstripe.h"
 
-/* a boolean for each page in the swapmap to indicate if it is stored or not */
-static bool * swapmap;
+/*
+ * The swap map is a bitmap with a bit set for each page in use.
+ *
+ * Free pages are found next-fit: the search starts where the last one
+ * ended, so consecutive swap-outs get consecutive pages of the file, and a
+ * full scan is only needed when the page file is nearly full.
+ */
+#define SWAPMAP_BITS 32
 
-static ssize_t swapmap_size;
-static struct vnode * swapfile;
+static uint32_t * swapmap;
+static ssize_t swapmap_size;   /* in pages */
+static pfid swapmap_hint = 0;  /* Where the next search starts */
 
-void page_file_bootstrap(void)
+/*
+ * The page file is kept on the raw disk lhd0raw:, and transferred to and
+ * from with DEVOP_IO directly: pages are a whole number of sectors, so
+ * there is no file system or seek check in the way. With the swapstripe
+ * option it is striped page by page across lhd0raw: and lhd1raw:, so that
+ * faults on different disks can be served at once. If no raw disk can be
+ * opened, the file LHD0.img is used through the VFS instead.
+ */
+#define PF_DEVICES_MAX 2
+
+struct pf_device {
+        const char* pd_name;
+        struct vnode* pd_vnode;
+        struct device* pd_device;  /* NULL for a file */
+        ssize_t pd_npages;
+        unsigned pd_writes;        /* Pages, under swapmap_lock */
+        unsigned pd_reads;
+};
+
+static struct pf_device pf_devices[PF_DEVICES_MAX];
+static unsigned pf_ndevices = 0;
+
+/* Protects swapmap and the statistics. The I/O itself is done without it. */
+static struct spinlock swapmap_lock = SPINLOCK_INITIALIZER;
+
+/* Statistics */
+static unsigned swap_used = 0;
+static unsigned swap_writes = 0;
+static unsigned swap_reads = 0;
+static unsigned swap_batches = 0;   /* Clustered writes */
+static unsigned swap_batched = 0;   /* Pages written by them */
+static unsigned swap_read_batches = 0; /* Clustered reads */
+static unsigned swap_read_batched = 0; /* Pages read by them */
+
+// ~~~~~ Swap Map ~~~~~~~
+/* All of these must be called with swapmap_lock held */
+
+static
+bool
+swapmap_isset(pfid i)
 {
-        /* Limited scope of buffer */
-        {
-                char buffer[64];
-                snprintf(buffer, sizeof(buffer), "LHD0.img");
-                const int error = vfs_open(buffer, 2, 0, &swapfile);
+        return (swapmap[i / SWAPMAP_BITS] & (1U << (i % SWAPMAP_BITS))) != 0;
+}
 
-                if (error) {
-                        kprintf("Error loading %s: %s\n", buffer, strerror(error));
-                        return;
+static
+void
+swapmap_mark(pfid i)
+{
+        KASSERT(!swapmap_isset(i));
+        swapmap[i / SWAPMAP_BITS] |= 1U << (i % SWAPMAP_BITS);
+        swap_used++;
+}
+
+static
+void
+swapmap_unmark(pfid i)
+{
+        KASSERTM(swapmap_isset(i), "pfid %d", i);
+        swapmap[i / SWAPMAP_BITS] &= ~(1U << (i % SWAPMAP_BITS));
+        swap_used--;
+}
+
+/*
+ * Finds and marks npages free pages in a row, starting the search at the
+ * hint and wrapping around once. Whole words are skipped while full.
+ * Returns the first page, or PF_INVALID.
+ */
+static
+pfid
+swapmap_alloc(unsigned npages)
+{
+        KASSERT(npages > 0);
+
+        if (swap_used + npages > (unsigned)swapmap_size) {
+                return PF_INVALID;
+        }
+
+        pfid run_start = swapmap_hint;
+        unsigned run_length = 0;
+
+        for (ssize_t scanned = 0; scanned < swapmap_size; ) {
+                const pfid i = (swapmap_hint + scanned) % swapmap_size;
+
+                if (i == 0) {
+                        /* A run may not wrap around the end of the file */
+                        run_length = 0;
+                }
+
+                if (run_length == 0 && i % SWAPMAP_BITS == 0 &&
+                    swapmap[i / SWAPMAP_BITS] == 0xffffffff &&
+                    i + SWAPMAP_BITS <= swapmap_size) {
+                        scanned += SWAPMAP_BITS;
+                        continue;
+                }
+                ++scanned;
+
+                if (swapmap_isset(i)) {
+                        run_length = 0;
+                        continue;
+                }
+                if (run_length == 0) {
+                        run_start = i;
+                }
+                if (++run_length == npages) {
+                        for (unsigned j = 0; j < npages; ++j) {
+                                swapmap_mark(run_start + j);
+                        }
+                        swapmap_hint = (run_start + npages) % swapmap_size;
+                        return run_start;
                 }
         }
+        return PF_INVALID;
+}
 
-        /* Limited scope of status */
-        {
-                struct stat status;
-                const int error = VOP_STAT(swapfile, &status);
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
+/*
+ * Opens name as the next page file device. Returns false, saying why, if
+ * it cannot be used.
+ */
+static
+bool
+pf_open(const char* name)
+{
+        KASSERT(pf_ndevices < PF_DEVICES_MAX);
+        struct pf_device* pd = &pf_devices[pf_ndevices];
+
+        /* vfs_open may destroy the path */
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%s", name);
+        int error = vfs_open(buffer, O_RDWR, 0, &pd->pd_vnode);
+        if (error) {
+                kprintf("page file: cannot open %s: %s\n", name, strerror(error));
+                return false;
+        }
+
+        pd->pd_device = dev_getdevice(pd->pd_vnode);
+        if (pd->pd_device != NULL) {
+                const struct device* d = pd->pd_device;
+                if (d->d_blocks == 0 || PAGE_SIZE % d->d_blocksize != 0) {
+                        kprintf("page file: %s is not a disk\n", name);
+                        vfs_close(pd->pd_vnode);
+                        return false;
+                }
+                pd->pd_npages = (off_t)d->d_blocks * d->d_blocksize / PAGE_SIZE;
+        }
+        else {
+                struct stat status;
+                error = VOP_STAT(pd->pd_vnode, &status);
                 if (error) {
                         kprintf("Error getting page file status: %s\n", strerror(error));
-                        return;
+                        vfs_close(pd->pd_vnode);
+                        return false;
                 }
+                pd->pd_npages = status.st_size / PAGE_SIZE;
+        }
+
+        if (pd->pd_npages == 0) {
+                kprintf("page file: %s is too small\n", name);
+                vfs_close(pd->pd_vnode);
+                return false;
+        }
+
+        DEBUG(DB_VM, "Page file memory available on %s: %d\n",
+              name, (int)(pd->pd_npages * PAGE_SIZE));
 
-                DEBUG(DB_VM, "Page file memory available: %d\n", (int)status.st_size);
+        pd->pd_name = name;
+        pd->pd_writes = 0;
+        pd->pd_reads = 0;
+        pf_ndevices++;
+        return true;
+}
+
+void page_file_bootstrap(void)
+{
+        if (pf_open("lhd0raw:")) {
+#if OPT_SWAPSTRIPE
+                (void)pf_open("lhd1raw:");
+#endif
+        }
+        else if (!pf_open("LHD0.img")) {
+                return;
+        }
 
-                /* kmalloc bool array depending on how many entries we can fit into the img */
-                swapmap_size = size_to_page_count(status.st_size);
-                swapmap = kmalloc(swapmap_size);
-                /* indicate every entry is UNUSED, meaning no page is stored there */
-                for ( pfid i = 0; i < swapmap_size; i++) {
-                        swapmap[i] = 0;
+        /* A stripe takes the same number of pages from each device */
+        ssize_t per_device = pf_devices[0].pd_npages;
+        for (unsigned i = 1; i < pf_ndevices; i++) {
+                if (pf_devices[i].pd_npages < per_device) {
+                        per_device = pf_devices[i].pd_npages;
                 }
         }
 
+        /* kmalloc a bitmap depending on how many pages we can fit on the devices */
+        const ssize_t npages = per_device * pf_ndevices;
+        const ssize_t nwords = (npages + SWAPMAP_BITS - 1) / SWAPMAP_BITS;
+        swapmap = kmalloc(nwords * sizeof(uint32_t));
+        if (swapmap == NULL) {
+                kprintf("Error allocating the page file swap map\n");
+                return;
+        }
+        /* indicate every entry is UNUSED, meaning no page is stored there */
+        for (ssize_t i = 0; i < nwords; i++) {
+                swapmap[i] = 0;
+        }
+        swapmap_size = npages;
+
+        swap_cache_bootstrap(swapmap_size);
+
+
+}
+
+/*
+ * Transfers npages pages between bufs and the pages on disk from first on.
+ * Page p of the page file is page p / pf_ndevices of device
+ * p % pf_ndevices, so the pages of a run that share a device are
+ * consecutive on it, and each device gets a single transfer.
+ */
+static
+int
+pf_io(pfid first, void* const* bufs, unsigned npages, enum uio_rw rw) {
+
+        KASSERT(npages > 0 && npages <= PF_BATCH_MAX);
 
+        for (unsigned d = 0; d < pf_ndevices && d < npages; d++) {
+                struct pf_device* pd = &pf_devices[(first + d) % pf_ndevices];
+
+                /* new uio for the transfer, one iovec per page */
+                struct iovec iov[PF_BATCH_MAX];
+                struct uio swp_uio;
+                unsigned n = 0;
+                for (unsigned i = d; i < npages; i += pf_ndevices) {
+                        iov[n].iov_kbase = bufs[i];
+                        iov[n].iov_len = PAGE_SIZE;
+                        n++;
+                }
+                swp_uio.uio_iov = iov;
+                swp_uio.uio_iovcnt = n;
+                swp_uio.uio_offset = (off_t)((first + d) / pf_ndevices) * PAGE_SIZE;
+                swp_uio.uio_resid = n * PAGE_SIZE;
+                swp_uio.uio_segflg = UIO_SYSSPACE;
+                swp_uio.uio_rw = rw;
+                swp_uio.uio_space = NULL;
+
+                int result;
+                if (pd->pd_device != NULL) {
+                        result = DEVOP_IO(pd->pd_device, &swp_uio);
+                }
+                else if (rw == UIO_READ) {
+                        result = VOP_READ(pd->pd_vnode, &swp_uio);
+                }
+                else {
+                        result = VOP_WRITE(pd->pd_vnode, &swp_uio);
+                }
+                if (result == 0 && swp_uio.uio_resid != 0) {
+                        result = EIO;
+                }
+                if (result) {
+                        return result;
+                }
+
+                spinlock_acquire(&swapmap_lock);
+                if (rw == UIO_READ) {
+                        pd->pd_reads += n;
+                }
+                else {
+                        pd->pd_writes += n;
+                }
+                spinlock_release(&swapmap_lock);
+        }
+
+        return 0;
 }
 
 /*
@@ -59,62 +306,261 @@ void page_file_bootstrap(void)
  * Returns PF_INVALID if it is not possible to write a page to disk.
  */
 pfid page_file_write(const void* src) {
+        return page_file_write_batch(&src, 1);
+}
 
-        /* find next free page index */
-        pfid i;
-        for (i = 0; i < swapmap_size; i++) {
-                if ( swapmap[i] == 0 ) {
-                        swapmap[i] = 1;
-                        /* new uio for swap write transfer */
-                        struct iovec iov;
-                        struct uio swp_uio;
-                        uio_kinit(&iov, &swp_uio, (void*) src, PAGE_SIZE, i*PAGE_SIZE, UIO_WRITE);
-
-                        int result = VOP_WRITE(swapfile, &swp_uio);
-                        if (result) {
-                                return result;
-                        }
+/*
+ * Writes npages pages to the pages on disk from first on, in a single I/O.
+ * The pages must be in use already.
+ */
+static
+int
+page_file_write_run(pfid first, const void* const* srcs, unsigned npages) {
+
+        const int result = pf_io(first, (void* const*) srcs, npages, UIO_WRITE);
+        if (result) {
+                kprintf("page file: write failed: %s\n", strerror(result));
+                return result;
+        }
 
-                        return i;
+        spinlock_acquire(&swapmap_lock);
+        swap_writes += npages;
+        if (npages > 1) {
+                swap_batches++;
+                swap_batched += npages;
+        }
+        spinlock_release(&swapmap_lock);
+
+        return 0;
+}
+
+/*
+ * Writes npages pages to consecutive pages on disk.
+ * Returns the index of the first page; page i of srcs can be retrieved
+ * from that index plus i.
+ * Returns PF_INVALID if there is no free run of npages pages.
+ *
+ * The swap cache gets to keep each page first. The pages it turns down
+ * are written in as few I/Os as the pages it keeps between them allow.
+ */
+pfid page_file_write_batch(const void* const* srcs, unsigned npages) {
+
+        KASSERT(npages > 0 && npages <= PF_BATCH_MAX);
+
+        spinlock_acquire(&swapmap_lock);
+        const pfid first = swapmap_size == 0 ? PF_INVALID : swapmap_alloc(npages);
+        spinlock_release(&swapmap_lock);
+
+        if (first == PF_INVALID) {
+                return PF_INVALID;
+        }
+
+        bool cached[PF_BATCH_MAX];
+        for (unsigned i = 0; i < npages; i++) {
+                cached[i] = swap_cache_store(first + i, srcs[i]);
+        }
+
+        for (unsigned i = 0; i < npages; ) {
+                if (cached[i]) {
+                        i++;
+                        continue;
+                }
+                unsigned run = 1;
+                while (i + run < npages && !cached[i + run]) {
+                        run++;
+                }
+                if (page_file_write_run(first + i, srcs + i, run)) {
+                        for (unsigned j = 0; j < npages; j++) {
+                                page_file_free(first + j);
+                        }
+                        return PF_INVALID;
                 }
-            }
+                i += run;
+        }
 
-        return PF_INVALID;
+        return first;
+}
+
+int page_file_write_at(pfid index, const void* src) {
+
+        KASSERT(index >= 0 && index < swapmap_size);
+
+        return page_file_write_run(index, &src, 1);
 }
 
 /*
  * Reads PAGE_SIZE bytes from page pfid on disk.
  * Returns an error code if the data cannot be read.
- * Free's the page pfid for future use.
  */
-int page_file_read_and_free(pfid index, void* data) {
+int page_file_read(pfid index, void* data) {
 
-        if ( index < 0 || index >= swapmap_size || swapmap[index] != 1 ) {
-                return PF_INVALID;
+        if ( index < 0 || index >= swapmap_size ) {
+                return EINVAL;
         }
 
-        /* new uio for swap read transfer */
-        struct iovec iov;
-        struct uio swp_uio;
-        uio_kinit(&iov, &swp_uio, data, PAGE_SIZE, index*PAGE_SIZE, UIO_READ);
+        spinlock_acquire(&swapmap_lock);
+        const bool in_use = swapmap_isset(index);
+        spinlock_release(&swapmap_lock);
+
+        if (!in_use) {
+                return EINVAL;
+        }
+
+        if (swap_cache_load(index, data)) {
+                return 0;
+        }
 
         /* read swp page into data */
-        int result = VOP_READ(swapfile, &swp_uio);
+        const int result = pf_io(index, &data, 1, UIO_READ);
+        if (result) {
+                return result;
+        }
+
+        spinlock_acquire(&swapmap_lock);
+        swap_reads++;
+        spinlock_release(&swapmap_lock);
+
+        return 0;
+}
+
+/*
+ * Reads npages pages from consecutive pages from first on into dsts, each
+ * from the swap cache if it has it. The others are read in as few I/Os as
+ * the cached pages between them allow.
+ */
+int page_file_read_batch(pfid first, void* const* dsts, unsigned npages) {
+
+        KASSERT(npages > 0 && npages <= PF_BATCH_MAX);
+
+        if ( first < 0 || first + (ssize_t)npages > swapmap_size ) {
+                return EINVAL;
+        }
+
+        spinlock_acquire(&swapmap_lock);
+        bool in_use = true;
+        for (unsigned i = 0; i < npages; i++) {
+                in_use = in_use && swapmap_isset(first + i);
+        }
+        spinlock_release(&swapmap_lock);
+
+        if (!in_use) {
+                return EINVAL;
+        }
+
+        bool cached[PF_BATCH_MAX];
+        for (unsigned i = 0; i < npages; i++) {
+                cached[i] = swap_cache_load(first + i, dsts[i]);
+        }
+
+        for (unsigned i = 0; i < npages; ) {
+                if (cached[i]) {
+                        i++;
+                        continue;
+                }
+                unsigned run = 1;
+                while (i + run < npages && !cached[i + run]) {
+                        run++;
+                }
+
+                const int result = pf_io(first + i, dsts + i, run, UIO_READ);
+                if (result) {
+                        return result;
+                }
+
+                spinlock_acquire(&swapmap_lock);
+                swap_reads += run;
+                if (run > 1) {
+                        swap_read_batches++;
+                        swap_read_batched += run;
+                }
+                spinlock_release(&swapmap_lock);
+
+                i += run;
+        }
+
+        return 0;
+}
+
+/*
+ * Reads PAGE_SIZE bytes from page pfid on disk.
+ * Returns an error code if the data cannot be read.
+ * Free's the page pfid for future use.
+ */
+int page_file_read_and_free(pfid index, void* data) {
+
+        int result = page_file_read(index, data);
         if (result) {
                 return result;
         }
 
         /* mark as free */
-        swapmap[index] = 0;
+        page_file_free(index);
         return 0;
 }
 
+/*
+ * Copies page pfid to a new page on disk.
+ * Returns the index of the copy, or PF_INVALID.
+ */
+pfid page_file_copy(pfid index) {
+
+        void* buffer = kmalloc(PAGE_SIZE);
+        if (buffer == NULL) {
+                return PF_INVALID;
+        }
+
+        pfid copy = PF_INVALID;
+        if (page_file_read(index, buffer) == 0) {
+                copy = page_file_write(buffer);
+        }
+
+        kfree(buffer);
+        return copy;
+}
+
 /*
  * Free's the page pfid for future use.
  */
 void page_file_free(pfid index) {
        KASSERT( !(index < 0 ));
        KASSERT( !(index >= swapmap_size));
-       KASSERT( !(swapmap[index] != 1 ));
-       swapmap[index] = 0;
+
+       if (!swap_cache_drop(index)) {
+               /* The swap cache is writing it out, and frees it after */
+               return;
+       }
+
+       spinlock_acquire(&swapmap_lock);
+       swapmap_unmark(index);
+       spinlock_release(&swapmap_lock);
+}
+
+void page_file_printstats(void) {
+
+        spinlock_acquire(&swapmap_lock);
+        const unsigned used = swap_used;
+        const unsigned writes = swap_writes;
+        const unsigned reads = swap_reads;
+        const unsigned batches = swap_batches;
+        const unsigned batched = swap_batched;
+        const unsigned read_batches = swap_read_batches;
+        const unsigned read_batched = swap_read_batched;
+        spinlock_release(&swapmap_lock);
+
+        kprintf("Page file: %u of %d pages in use, %u pages written, %u pages read from disk\n",
+                used, (int)swapmap_size, writes, reads);
+        kprintf("Page file: %u clustered writes of %u pages, %u clustered reads of %u pages\n",
+                batches, batched, read_batches, read_batched);
+
+        for (unsigned i = 0; i < pf_ndevices; i++) {
+                spinlock_acquire(&swapmap_lock);
+                const unsigned dev_writes = pf_devices[i].pd_writes;
+                const unsigned dev_reads = pf_devices[i].pd_reads;
+                spinlock_release(&swapmap_lock);
+
+                kprintf("Page file: %s%s, %d pages, %u pages written, %u pages read\n",
+                        pf_devices[i].pd_name,
+                        pf_devices[i].pd_device != NULL ? " (raw)" : "",
+                        (int)pf_devices[i].pd_npages, dev_writes, dev_reads);
+        }
 }
@@ -1,7 +1,13 @@
 #include <page_table.h>
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <platform/maxcpus.h>
 
 static
 unsigned
@@ -15,6 +21,55 @@ hash(unsigned x)
         return x;
 }
 
+/*
+ * Latency of the operations that change a page table, in a histogram of
+ * powers of two of microseconds. Timing takes two clock reads per write
+ * or remove, so it is off unless turned on with page_table_set_timing.
+ *
+ * Each cpu counts in its own pt_stats, with interrupts off so that the
+ * thread stays on it; page_table_printstats adds them up.
+ */
+#define PT_LATENCY_BUCKETS 16
+
+struct pt_stats {
+        unsigned ps_latency[PT_LATENCY_BUCKETS];
+        unsigned ps_latency_max;   /* Microseconds */
+        unsigned ps_resizes;       /* Migrations started */
+};
+
+static struct pt_stats pt_stats[MAXCPUS];
+static volatile bool pt_timing = false;
+
+/* The statistics of the current cpu. Call with interrupts off */
+static
+struct pt_stats*
+pt_stats_of_curcpu(void)
+{
+        return pt_stats + (CURCPU_EXISTS() ? curcpu->c_number : 0);
+}
+
+/* Records an operation that began at before */
+static
+void
+pt_account(const struct timespec* before)
+{
+        struct timespec now;
+        gettime(&now);
+        timespec_sub(&now, before, &now);
+
+        const unsigned usecs = now.tv_sec * 1000000 + now.tv_nsec / 1000;
+        unsigned bucket = 0;
+        while (bucket < PT_LATENCY_BUCKETS - 1 && usecs >= (1U << bucket)) {
+                ++bucket;
+        }
+
+        const int spl = splhigh();
+        struct pt_stats* stats = pt_stats_of_curcpu();
+        stats->ps_latency[bucket] += 1;
+        stats->ps_latency_max = max(stats->ps_latency_max, usecs);
+        splx(spl);
+}
+
 void
 page_mapping_invalidate(page_mapping* pm)
 {
@@ -24,19 +79,58 @@ page_mapping_invalidate(page_mapping* pm)
 bool
 page_mapping_is_valid(const page_mapping* pm)
 {
-        return pm->pm_vpage != VPAGE_INVALID;
+        /* Neither empty nor a tombstone */
+        return pm->pm_vpage >= 0;
+}
+
+static
+bool
+page_mapping_is_empty(const page_mapping* pm)
+{
+        return pm->pm_vpage == VPAGE_INVALID;
+}
+
+/* The smallest power of two capacity that is at least capacity */
+static
+unsigned
+page_table_round_capacity(unsigned capacity)
+{
+        unsigned rounded = PAGE_TABLE_CAPACITY_MIN;
+        while (rounded < capacity) {
+                rounded *= 2;
+        }
+        return rounded;
 }
 
+static
 void
-page_table_init_with_buffer(page_table* pt,
-                            page_mapping* mappings,
-                            unsigned capacity,
-                            bool owns_mappings) {
+page_table_init_hash(page_table* pt, page_mapping* mappings, unsigned capacity,
+                     bool owns_mappings)
+{
+        KASSERT((capacity & (capacity - 1)) == 0);
+
+        pt->pt_kind = PAGE_TABLE_HASH;
         pt->pt_mappings = mappings;
         pt->pt_capacity = capacity;
         pt->pt_count = 0;
+        pt->pt_resident = 0;
+        pt->pt_swapped = 0;
+        pt->pt_resident_max = 0;
         pt->pt_owns_mappings = owns_mappings;
-        pt->pt_resize_pending = false;
+        pt->pt_old_mappings = NULL;
+        pt->pt_old_capacity = 0;
+        pt->pt_old_count = 0;
+        pt->pt_owns_old_mappings = false;
+        pt->pt_migrate_next = 0;
+        pt->pt_directory = NULL;
+}
+
+void
+page_table_init_with_buffer(page_table* pt,
+                            page_mapping* mappings,
+                            unsigned capacity,
+                            bool owns_mappings) {
+        page_table_init_hash(pt, mappings, capacity, owns_mappings);
 }
 
 static
@@ -57,11 +151,8 @@ page_mappings_create(unsigned capacity)
 void
 page_table_init_with_capacity(page_table* pt, unsigned capacity)
 {
-        pt->pt_mappings = page_mappings_create(capacity);
-        pt->pt_capacity = capacity;
-        pt->pt_count = 0;
-        pt->pt_owns_mappings = true;
-        pt->pt_resize_pending = false;
+        capacity = page_table_round_capacity(capacity);
+        page_table_init_hash(pt, page_mappings_create(capacity), capacity, true);
 }
 
 void
@@ -71,6 +162,34 @@ page_table_init(page_table* pt)
 
 }
 
+void
+page_table_init_radix(page_table* pt)
+{
+        page_table_init_hash(pt, NULL, 0, false);
+        pt->pt_kind = PAGE_TABLE_RADIX;
+}
+
+/* The kind of page table address spaces get. Set from the menu */
+static unsigned page_table_default_kind = PAGE_TABLE_HASH;
+
+void
+page_table_init_default(page_table* pt, unsigned capacity)
+{
+        if (page_table_default_kind == PAGE_TABLE_RADIX) {
+                page_table_init_radix(pt);
+        }
+        else {
+                page_table_init_with_capacity(pt, capacity);
+        }
+}
+
+void
+page_table_set_default_kind(unsigned kind)
+{
+        KASSERT(kind == PAGE_TABLE_HASH || kind == PAGE_TABLE_RADIX);
+        page_table_default_kind = kind;
+}
+
 page_table* page_table_create_with_capacity(unsigned capacity)
 {
         page_table* pt = (page_table*)kmalloc(sizeof(page_table));
@@ -87,15 +206,28 @@ page_table_create()
         return page_table_create_with_capacity(PAGE_TABLE_CAPACITY_MIN);
 }
 
+static void radix_cleanup(page_table* pt);
+
 void
 page_table_cleanup(page_table* pt)
 {
+        if (pt->pt_kind == PAGE_TABLE_RADIX) {
+                radix_cleanup(pt);
+        }
         if (pt->pt_owns_mappings) {
                 kfree(pt->pt_mappings);
         }
+        if (pt->pt_owns_old_mappings) {
+                kfree(pt->pt_old_mappings);
+        }
         pt->pt_mappings = NULL;
         pt->pt_capacity = 0;
         pt->pt_count = 0;
+        pt->pt_resident = 0;
+        pt->pt_swapped = 0;
+        pt->pt_old_mappings = NULL;
+        pt->pt_old_capacity = 0;
+        pt->pt_old_count = 0;
 }
 
 void
@@ -105,97 +237,603 @@ page_table_destroy(page_table* pt)
         kfree(pt);
 }
 
+/* Counts an entry that appears in the table, or with -1, one that leaves it */
+static
+void
+pt_tally(page_table* pt, ppage_t ppage, int delta)
+{
+        if (PPAGE_IS_RESIDENT(ppage)) {
+                pt->pt_resident += delta;
+                if (pt->pt_resident > pt->pt_resident_max) {
+                        pt->pt_resident_max = pt->pt_resident;
+                }
+        }
+        else if (PPAGE_IS_SWAPPED(ppage)) {
+                pt->pt_swapped += delta;
+        }
+}
+
+/* Calls visit on an entry and counts the change it makes, if any */
+static
+int
+pt_visit(page_table* pt, vpage_t vpage, ppage_t* entry,
+         page_table_visitor visit, void* data)
+{
+        const ppage_t before = *entry;
+        const int result = visit(vpage, entry, data);
+        if (*entry != before) {
+                pt_tally(pt, before, -1);
+                pt_tally(pt, *entry, 1);
+        }
+        return result;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~ Hash table ~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/*
+ * Returns the slot of vpage in an array of mappings, or the empty slot
+ * where it would go. The capacity is a power of two. Tombstones, which
+ * only the old array of a migration has, are probed past.
+ */
+static
+unsigned
+page_table_find_slot(const page_mapping* mappings, unsigned capacity, vpage_t vpage)
+{
+        const unsigned mask = capacity - 1;
+
+        unsigned i = hash(vpage) & mask;
+
+        while (!page_mapping_is_empty(mappings + i) && mappings[i].pm_vpage != vpage) {
+                i = (i + 1) & mask;
+        }
+        return i;
+}
+
+/*
+ * Returns the mapping of vpage, in the current array or, during a
+ * migration, in the old one. NULL if there is none.
+ */
+static
+page_mapping*
+hash_find(const page_table* pt, vpage_t vpage)
+{
+        page_mapping* mappings = pt->pt_mappings;
+        unsigned i = page_table_find_slot(mappings, pt->pt_capacity, vpage);
+        if (page_mapping_is_valid(mappings + i)) {
+                return mappings + i;
+        }
+
+        mappings = pt->pt_old_mappings;
+        if (mappings == NULL) {
+                return NULL;
+        }
+        i = page_table_find_slot(mappings, pt->pt_old_capacity, vpage);
+        if (page_mapping_is_valid(mappings + i)) {
+                return mappings + i;
+        }
+        return NULL;
+}
+
+/* Puts a mapping that is in neither array into the current one */
+static
+void
+hash_insert(page_table* pt, vpage_t vpage, ppage_t ppage)
+{
+        page_mapping* mappings = pt->pt_mappings;
+        const unsigned i = page_table_find_slot(mappings, pt->pt_capacity, vpage);
+
+        KASSERT(page_mapping_is_empty(mappings + i));
+        mappings[i].pm_vpage = vpage;
+        mappings[i].pm_ppage = ppage;
+}
+
+/*
+ * Moves the mappings in the next nbuckets buckets of the old array into
+ * the current one, leaving tombstones behind so that the probe sequences
+ * of the others stay intact. Frees the old array once it is done.
+ */
+static
+void
+hash_migrate(page_table* pt, unsigned nbuckets)
+{
+        page_mapping* old = pt->pt_old_mappings;
+        KASSERT(old != NULL);
+
+        unsigned i = pt->pt_migrate_next;
+        const unsigned end = nbuckets >= pt->pt_old_capacity - i
+                ? pt->pt_old_capacity : i + nbuckets;
+
+        for (; i < end; ++i) {
+                if (!page_mapping_is_valid(old + i)) {
+                        continue;
+                }
+                hash_insert(pt, old[i].pm_vpage, old[i].pm_ppage);
+                old[i].pm_vpage = VPAGE_TOMBSTONE;
+                pt->pt_old_count -= 1;
+        }
+        pt->pt_migrate_next = i;
+
+        if (i == pt->pt_old_capacity) {
+                KASSERT(pt->pt_old_count == 0);
+                if (pt->pt_owns_old_mappings) {
+                        kfree(old);
+                }
+                pt->pt_old_mappings = NULL;
+                pt->pt_old_capacity = 0;
+                pt->pt_owns_old_mappings = false;
+        }
+}
+
 void
 page_table_resize(page_table* pt, unsigned capacity)
 {
+        KASSERT(pt->pt_kind == PAGE_TABLE_HASH);
         KASSERT(capacity > pt->pt_count);
 
-        capacity = max(capacity, PAGE_TABLE_CAPACITY_MIN);
+        capacity = page_table_round_capacity(capacity);
 
         if (capacity == pt->pt_capacity) {
                 return;
         }
 
-        if (pt->pt_resize_pending) {
+        /* One migration at a time */
+        if (pt->pt_old_mappings != NULL) {
+                hash_migrate(pt, pt->pt_old_capacity);
+        }
+
+        page_mapping* mappings = page_mappings_create(capacity);
+        if (mappings == NULL) {
+                /*
+                 * Stay as we are, the next write tries again. hash_write
+                 * fails once the table is too full to wait any longer.
+                 */
                 return;
         }
-        pt->pt_resize_pending = true;
 
-        page_mapping* old_mappings = pt->pt_mappings;
-        const unsigned old_capacity = pt->pt_capacity;
-        const unsigned old_count = pt->pt_count;
-        const unsigned old_mappings_owned = pt->pt_owns_mappings;
+        /*
+         * The mappings move over PAGE_TABLE_MIGRATE_BUCKETS buckets at a
+         * time, with each write or remove that follows, rather than all
+         * at once here.
+         */
+        pt->pt_old_mappings = pt->pt_mappings;
+        pt->pt_old_capacity = pt->pt_capacity;
+        pt->pt_old_count = pt->pt_count;
+        pt->pt_owns_old_mappings = pt->pt_owns_mappings;
+        pt->pt_migrate_next = 0;
 
-        pt->pt_mappings = page_mappings_create(capacity);
+        pt->pt_mappings = mappings;
         pt->pt_capacity = capacity;
-        pt->pt_count = 0; // We'll be adding the elements back one by one
         pt->pt_owns_mappings = true;
 
-        for (unsigned i = 0; i < old_capacity; ++i) {
-                const page_mapping* mapping = old_mappings + i;
-                if (!page_mapping_is_valid(mapping)) {
+        const int spl = splhigh();
+        pt_stats_of_curcpu()->ps_resizes += 1;
+        splx(spl);
+}
+
+bool
+page_table_is_overcapacity(const page_table* pt)
+{
+        KASSERT(pt != NULL);
+        const unsigned count = pt->pt_count - pt->pt_old_count;
+        return 100 * count > pt->pt_capacity * PAGE_TABLE_MAX_LOAD_PERCENT;
+}
+
+bool
+page_table_is_undercapacity(const page_table* pt)
+{
+        KASSERT(pt != NULL);
+        const unsigned count = pt->pt_count - pt->pt_old_count;
+        return 100 * count < pt->pt_capacity * PAGE_TABLE_MIN_LOAD_PERCENT;
+}
+
+/*
+ * Does a bounded amount of resizing work after a write or remove: moves
+ * on the migration in progress, or starts one if the load calls for it.
+ */
+static
+void
+hash_step(page_table* pt)
+{
+        if (pt->pt_old_mappings != NULL) {
+                hash_migrate(pt, PAGE_TABLE_MIGRATE_BUCKETS);
+        }
+        else if (page_table_is_overcapacity(pt)) {
+                page_table_resize(pt, pt->pt_capacity * PAGE_TABLE_GROWTH_FACTOR);
+        }
+        else if (page_table_is_undercapacity(pt) && pt->pt_capacity > PAGE_TABLE_CAPACITY_MIN) {
+                page_table_resize(pt, pt->pt_capacity / PAGE_TABLE_GROWTH_FACTOR);
+        }
+}
+
+/*
+ * Would one more mapping take the table past PAGE_TABLE_HARD_LOAD_PERCENT?
+ * Counts the mappings not migrated yet too, as they all end up in
+ * pt_mappings.
+ */
+static
+bool
+hash_is_full(const page_table* pt)
+{
+        return 100 * (pt->pt_count + 1) > pt->pt_capacity * PAGE_TABLE_HARD_LOAD_PERCENT;
+}
+
+static
+int
+hash_write(page_table* pt, const vpage_t vpage, ppage_t ppage)
+{
+        page_mapping* mapping = hash_find(pt, vpage);
+
+        if (mapping != NULL) {
+                /* Overwrite the old mapping, wherever it is */
+                pt_tally(pt, mapping->pm_ppage, -1);
+                pt_tally(pt, ppage, 1);
+                mapping->pm_ppage = ppage;
+                return 0;
+        }
+
+        if (hash_is_full(pt)) {
+                /* Every resize since the table passed 70% failed; one last try */
+                page_table_resize(pt, pt->pt_capacity * PAGE_TABLE_GROWTH_FACTOR);
+                if (hash_is_full(pt)) {
+                        return ENOMEM;
+                }
+        }
+
+        /* Insert a new mapping */
+        hash_insert(pt, vpage, ppage);
+        pt->pt_count += 1;
+        pt_tally(pt, ppage, 1);
+
+        hash_step(pt);
+        return 0;
+}
+
+static
+void
+hash_remove(page_table* pt, vpage_t vpage)
+{
+        page_mapping* mappings = pt->pt_mappings;
+        const unsigned mask = pt->pt_capacity - 1;
+
+        unsigned i = page_table_find_slot(mappings, pt->pt_capacity, vpage);
+
+        if (!page_mapping_is_valid(mappings + i)) {
+                page_mapping* old = pt->pt_old_mappings == NULL ? NULL : hash_find(pt, vpage);
+                if (old == NULL) {
+                        /* Key is not in table */
+                        return;
+                }
+                /* Not migrated yet; the old array only loses entries */
+                pt_tally(pt, old->pm_ppage, -1);
+                old->pm_vpage = VPAGE_TOMBSTONE;
+                pt->pt_old_count -= 1;
+                pt->pt_count -= 1;
+                hash_step(pt);
+                return;
+        }
+
+        pt->pt_count -= 1;
+        pt_tally(pt, mappings[i].pm_ppage, -1);
+
+        unsigned j = i;
+
+        while (true) {
+                page_mapping_invalidate(mappings + i);
+        r2:
+                j = (j + 1) & mask;
+
+                if (!page_mapping_is_valid(mappings + j)) {
+                        break;
+                }
+
+                unsigned k = hash(mappings[j].pm_vpage) & mask;
+                if (i <= j ? i < k && k <= j : i < k || k <= j) {
+                        goto r2;
+                }
+
+                mappings[i] = mappings[j];
+                i = j;
+        }
+
+        hash_step(pt);
+}
+
+static
+int
+hash_iterate_array(page_table* pt, page_mapping* mappings, unsigned capacity,
+                   vpage_t first, unsigned npages, page_table_visitor visit,
+                   void* data)
+{
+        for (unsigned i = 0; i < capacity; ++i) {
+
+                page_mapping* mapping = mappings + i;
+
+                if (!page_mapping_is_valid(mapping)
+                    || (unsigned)(mapping->pm_vpage - first) >= npages) {
                         continue;
                 }
-                page_table_write(pt, mapping->pm_vpage, mapping->pm_ppage);
+                const int result = pt_visit(pt, mapping->pm_vpage,
+                                            &mapping->pm_ppage, visit, data);
+                if (result) {
+                        return result;
+                }
         }
+        return 0;
+}
 
-        if (old_mappings_owned) {
-                kfree(old_mappings);
+static
+int
+hash_iterate(page_table* pt, vpage_t first, unsigned npages,
+             page_table_visitor visit, void* data)
+{
+        const int result = hash_iterate_array(pt, pt->pt_mappings, pt->pt_capacity,
+                                              first, npages, visit, data);
+        if (result || pt->pt_old_mappings == NULL) {
+                return result;
         }
+        return hash_iterate_array(pt, pt->pt_old_mappings, pt->pt_old_capacity,
+                                  first, npages, visit, data);
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~ Radix tree ~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+/* An entry of a radix table that maps nothing */
+#define PT_RADIX_ABSENT (-0x7fffffff - 1)
 
-        /* If our implementation works this will be true */
-        KASSERTM(pt->pt_count == old_count,
-                 "\n    old_count: %d, new_count: %d\n", old_count, pt->pt_count);
+#define PT_DIRECTORY_INDEX(vpage) ((unsigned)(vpage) >> PT_RADIX_BITS)
+#define PT_TABLE_INDEX(vpage)     ((unsigned)(vpage) & (PT_RADIX_ENTRIES - 1))
 
-        pt->pt_resize_pending = false;
+struct pt_radix_directory {
+        ppage_t* rd_tables[PT_RADIX_ENTRIES];
+        uint16_t rd_counts[PT_RADIX_ENTRIES]; /* Mappings in each table */
+};
+
+/*
+ * Returns the entry for vpage, or NULL if vpage is not mapped.
+ */
+static
+ppage_t*
+radix_find(const page_table* pt, vpage_t vpage)
+{
+        KASSERT(vpage >= 0 && vpage < PT_VPAGE_LIMIT);
+
+        if (pt->pt_directory == NULL) {
+                return NULL;
+        }
+        ppage_t* table = pt->pt_directory->rd_tables[PT_DIRECTORY_INDEX(vpage)];
+        if (table == NULL) {
+                return NULL;
+        }
+        ppage_t* entry = table + PT_TABLE_INDEX(vpage);
+        return *entry == PT_RADIX_ABSENT ? NULL : entry;
 }
 
-bool
-page_table_is_overcapacity(const page_table* pt)
+/*
+ * Returns the table that holds vpage, allocating it, and the directory,
+ * if need be. Returns NULL if there is no kernel memory for them.
+ */
+static
+ppage_t*
+radix_table_of(page_table* pt, vpage_t vpage)
 {
-        KASSERT(pt != NULL);
-        return 100 * pt->pt_count > pt->pt_capacity * PAGE_TABLE_MAX_LOAD_PERCENT;
+        KASSERT(vpage >= 0 && vpage < PT_VPAGE_LIMIT);
+
+        struct pt_radix_directory* dir = pt->pt_directory;
+        if (dir == NULL) {
+                dir = kmalloc(sizeof(struct pt_radix_directory));
+                if (dir == NULL) {
+                        return NULL;
+                }
+                for (unsigned i = 0; i < PT_RADIX_ENTRIES; ++i) {
+                        dir->rd_tables[i] = NULL;
+                        dir->rd_counts[i] = 0;
+                }
+                pt->pt_directory = dir;
+        }
+
+        const unsigned d = PT_DIRECTORY_INDEX(vpage);
+        if (dir->rd_tables[d] == NULL) {
+                ppage_t* table = kmalloc(PT_RADIX_ENTRIES * sizeof(ppage_t));
+                if (table == NULL) {
+                        return NULL;
+                }
+                for (unsigned i = 0; i < PT_RADIX_ENTRIES; ++i) {
+                        table[i] = PT_RADIX_ABSENT;
+                }
+                dir->rd_tables[d] = table;
+        }
+        return dir->rd_tables[d];
 }
 
-bool
-page_table_is_undercapacity(const page_table* pt)
+static
+int
+radix_write(page_table* pt, vpage_t vpage, ppage_t ppage)
 {
-        KASSERT(pt != NULL);
-        return 100 * pt->pt_count < pt->pt_capacity * PAGE_TABLE_MIN_LOAD_PERCENT;
+        KASSERT(ppage != PT_RADIX_ABSENT);
+
+        ppage_t* table = radix_table_of(pt, vpage);
+        if (table == NULL) {
+                return ENOMEM;
+        }
+        ppage_t* entry = table + PT_TABLE_INDEX(vpage);
+        if (*entry == PT_RADIX_ABSENT) {
+                pt->pt_directory->rd_counts[PT_DIRECTORY_INDEX(vpage)] += 1;
+                pt->pt_count += 1;
+        }
+        else {
+                pt_tally(pt, *entry, -1);
+        }
+        pt_tally(pt, ppage, 1);
+        *entry = ppage;
+        return 0;
 }
 
+/*
+ * Removes the mapping of vpage, if any, and frees its table once it is
+ * empty.
+ */
 static
-unsigned
-page_table_find_slot(const page_table* pt, vpage_t vpage)
+void
+radix_remove(page_table* pt, vpage_t vpage)
 {
-        KASSERT(pt != NULL);
+        ppage_t* entry = radix_find(pt, vpage);
+        if (entry == NULL) {
+                return;
+        }
+        pt_tally(pt, *entry, -1);
+        *entry = PT_RADIX_ABSENT;
+        pt->pt_count -= 1;
 
-        const page_mapping* mappings = pt->pt_mappings;
-        const unsigned capacity = pt->pt_capacity;
+        struct pt_radix_directory* dir = pt->pt_directory;
+        const unsigned d = PT_DIRECTORY_INDEX(vpage);
+        dir->rd_counts[d] -= 1;
+        if (dir->rd_counts[d] == 0) {
+                kfree(dir->rd_tables[d]);
+                dir->rd_tables[d] = NULL;
+        }
+}
 
-        unsigned i = hash(vpage) % capacity;
+static
+void
+radix_cleanup(page_table* pt)
+{
+        struct pt_radix_directory* dir = pt->pt_directory;
+        if (dir == NULL) {
+                return;
+        }
+        for (unsigned d = 0; d < PT_RADIX_ENTRIES; ++d) {
+                if (dir->rd_tables[d] != NULL) {
+                        kfree(dir->rd_tables[d]);
+                }
+        }
+        kfree(dir);
+        pt->pt_directory = NULL;
+}
 
-        while (page_mapping_is_valid(mappings + i) && mappings[i].pm_vpage != vpage) {
-                i = (i + 1) % capacity;
+/*
+ * Walks the range table by table, skipping the 4MB spans that have no
+ * table at all.
+ */
+static
+int
+radix_iterate(page_table* pt, vpage_t first, unsigned npages,
+              page_table_visitor visit, void* data)
+{
+        const struct pt_radix_directory* dir = pt->pt_directory;
+        if (dir == NULL) {
+                return 0;
+        }
+
+        const vpage_t end = first + npages;
+        KASSERT(first >= 0 && end <= PT_VPAGE_LIMIT);
+
+        vpage_t vpage = first;
+        while (vpage < end) {
+                const unsigned d = PT_DIRECTORY_INDEX(vpage);
+                const vpage_t table_end = min(end, (vpage_t)((d + 1) << PT_RADIX_BITS));
+
+                ppage_t* table = dir->rd_tables[d];
+                if (table == NULL) {
+                        vpage = table_end;
+                        continue;
+                }
+
+                for (; vpage < table_end; ++vpage) {
+                        ppage_t* entry = table + PT_TABLE_INDEX(vpage);
+                        if (*entry == PT_RADIX_ABSENT) {
+                                continue;
+                        }
+                        const int result = pt_visit(pt, vpage, entry, visit, data);
+                        if (result) {
+                                return result;
+                        }
+                }
+        }
+        return 0;
+}
+
+static
+int
+radix_write_range(page_table* pt, vpage_t first, unsigned npages, ppage_t ppage)
+{
+        KASSERT(ppage != PT_RADIX_ABSENT);
+
+        const vpage_t end = first + npages;
+        vpage_t vpage = first;
+
+        while (vpage < end) {
+                const unsigned d = PT_DIRECTORY_INDEX(vpage);
+                const vpage_t table_end = min(end, (vpage_t)((d + 1) << PT_RADIX_BITS));
+
+                ppage_t* table = radix_table_of(pt, vpage);
+                if (table == NULL) {
+                        return ENOMEM;
+                }
+                for (; vpage < table_end; ++vpage) {
+                        ppage_t* entry = table + PT_TABLE_INDEX(vpage);
+                        if (*entry == PT_RADIX_ABSENT) {
+                                pt->pt_directory->rd_counts[d] += 1;
+                                pt->pt_count += 1;
+                        }
+                        else {
+                                pt_tally(pt, *entry, -1);
+                        }
+                        pt_tally(pt, ppage, 1);
+                        *entry = ppage;
+                }
+        }
+        return 0;
+}
+
+static
+void
+radix_remove_range(page_table* pt, vpage_t first, unsigned npages)
+{
+        struct pt_radix_directory* dir = pt->pt_directory;
+        if (dir == NULL) {
+                return;
+        }
+
+        const vpage_t end = first + npages;
+        vpage_t vpage = first;
+
+        while (vpage < end) {
+                const unsigned d = PT_DIRECTORY_INDEX(vpage);
+                const vpage_t table_end = min(end, (vpage_t)((d + 1) << PT_RADIX_BITS));
+
+                ppage_t* table = dir->rd_tables[d];
+                if (table == NULL) {
+                        vpage = table_end;
+                        continue;
+                }
+
+                for (; vpage < table_end; ++vpage) {
+                        ppage_t* entry = table + PT_TABLE_INDEX(vpage);
+                        if (*entry != PT_RADIX_ABSENT) {
+                                pt_tally(pt, *entry, -1);
+                                *entry = PT_RADIX_ABSENT;
+                                dir->rd_counts[d] -= 1;
+                                pt->pt_count -= 1;
+                        }
+                }
+                if (dir->rd_counts[d] == 0) {
+                        kfree(table);
+                        dir->rd_tables[d] = NULL;
+                }
         }
-        return i;
 }
 
+// ~~~~~~~~~~~~~~~~~~~~~~~~~ Interface ~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
 bool
 page_table_contains(const page_table* pt, vpage_t vpage)
 {
         KASSERT(pt != NULL);
 
-        const page_mapping* mappings = pt->pt_mappings;
-
-        const int i = page_table_find_slot(pt, vpage);
-
-        if (page_mapping_is_valid(mappings + i)) {
-                /* Key found */
-                return true;
+        if (pt->pt_kind == PAGE_TABLE_RADIX) {
+                return radix_find(pt, vpage) != NULL;
         }
-        /* Key not found */
-        return false;
+        return hash_find(pt, vpage) != NULL;
 }
 
 ppage_t
@@ -203,82 +841,195 @@ page_table_read(const page_table* pt, vpage_t vpage)
 {
         KASSERT(pt != NULL);
 
-        const page_mapping* mappings = pt->pt_mappings;
+        if (pt->pt_kind == PAGE_TABLE_RADIX) {
+                const ppage_t* entry = radix_find(pt, vpage);
+                return entry == NULL ? PPAGE_INVALID : *entry;
+        }
+        const page_mapping* mapping = hash_find(pt, vpage);
+        return mapping == NULL ? PPAGE_INVALID : mapping->pm_ppage;
+}
 
-        const int i = page_table_find_slot(pt, vpage);
+int
+page_table_write(page_table* pt, vpage_t vpage, ppage_t ppage)
+{
+        KASSERT(pt != NULL);
 
-        if (page_mapping_is_valid(mappings + i)) {
-                /* Key found */
-                return mappings[i].pm_ppage;
+        struct timespec before;
+        const bool timed = pt_timing;
+        if (timed) {
+                gettime(&before);
+        }
+
+        int result = 0;
+        if (pt->pt_kind == PAGE_TABLE_RADIX) {
+                result = radix_write(pt, vpage, ppage);
+        }
+        else {
+                result = hash_write(pt, vpage, ppage);
+        }
+
+        if (timed) {
+                pt_account(&before);
         }
-        /* Key not found */
-        return PPAGE_INVALID;
-        // TODO should possibly be VPAGE_INVALID?
+        return result;
 }
 
 void
-page_table_write(page_table* pt, const vpage_t vpage, ppage_t ppage)
+page_table_remove(page_table* pt, vpage_t vpage)
 {
         KASSERT(pt != NULL);
 
-        page_mapping* mappings = pt->pt_mappings;
+        struct timespec before;
+        const bool timed = pt_timing;
+        if (timed) {
+                gettime(&before);
+        }
 
-        const int i = page_table_find_slot(pt, vpage);
+        if (pt->pt_kind == PAGE_TABLE_RADIX) {
+                radix_remove(pt, vpage);
+        }
+        else {
+                hash_remove(pt, vpage);
+        }
 
-        if (page_mapping_is_valid(mappings + i)) {
-                /* Overwrite the old mapping */
-                mappings[i].pm_ppage = ppage;
-                return;
+        if (timed) {
+                pt_account(&before);
         }
+}
 
-        /* Insert a new mapping */
-        mappings[i].pm_vpage = vpage;
-        mappings[i].pm_ppage = ppage;
-        pt->pt_count += 1;
+int
+page_table_iterate(page_table* pt, vpage_t first, unsigned npages,
+                   page_table_visitor visit, void* data)
+{
+        KASSERT(pt != NULL);
 
-        if (page_table_is_overcapacity(pt)) {
-                page_table_resize(pt, pt->pt_capacity * PAGE_TABLE_GROWTH_FACTOR);
+        if (pt->pt_kind == PAGE_TABLE_RADIX) {
+                return radix_iterate(pt, first, npages, visit, data);
         }
+        return hash_iterate(pt, first, npages, visit, data);
 }
 
-void
-page_table_remove(page_table* pt, int vpage)
+int
+page_table_write_range(page_table* pt, vpage_t first, unsigned npages, ppage_t ppage)
 {
         KASSERT(pt != NULL);
 
-        page_mapping* mappings = pt->pt_mappings;
-        const unsigned capacity = pt->pt_capacity;
+        if (pt->pt_kind == PAGE_TABLE_RADIX) {
+                return radix_write_range(pt, first, npages, ppage);
+        }
+        for (unsigned i = 0; i < npages; ++i) {
+                const int result = hash_write(pt, first + i, ppage);
+                if (result) {
+                        return result;
+                }
+        }
+        return 0;
+}
 
-        int i = page_table_find_slot(pt, vpage);
+void
+page_table_remove_range(page_table* pt, vpage_t first, unsigned npages)
+{
+        KASSERT(pt != NULL);
 
-        if (!page_mapping_is_valid(mappings + i)) {
-                /* Key is not in table */
+        if (pt->pt_kind == PAGE_TABLE_RADIX) {
+                radix_remove_range(pt, first, npages);
                 return;
         }
+        for (unsigned i = 0; i < npages && pt->pt_count > 0; ++i) {
+                hash_remove(pt, first + i);
+        }
+}
 
-        pt->pt_count -= 1;
+unsigned
+page_table_resident(const page_table* pt)
+{
+        KASSERT(pt != NULL);
+        return pt->pt_resident;
+}
 
-        int j = i;
+unsigned
+page_table_swapped(const page_table* pt)
+{
+        KASSERT(pt != NULL);
+        return pt->pt_swapped;
+}
 
-        while (true) {
-                page_mapping_invalidate(mappings + i);
-        r2:
-                j = (j + 1) % capacity;
+unsigned
+page_table_resident_max(const page_table* pt)
+{
+        KASSERT(pt != NULL);
+        return pt->pt_resident_max;
+}
 
-                if (!page_mapping_is_valid(mappings + j)) {
-                        break;
-                }
+size_t
+page_table_footprint(const page_table* pt)
+{
+        KASSERT(pt != NULL);
 
-                int k = hash(mappings[j].pm_vpage) % capacity;
-                if (i <= j ? i < k && k <= j : i < k || k <= j) {
-                        goto r2;
+        if (pt->pt_kind == PAGE_TABLE_HASH) {
+                size_t bytes = pt->pt_owns_mappings ? pt->pt_capacity * sizeof(page_mapping) : 0;
+                if (pt->pt_owns_old_mappings) {
+                        bytes += pt->pt_old_capacity * sizeof(page_mapping);
                 }
+                return bytes;
+        }
 
-                mappings[i] = mappings[j];
-                i = j;
+        const struct pt_radix_directory* dir = pt->pt_directory;
+        if (dir == NULL) {
+                return 0;
         }
-        if (page_table_is_undercapacity(pt)) {
-                page_table_resize(pt, capacity / PAGE_TABLE_GROWTH_FACTOR);
+        size_t bytes = sizeof(struct pt_radix_directory);
+        for (unsigned d = 0; d < PT_RADIX_ENTRIES; ++d) {
+                if (dir->rd_tables[d] != NULL) {
+                        bytes += PT_RADIX_ENTRIES * sizeof(ppage_t);
+                }
         }
+        return bytes;
+}
+
+void
+page_table_set_timing(bool on)
+{
+        pt_timing = on;
 }
 
+void
+page_table_printstats(void)
+{
+        unsigned latency[PT_LATENCY_BUCKETS];
+        unsigned worst = 0;
+        unsigned resizes = 0;
+
+        /* Racy against the cpus still counting, which is fine for this */
+        for (unsigned i = 0; i < PT_LATENCY_BUCKETS; ++i) {
+                latency[i] = 0;
+        }
+        for (unsigned c = 0; c < MAXCPUS; ++c) {
+                for (unsigned i = 0; i < PT_LATENCY_BUCKETS; ++i) {
+                        latency[i] += pt_stats[c].ps_latency[i];
+                }
+                worst = max(worst, pt_stats[c].ps_latency_max);
+                resizes += pt_stats[c].ps_resizes;
+        }
+
+        kprintf("Page tables: default %s, %u hash table resizes\n",
+                page_table_default_kind == PAGE_TABLE_RADIX ? "radix" : "hash",
+                resizes);
+        if (!pt_timing) {
+                kprintf("    timing is off, see pt timing on\n");
+                return;
+        }
+        kprintf("    worst write or remove %u us\n", worst);
+        kprintf("    latency (us)  operations\n");
+        for (unsigned i = 0; i < PT_LATENCY_BUCKETS; ++i) {
+                if (latency[i] == 0) {
+                        continue;
+                }
+                if (i == PT_LATENCY_BUCKETS - 1) {
+                        kprintf("    >= %7u  %10u\n", 1U << (i - 1), latency[i]);
+                }
+                else {
+                        kprintf("    <  %7u  %10u\n", 1U << i, latency[i]);
+                }
+        }
+}
@@ -0,0 +1,160 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <coremap.h>
+#include <pageout.h>
+
+/*
+ * The daemon sleeps on pageout_wchan. pageout_busy is set from the time it
+ * is woken until it goes back to sleep, so that claims made meanwhile don't
+ * keep waking it.
+ *
+ * pageout_stalled is set after a round that could free nothing, when every
+ * frame is shared, busy or kernel memory. Another round would only scan
+ * the whole coremap again for nothing, so claims don't wake the daemon
+ * until pageout_progress reports a frame freed or given an owner.
+ */
+static struct spinlock pageout_lock = SPINLOCK_INITIALIZER;
+static struct wchan* pageout_wchan = NULL;
+static bool pageout_busy = false;
+static volatile bool pageout_stalled = false;
+
+/* In pages. 0 until the daemon is started, which keeps it from being woken */
+static size_t low_watermark = 0;
+static size_t high_watermark = 0;
+
+/* Statistics, protected by pageout_lock */
+static unsigned pageout_wakeups = 0;
+static unsigned pageout_reclaimed = 0;  /* Frames freed */
+static unsigned pageout_shortfalls = 0; /* Rounds that ended below the high watermark */
+static unsigned pageout_stalls = 0;     /* Of those, rounds that freed nothing */
+
+/*
+ * The daemon itself.
+ */
+static
+void
+pageout_thread(void* unused1, unsigned long unused2)
+{
+        (void)unused1;
+        (void)unused2;
+
+        for (;;) {
+                spinlock_acquire(&pageout_lock);
+                pageout_busy = false;
+                wchan_sleep(pageout_wchan, &pageout_lock);
+                pageout_busy = true;
+                pageout_wakeups += 1;
+                spinlock_release(&pageout_lock);
+
+                unsigned reclaimed = 0;
+                size_t nfree = coremap_free_page_count();
+
+                while (nfree < high_watermark) {
+                        const unsigned n = coremap_reclaim(high_watermark - nfree);
+                        if (n == 0) {
+                                /* Everything left is busy, shared or kernel memory */
+                                break;
+                        }
+                        reclaimed += n;
+                        nfree = coremap_free_page_count();
+                }
+
+                DEBUG(DB_VM, "pageout: freed %u pages, %zu free\n", reclaimed, nfree);
+
+                spinlock_acquire(&pageout_lock);
+                pageout_reclaimed += reclaimed;
+                if (nfree < high_watermark) {
+                        pageout_shortfalls += 1;
+                }
+                if (nfree < high_watermark && reclaimed == 0) {
+                        pageout_stalls += 1;
+                        pageout_stalled = true;
+                }
+                spinlock_release(&pageout_lock);
+        }
+}
+
+void
+pageout_bootstrap(void)
+{
+        pageout_wchan = wchan_create("pageout");
+        if (pageout_wchan == NULL) {
+                panic("pageout: Could not create wait channel\n");
+        }
+
+        const int error = thread_fork("pageout", NULL, pageout_thread, NULL, 0);
+        if (error) {
+                panic("pageout: Could not start the daemon: %s\n", strerror(error));
+        }
+
+        const size_t npages = hardware_pages_available();
+
+        spinlock_acquire(&pageout_lock);
+        low_watermark = max(npages / PAGEOUT_LOW_WATERMARK_DIVISOR,
+                            PAGEOUT_WATERMARK_MIN);
+        high_watermark = max(npages / PAGEOUT_HIGH_WATERMARK_DIVISOR,
+                             2 * PAGEOUT_WATERMARK_MIN);
+        spinlock_release(&pageout_lock);
+
+        DEBUG(DB_VM, "pageout: low watermark %zu, high watermark %zu pages\n",
+              low_watermark, high_watermark);
+}
+
+void
+pageout_check(size_t nfree)
+{
+        /* Racy, but a missed wakeup is made up for by the next claim */
+        if (nfree >= low_watermark || pageout_busy || pageout_stalled) {
+                return;
+        }
+
+        spinlock_acquire(&pageout_lock);
+        if (!pageout_busy) {
+                pageout_busy = true;
+                wchan_wakeone(pageout_wchan, &pageout_lock);
+        }
+        spinlock_release(&pageout_lock);
+}
+
+void
+pageout_progress(void)
+{
+        /* Racy too: if the daemon misses this, the next call makes up for it */
+        if (pageout_stalled) {
+                pageout_stalled = false;
+        }
+}
+
+bool
+pageout_memory_is_plentiful(size_t nfree)
+{
+        /* Racy, like pageout_check */
+        return nfree > 2 * high_watermark;
+}
+
+void
+pageout_printstats(void)
+{
+        spinlock_acquire(&pageout_lock);
+        const size_t low = low_watermark;
+        const size_t high = high_watermark;
+        const bool busy = pageout_busy;
+        const unsigned wakeups = pageout_wakeups;
+        const unsigned reclaimed = pageout_reclaimed;
+        const unsigned shortfalls = pageout_shortfalls;
+        const unsigned stalls = pageout_stalls;
+        const bool stalled = pageout_stalled;
+        spinlock_release(&pageout_lock);
+
+        kprintf("Pageout: low watermark %zu pages, high watermark %zu pages, %zu free\n",
+                low, high, coremap_free_page_count());
+        kprintf("Pageout: %s, %u wakeups, %u pages freed, %u rounds ended short, "
+                "%u freed nothing\n",
+                busy ? "running" : stalled ? "stalled" : "sleeping",
+                wakeups, reclaimed, shortfalls, stalls);
+}
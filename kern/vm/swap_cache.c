@@ -0,0 +1,704 @@
+/*
+ * Copyright (c) 2018
+ *	The Trap Handlers!
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <coremap.h>
+#include <page_file.h>
+#include <swap_cache.h>
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~ Compressor ~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#define LZ_MIN_MATCH  4
+#define LZ_SKIP_SHIFT 6  /* Search faster through data that does not match */
+
+/* Bytes are loaded one at a time, as they need not be aligned */
+static
+uint32_t
+lz_read32(const uint8_t* p)
+{
+        return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static
+unsigned
+lz_hash(uint32_t v)
+{
+        return (v * 2654435761U) >> (32 - SWAP_CACHE_HASH_BITS);
+}
+
+/* Writes the rest of a length that did not fit in its 4 bits */
+static
+size_t
+lz_put_length(uint8_t* dst, size_t op, size_t n)
+{
+        while (n >= 255) {
+                dst[op++] = 255;
+                n -= 255;
+        }
+        dst[op++] = n;
+        return op;
+}
+
+static
+int
+lz_get_length(const uint8_t* src, size_t size, size_t* ip, size_t* n)
+{
+        uint8_t b;
+        do {
+                if (*ip >= size || *n > PAGE_SIZE) {
+                        return EINVAL;
+                }
+                b = src[(*ip)++];
+                *n += b;
+        } while (b == 255);
+        return 0;
+}
+
+/*
+ * Appends a sequence: a token with both lengths, nlit literals, and,
+ * unless len is 0 for the last sequence, a back reference of len bytes
+ * at offset. Returns the new output size, or 0 if it passes cap.
+ */
+static
+size_t
+lz_emit(uint8_t* dst, size_t op, size_t cap, const uint8_t* lit, size_t nlit,
+        size_t offset, size_t len)
+{
+        size_t need = 1 + nlit + nlit / 255 + 1;
+        if (len != 0) {
+                need += 2 + (len - LZ_MIN_MATCH) / 255 + 1;
+        }
+        if (op + need > cap) {
+                return 0;
+        }
+
+        const size_t nmatch = len == 0 ? 0 : len - LZ_MIN_MATCH;
+        dst[op++] = (nlit < 15 ? nlit : 15) << 4 | (nmatch < 15 ? nmatch : 15);
+        if (nlit >= 15) {
+                op = lz_put_length(dst, op, nlit - 15);
+        }
+        memcpy(dst + op, lit, nlit);
+        op += nlit;
+
+        if (len != 0) {
+                dst[op++] = offset & 0xff;
+                dst[op++] = offset >> 8;
+                if (nmatch >= 15) {
+                        op = lz_put_length(dst, op, nmatch - 15);
+                }
+        }
+        return op;
+}
+
+size_t
+swap_cache_compress(const void* src_, void* dst_, size_t cap, uint16_t* table)
+{
+        const uint8_t* src = src_;
+        uint8_t* dst = dst_;
+        size_t ip = 0, anchor = 0, op = 0;
+
+        for (unsigned i = 0; i < SWAP_CACHE_HASH_SIZE; ++i) {
+                table[i] = 0;
+        }
+
+        while (ip + LZ_MIN_MATCH <= PAGE_SIZE) {
+                const uint32_t v = lz_read32(src + ip);
+                const unsigned h = lz_hash(v);
+                const size_t ref = table[h];
+                table[h] = ip;
+
+                if (ref >= ip || lz_read32(src + ref) != v) {
+                        ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+                        continue;
+                }
+
+                size_t len = LZ_MIN_MATCH;
+                while (ip + len < PAGE_SIZE && src[ref + len] == src[ip + len]) {
+                        ++len;
+                }
+
+                op = lz_emit(dst, op, cap, src + anchor, ip - anchor, ip - ref, len);
+                if (op == 0) {
+                        return 0;
+                }
+                ip += len;
+                anchor = ip;
+        }
+
+        /* The last literals, without a match */
+        return lz_emit(dst, op, cap, src + anchor, PAGE_SIZE - anchor, 0, 0);
+}
+
+int
+swap_cache_decompress(const void* src_, size_t size, void* dst_)
+{
+        const uint8_t* src = src_;
+        uint8_t* dst = dst_;
+        size_t ip = 0, op = 0;
+
+        while (ip < size) {
+                const uint8_t token = src[ip++];
+
+                size_t nlit = token >> 4;
+                if (nlit == 15 && lz_get_length(src, size, &ip, &nlit)) {
+                        return EINVAL;
+                }
+                if (nlit > size - ip || nlit > PAGE_SIZE - op) {
+                        return EINVAL;
+                }
+                memcpy(dst + op, src + ip, nlit);
+                ip += nlit;
+                op += nlit;
+
+                if (ip == size) {
+                        break;
+                }
+
+                if (size - ip < 2) {
+                        return EINVAL;
+                }
+                const size_t offset = src[ip] | src[ip + 1] << 8;
+                ip += 2;
+
+                size_t len = token & 15;
+                if (len == 15 && lz_get_length(src, size, &ip, &len)) {
+                        return EINVAL;
+                }
+                len += LZ_MIN_MATCH;
+                if (offset == 0 || offset > op || len > PAGE_SIZE - op) {
+                        return EINVAL;
+                }
+
+                /* The reference may overlap what it produces, as in runs */
+                for (size_t i = 0; i < len; ++i) {
+                        dst[op + i] = dst[op - offset + i];
+                }
+                op += len;
+        }
+        return op == PAGE_SIZE ? 0 : EINVAL;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~ Cache ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#define SC_ABSENT   0  /* Not in the cache */
+#define SC_CACHED   1
+#define SC_SPILLING 2  /* Being written to its slot, but still readable */
+#define SC_FREED    3  /* Freed while spilling or read; they free the slot */
+
+#define SC_NONE     (-1)
+#define SC_BITS     32
+
+/*
+ * The entry of each page file slot. Cached pages are on a list from the
+ * oldest to the newest, which is the order they are spilled in.
+ */
+struct sc_entry {
+        unsigned sce_block;   /* First block in the arena */
+        uint16_t sce_size;    /* Compressed bytes */
+        uint8_t sce_state;
+        uint8_t sce_readers;  /* Loads copying it out; off the list while any */
+        pfid sce_older;
+        pfid sce_newer;
+};
+
+static struct sc_entry* sc_entries;  /* One per page file slot */
+static unsigned sc_nslots;
+static pfid sc_oldest = SC_NONE;
+static pfid sc_newest = SC_NONE;
+
+static uint8_t* sc_arena;
+static uint32_t* sc_blockmap;        /* A bit set for each block in use */
+static unsigned sc_nblocks;
+static unsigned sc_blocks_used = 0;
+static unsigned sc_block_hint = 0;
+
+static bool sc_enabled = true;
+
+/*
+ * Protects all of the above and the statistics. Pages are copied into
+ * the arena with it held, but taken out without it: a load counts itself
+ * in sce_readers, which keeps the entry from being spilled and its blocks
+ * from being given up, and a spill reads its blocks with sc_work_lock
+ * held, which no other store can then reuse.
+ */
+static struct spinlock sc_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Held by the one thread storing a page: it owns the scratch space
+ * below, and spills pages to disk on behalf of the cache. Others that
+ * find it busy send their page to disk instead of waiting, which also
+ * keeps a spill write that needs memory from coming back in here.
+ */
+static struct lock* sc_work_lock;
+static uint16_t sc_table[SWAP_CACHE_HASH_SIZE];
+static uint8_t sc_staging[SWAP_CACHE_MAX_STORED];
+static uint8_t sc_spill_page[PAGE_SIZE];
+
+/* Statistics */
+static unsigned sc_npages = 0;           /* Pages cached now */
+static unsigned sc_stores = 0;
+static unsigned long long sc_stored_bytes = 0; /* Compressed, over all stores */
+static unsigned sc_rejected = 0;         /* Did not compress well enough */
+static unsigned sc_full = 0;             /* No room, even after spilling */
+static unsigned sc_busy = 0;             /* Someone else was storing */
+static unsigned sc_spills = 0;
+static unsigned sc_hits = 0;
+static unsigned sc_misses = 0;
+
+/* All of these must be called with sc_lock held */
+
+static
+bool
+sc_block_isset(unsigned i)
+{
+        return (sc_blockmap[i / SC_BITS] & (1U << (i % SC_BITS))) != 0;
+}
+
+static
+void
+sc_block_mark(unsigned first, unsigned n, bool used)
+{
+        for (unsigned i = first; i < first + n; ++i) {
+                KASSERT(sc_block_isset(i) != used);
+                if (used) {
+                        sc_blockmap[i / SC_BITS] |= 1U << (i % SC_BITS);
+                }
+                else {
+                        sc_blockmap[i / SC_BITS] &= ~(1U << (i % SC_BITS));
+                }
+        }
+        if (used) {
+                sc_blocks_used += n;
+        }
+        else {
+                sc_blocks_used -= n;
+        }
+}
+
+/*
+ * Finds and marks n free blocks in a row, next-fit as in the swap map.
+ * Returns the first, or SC_NONE.
+ */
+static
+int
+sc_block_alloc(unsigned n)
+{
+        if (sc_blocks_used + n > sc_nblocks) {
+                return SC_NONE;
+        }
+
+        unsigned run_start = 0, run_length = 0;
+
+        for (unsigned scanned = 0; scanned < sc_nblocks; ) {
+                const unsigned i = (sc_block_hint + scanned) % sc_nblocks;
+
+                if (i == 0) {
+                        run_length = 0;
+                }
+                if (run_length == 0 && i % SC_BITS == 0 &&
+                    sc_blockmap[i / SC_BITS] == 0xffffffff &&
+                    i + SC_BITS <= sc_nblocks) {
+                        scanned += SC_BITS;
+                        continue;
+                }
+                ++scanned;
+
+                if (sc_block_isset(i)) {
+                        run_length = 0;
+                        continue;
+                }
+                if (run_length == 0) {
+                        run_start = i;
+                }
+                if (++run_length == n) {
+                        sc_block_mark(run_start, n, true);
+                        sc_block_hint = (run_start + n) % sc_nblocks;
+                        return run_start;
+                }
+        }
+        return SC_NONE;
+}
+
+static
+unsigned
+sc_entry_blocks(const struct sc_entry* e)
+{
+        return DIVROUNDUP(e->sce_size, SWAP_CACHE_BLOCK);
+}
+
+static
+void
+sc_list_append(pfid index)
+{
+        struct sc_entry* e = sc_entries + index;
+        e->sce_older = sc_newest;
+        e->sce_newer = SC_NONE;
+        if (sc_newest == SC_NONE) {
+                sc_oldest = index;
+        }
+        else {
+                sc_entries[sc_newest].sce_newer = index;
+        }
+        sc_newest = index;
+}
+
+static
+void
+sc_list_remove(pfid index)
+{
+        struct sc_entry* e = sc_entries + index;
+        if (e->sce_older == SC_NONE) {
+                sc_oldest = e->sce_newer;
+        }
+        else {
+                sc_entries[e->sce_older].sce_newer = e->sce_newer;
+        }
+        if (e->sce_newer == SC_NONE) {
+                sc_newest = e->sce_older;
+        }
+        else {
+                sc_entries[e->sce_newer].sce_older = e->sce_older;
+        }
+}
+
+/* Gives up the blocks of a page leaving the cache */
+static
+void
+sc_release(pfid index)
+{
+        struct sc_entry* e = sc_entries + index;
+        sc_block_mark(e->sce_block, sc_entry_blocks(e), false);
+        sc_npages -= 1;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+void
+swap_cache_bootstrap(unsigned nslots)
+{
+        unsigned npages = hardware_pages_available() / SWAP_CACHE_DIVISOR;
+        if (npages < SWAP_CACHE_MIN_PAGES) {
+                npages = SWAP_CACHE_MIN_PAGES;
+        }
+        const unsigned nblocks = npages * (PAGE_SIZE / SWAP_CACHE_BLOCK);
+        const unsigned nwords = DIVROUNDUP(nblocks, SC_BITS);
+
+        sc_work_lock = lock_create("swap cache");
+        sc_entries = kmalloc(nslots * sizeof(struct sc_entry));
+        sc_blockmap = kmalloc(nwords * sizeof(uint32_t));
+        sc_arena = kmalloc(npages * PAGE_SIZE);
+        if (sc_work_lock == NULL || sc_entries == NULL ||
+            sc_blockmap == NULL || sc_arena == NULL) {
+                kprintf("Error allocating the swap cache, going without\n");
+                if (sc_work_lock != NULL) {
+                        lock_destroy(sc_work_lock);
+                }
+                kfree(sc_entries);
+                kfree(sc_blockmap);
+                kfree(sc_arena);
+                sc_entries = NULL;
+                return;
+        }
+
+        for (unsigned i = 0; i < nslots; ++i) {
+                sc_entries[i].sce_state = SC_ABSENT;
+                sc_entries[i].sce_readers = 0;
+        }
+        for (unsigned i = 0; i < nwords; ++i) {
+                sc_blockmap[i] = 0;
+        }
+        sc_nslots = nslots;
+        sc_nblocks = nblocks;
+
+        DEBUG(DB_VM, "Swap cache: %u pages for %u page file slots\n",
+              npages, nslots);
+}
+
+/*
+ * Writes the oldest cached page to its slot and gives up its blocks.
+ * Called with sc_work_lock held. Returns false if there was nothing to
+ * spill, or the write failed.
+ */
+static
+bool
+sc_spill_oldest(void)
+{
+        KASSERT(lock_do_i_hold(sc_work_lock));
+
+        spinlock_acquire(&sc_lock);
+        const pfid victim = sc_oldest;
+        if (victim == SC_NONE) {
+                spinlock_release(&sc_lock);
+                return false;
+        }
+        struct sc_entry* e = sc_entries + victim;
+        KASSERT(e->sce_state == SC_CACHED);
+        KASSERT(e->sce_readers == 0);
+        sc_list_remove(victim);
+        e->sce_state = SC_SPILLING;
+        const unsigned block = e->sce_block;
+        const size_t size = e->sce_size;
+        spinlock_release(&sc_lock);
+
+        /* Only we give up a spilling entry's blocks, and only we allocate */
+        const int error = swap_cache_decompress(sc_arena + block * SWAP_CACHE_BLOCK,
+                                                size, sc_spill_page);
+        KASSERT(error == 0);
+
+        const int result = page_file_write_at(victim, sc_spill_page);
+
+        spinlock_acquire(&sc_lock);
+        if (result && e->sce_state == SC_SPILLING) {
+                /* Keep it, as the newest, rather than lose it */
+                e->sce_state = SC_CACHED;
+                sc_list_append(victim);
+                spinlock_release(&sc_lock);
+                return false;
+        }
+        const bool freed = e->sce_state == SC_FREED;
+        sc_release(victim);
+        e->sce_state = SC_ABSENT;
+        sc_spills += 1;
+        spinlock_release(&sc_lock);
+
+        if (freed) {
+                /* Its owner let go of it meanwhile */
+                page_file_free(victim);
+        }
+        return true;
+}
+
+bool
+swap_cache_store(pfid index, const void* src)
+{
+        if (sc_entries == NULL || !sc_enabled) {
+                return false;
+        }
+        KASSERT(index >= 0 && (unsigned)index < sc_nslots);
+
+        if (!lock_tryacquire(sc_work_lock)) {
+                spinlock_acquire(&sc_lock);
+                sc_busy += 1;
+                spinlock_release(&sc_lock);
+                return false;
+        }
+
+        const size_t size = swap_cache_compress(src, sc_staging,
+                                                sizeof(sc_staging), sc_table);
+        const unsigned nblocks = DIVROUNDUP(size, SWAP_CACHE_BLOCK);
+
+        spinlock_acquire(&sc_lock);
+        if (size == 0) {
+                sc_rejected += 1;
+                spinlock_release(&sc_lock);
+                lock_release(sc_work_lock);
+                return false;
+        }
+
+        int block = sc_block_alloc(nblocks);
+        for (unsigned spilled = 0; block == SC_NONE && spilled < SWAP_CACHE_SPILL_MAX;
+             ++spilled) {
+                spinlock_release(&sc_lock);
+                const bool made_room = sc_spill_oldest();
+                spinlock_acquire(&sc_lock);
+                if (!made_room) {
+                        break;
+                }
+                block = sc_block_alloc(nblocks);
+        }
+        if (block == SC_NONE) {
+                sc_full += 1;
+                spinlock_release(&sc_lock);
+                lock_release(sc_work_lock);
+                return false;
+        }
+
+        struct sc_entry* e = sc_entries + index;
+        KASSERT(e->sce_state == SC_ABSENT);
+        memcpy(sc_arena + block * SWAP_CACHE_BLOCK, sc_staging, size);
+        e->sce_block = block;
+        e->sce_size = size;
+        e->sce_state = SC_CACHED;
+        sc_list_append(index);
+
+        sc_npages += 1;
+        sc_stores += 1;
+        sc_stored_bytes += size;
+        spinlock_release(&sc_lock);
+
+        lock_release(sc_work_lock);
+        return true;
+}
+
+bool
+swap_cache_load(pfid index, void* dst)
+{
+        if (sc_entries == NULL) {
+                return false;
+        }
+        KASSERT(index >= 0 && (unsigned)index < sc_nslots);
+
+        struct sc_entry* e = sc_entries + index;
+        spinlock_acquire(&sc_lock);
+        while (e->sce_state == SC_SPILLING) {
+                /*
+                 * The spill gives up its blocks as soon as the write is
+                 * done, so wait it out; then the page is on disk, or
+                 * back in the cache if the write failed.
+                 */
+                spinlock_release(&sc_lock);
+                KASSERT(!lock_do_i_hold(sc_work_lock));
+                lock_acquire(sc_work_lock);
+                lock_release(sc_work_lock);
+                spinlock_acquire(&sc_lock);
+        }
+        if (e->sce_state != SC_CACHED) {
+                sc_misses += 1;
+                spinlock_release(&sc_lock);
+                return false;
+        }
+        if (e->sce_readers++ == 0) {
+                sc_list_remove(index);
+        }
+        const unsigned block = e->sce_block;
+        const size_t size = e->sce_size;
+        sc_hits += 1;
+        spinlock_release(&sc_lock);
+
+        const int error = swap_cache_decompress(sc_arena + block * SWAP_CACHE_BLOCK,
+                                                size, dst);
+        KASSERT(error == 0);
+
+        spinlock_acquire(&sc_lock);
+        bool freed = false;
+        if (--e->sce_readers == 0) {
+                if (e->sce_state == SC_FREED) {
+                        sc_release(index);
+                        e->sce_state = SC_ABSENT;
+                        freed = true;
+                }
+                else {
+                        /* Just used, so the last to spill */
+                        sc_list_append(index);
+                }
+        }
+        spinlock_release(&sc_lock);
+
+        if (freed) {
+                /* Its owner let go of it meanwhile */
+                page_file_free(index);
+        }
+        return true;
+}
+
+bool
+swap_cache_drop(pfid index)
+{
+        if (sc_entries == NULL) {
+                return true;
+        }
+        KASSERT(index >= 0 && (unsigned)index < sc_nslots);
+
+        spinlock_acquire(&sc_lock);
+        struct sc_entry* e = sc_entries + index;
+        bool done = true;
+        switch (e->sce_state) {
+            case SC_CACHED:
+                if (e->sce_readers > 0) {
+                        e->sce_state = SC_FREED;
+                        done = false;
+                        break;
+                }
+                sc_list_remove(index);
+                sc_release(index);
+                e->sce_state = SC_ABSENT;
+                break;
+            case SC_SPILLING:
+                e->sce_state = SC_FREED;
+                done = false;
+                break;
+            default:
+                KASSERT(e->sce_state == SC_ABSENT);
+                break;
+        }
+        spinlock_release(&sc_lock);
+
+        return done;
+}
+
+void
+swap_cache_set_enabled(bool enabled)
+{
+        spinlock_acquire(&sc_lock);
+        sc_enabled = enabled;
+        spinlock_release(&sc_lock);
+}
+
+void
+swap_cache_printstats(void)
+{
+        spinlock_acquire(&sc_lock);
+        const bool enabled = sc_enabled;
+        const unsigned npages = sc_npages;
+        const unsigned used = sc_blocks_used;
+        const unsigned stores = sc_stores;
+        const unsigned long long stored_bytes = sc_stored_bytes;
+        const unsigned rejected = sc_rejected;
+        const unsigned full = sc_full;
+        const unsigned busy = sc_busy;
+        const unsigned spills = sc_spills;
+        const unsigned hits = sc_hits;
+        const unsigned misses = sc_misses;
+        spinlock_release(&sc_lock);
+
+        if (sc_entries == NULL) {
+                kprintf("Swap cache: not set up\n");
+                return;
+        }
+
+        /* In hundredths */
+        const unsigned ratio = stored_bytes == 0 ? 0
+                : (unsigned)((100ULL * stores * PAGE_SIZE) / stored_bytes);
+        const unsigned hit_rate = hits + misses == 0 ? 0
+                : (unsigned)((100ULL * hits) / (hits + misses));
+
+        kprintf("Swap cache: %s, %u pages in %u of %u bytes\n",
+                enabled ? "on" : "off", npages, used * SWAP_CACHE_BLOCK,
+                sc_nblocks * SWAP_CACHE_BLOCK);
+        kprintf("Swap cache: %u pages stored, compressed %u.%02u:1; turned down "
+                "%u incompressible, %u for room, %u while busy\n",
+                stores, ratio / 100, ratio % 100, rejected, full, busy);
+        kprintf("Swap cache: %u hits, %u misses (%u%% hit rate), %u pages spilled\n",
+                hits, misses, hit_rate, spills);
+}
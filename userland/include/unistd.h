@@ -141,6 +141,8 @@ int chdir(const char *path);
 
 /* Optional. */
 void *sbrk(__intptr_t change);
+pid_t vfork(void);
+pid_t spawn(const char *prog, char *const *args);
 ssize_t getdirentry(int filehandle, char *buf, size_t buflen);
 int symlink(const char *target, const char *linkname);
 ssize_t readlink(const char *path, char *buf, size_t buflen);
@@ -156,6 +158,7 @@ ssize_t __getcwd(char *buf, size_t buflen);
  */
 
 int execvp(const char *prog, char *const *args); /* calls execv */
+pid_t spawnvp(const char *prog, char *const *args); /* calls spawn */
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
 
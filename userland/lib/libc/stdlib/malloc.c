@@ -34,16 +34,29 @@
  * easy to follow. It performs abysmally if the heap becomes larger than
  * physical memory. To get (much) better out-of-core performance, port
  * the kernel's malloc. :-)
+ *
+ * Large blocks don't go on the heap: each gets an anonymous mapping of
+ * its own, which free hands back to the kernel at once. Memory on the
+ * heap is never returned, as the break only moves down when the top of
+ * the heap is free.
  */
 
 #include <stdlib.h>
 #include <stdint.h>  // for uintptr_t on non-OS/161 platforms
 #include <unistd.h>
+#include <sys/mman.h>
 #include <err.h>
 #include <assert.h>
 
 #undef MALLOCDEBUG
 
+/*
+ * Blocks of at least this many bytes are mapped rather than put on the
+ * heap. Below it, the system calls and the rounding to whole pages cost
+ * more than the memory they give back.
+ */
+#define MMAP_THRESHOLD (64 * 1024)
+
 #if defined(__mips__) || defined(__i386__)
 #define MALLOC32
 #elif defined(__alpha__) || defined(__x86_64__)
@@ -60,7 +73,8 @@
  *
  * mh_nextblock is the upwards offset to the next header.
  *
- * mh_pad is unused.
+ * mh_pad is 1 if the block has a mapping of its own, see __malloc_mmap;
+ * mh_nextblock is the length of the mapping then.
  * mh_inuse is 1 if the block is in use, 0 if it is free.
  * mh_magic* should always be a fixed value.
  *
@@ -298,6 +312,61 @@ __malloc_sbrk(size_t size)
 	return x;
 }
 
+/*
+ * Get an anonymous mapping for a block of size bytes, and return a
+ * pointer to its data; the header goes at the start of the mapping.
+ * Returns NULL if there is no room for it.
+ */
+static
+void *
+__malloc_mmap(size_t size)
+{
+	struct mheader *mh;
+	size_t len;
+
+	len = PAGE_SIZE * ((MBLOCKSIZE + size + PAGE_SIZE - 1) / PAGE_SIZE);
+	if (len < size) {
+		/* overflow */
+		return NULL;
+	}
+
+	mh = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON,
+		  -1, 0);
+	if (mh == MAP_FAILED) {
+		return NULL;
+	}
+
+	mh->mh_prevblock = 0;
+	mh->mh_pad = 1;
+	mh->mh_magic1 = MMAGIC;
+	mh->mh_nextblock = M_MKFIELD(len);
+	mh->mh_inuse = 1;
+	mh->mh_magic2 = MMAGIC;
+	return M_DATA(mh);
+}
+
+/*
+ * Give the mapping of a block from __malloc_mmap back.
+ */
+static
+void
+__malloc_munmap(void *x)
+{
+	struct mheader *mh;
+
+	mh = ((struct mheader *)x)-1;
+	if (!M_OK(mh) || !mh->mh_pad || mh->mh_prevblock != 0) {
+		errx(1, "free: Invalid pointer %p freed (corrupt header)", x);
+	}
+	if (!mh->mh_inuse) {
+		errx(1, "free: Invalid pointer %p freed (already free)", x);
+	}
+
+	if (munmap(mh, M_NEXTOFF(mh)) < 0) {
+		err(1, "free: munmap of %p failed", x);
+	}
+}
+
 /*
  * Make a new (free) block from the block passed in, leaving size
  * bytes for data in the current block. size must be a multiple of
@@ -375,6 +444,18 @@ malloc(size_t size)
 	/* Round size up to an integral number of blocks. */
 	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
 
+	/* Large blocks get a mapping, or the heap if there is no room. */
+	if (size >= MMAP_THRESHOLD) {
+		p = __malloc_mmap(size);
+		if (p != NULL) {
+#ifdef MALLOCDEBUG
+			warnx("malloc: mapped %lu bytes at %p",
+			      (unsigned long) size, p);
+#endif
+			return p;
+		}
+	}
+
 	/*
 	 * First-fit search algorithm for available blocks.
 	 * Check to make sure the next/previous sizes all agree.
@@ -547,9 +628,18 @@ free(void *x)
 		     (unsigned long) __heapbase, (unsigned long) __heaptop);
 	}
 
-	/* Don't allow freeing pointers that aren't on the heap. */
+	/*
+	 * Don't allow freeing pointers that aren't on the heap, other
+	 * than those of mapped blocks, which are right after the header
+	 * at the start of a page.
+	 */
 	if ((uintptr_t)x < __heapbase || (uintptr_t)x >= __heaptop) {
-		errx(1, "free: Invalid pointer %p freed (out of range)", x);
+		if ((uintptr_t)x % PAGE_SIZE != MBLOCKSIZE) {
+			errx(1, "free: Invalid pointer %p freed (out of range)",
+			     x);
+		}
+		__malloc_munmap(x);
+		return;
 	}
 
 #ifdef MALLOCDEBUG
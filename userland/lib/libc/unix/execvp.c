@@ -35,19 +35,21 @@
 #include <limits.h>
 
 /*
- * POSIX C function: exec a program on the search path. Tries
- * execv() repeatedly until one of the choices works.
+ * Run a program on the search path: tries RUN repeatedly until one of
+ * the choices works. Returns what RUN returned, or -1.
  */
+static
 int
-execvp(const char *prog, char *const *args)
+runpath(const char *prog, char *const *args,
+	int (*run)(const char *, char *const *))
 {
 	const char *searchpath, *s, *t;
 	char progpath[PATH_MAX];
 	size_t len;
+	int result;
 
 	if (strchr(prog, '/') != NULL) {
-		execv(prog, args);
-		return -1;
+		return run(prog, args);
 	}
 
 	searchpath = getenv("PATH");
@@ -74,7 +76,10 @@ execvp(const char *prog, char *const *args)
 		}
 		memcpy(progpath, s, len);
 		snprintf(progpath + len, sizeof(progpath) - len, "/%s", prog);
-		execv(progpath, args);
+		result = run(progpath, args);
+		if (result >= 0) {
+			return result;
+		}
 		switch (errno) {
 		    case ENOENT:
 		    case ENOTDIR:
@@ -89,3 +94,24 @@ execvp(const char *prog, char *const *args)
 	errno = ENOENT;
 	return -1;
 }
+
+/*
+ * POSIX C function: exec a program on the search path. Tries
+ * execv() repeatedly until one of the choices works.
+ */
+int
+execvp(const char *prog, char *const *args)
+{
+	runpath(prog, args, execv);
+	return -1;
+}
+
+/*
+ * Start a program on the search path in a new process, with spawn().
+ * Returns the pid of the new process, or -1.
+ */
+pid_t
+spawnvp(const char *prog, char *const *args)
+{
+	return runpath(prog, args, spawn);
+}
@@ -0,0 +1,169 @@
+/*
+ * launchbench.c
+ *
+ * Process launch benchmark: fork and execv against vfork and execv,
+ * and against spawn.
+ *
+ * Touches a heap of a given number of kilobytes first, as a shell or a
+ * larger program would have, since that is what fork has to copy. Then
+ * launches /bin/true the given number of times each way, waiting for
+ * each launch to exit before the next, and reports the launch rate.
+ *
+ * Usage: launchbench [launches [heapkb]]
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define PAGE            4096
+#define DEFAULT_COUNT   50
+#define DEFAULT_HEAP_KB 256
+#define PROGRAM         "/bin/true"
+
+static char *args[] = { (char *)PROGRAM, NULL };
+
+/* Microseconds since start */
+static
+unsigned long
+elapsed(time_t start_s, unsigned long start_ns)
+{
+	time_t end_s;
+	unsigned long end_ns;
+
+	__time(&end_s, &end_ns);
+	if (end_ns < start_ns) {
+		end_ns += 1000000000;
+		end_s--;
+	}
+	return (unsigned long)(end_s - start_s) * 1000000 +
+		(end_ns - start_ns) / 1000;
+}
+
+static
+void
+report(const char *how, unsigned count, unsigned long us)
+{
+	if (us == 0) {
+		us = 1;
+	}
+	printf("launchbench: %-12s %u launches in %lu us, %lu us each, "
+	       "%lu per second\n", how, count, us, us / count,
+	       (unsigned long)((unsigned long long)count * 1000000 / us));
+}
+
+static
+void
+reap(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "%s did not exit cleanly", PROGRAM);
+	}
+}
+
+static
+pid_t
+launch_fork(void)
+{
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		execv(PROGRAM, args);
+		warn("%s", PROGRAM);
+		_exit(1);
+	}
+	return pid;
+}
+
+static
+pid_t
+launch_vfork(void)
+{
+	pid_t pid = vfork();
+
+	if (pid < 0) {
+		err(1, "vfork");
+	}
+	if (pid == 0) {
+		/* Our parent's memory; nothing but exec or _exit */
+		execv(PROGRAM, args);
+		_exit(1);
+	}
+	return pid;
+}
+
+static
+pid_t
+launch_spawn(void)
+{
+	pid_t pid = spawn(PROGRAM, args);
+
+	if (pid < 0) {
+		err(1, "spawn %s", PROGRAM);
+	}
+	return pid;
+}
+
+static
+void
+run(const char *how, pid_t (*launch)(void), unsigned count)
+{
+	time_t start_s;
+	unsigned long start_ns;
+	unsigned i;
+
+	__time(&start_s, &start_ns);
+	for (i = 0; i < count; i++) {
+		reap(launch());
+	}
+	report(how, count, elapsed(start_s, start_ns));
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned count = DEFAULT_COUNT;
+	size_t heap = DEFAULT_HEAP_KB * 1024;
+	char *p;
+
+	if (argc > 1) {
+		count = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		heap = atoi(argv[2]) * 1024;
+	}
+	if (argc > 3 || count == 0) {
+		errx(1, "Usage: launchbench [launches [heapkb]]");
+	}
+
+	if (heap > 0) {
+		p = malloc(heap);
+		if (p == NULL) {
+			err(1, "malloc");
+		}
+		/* Make every page resident, and not the zero page */
+		memset(p, 1, heap);
+	}
+
+	printf("launchbench: %u launches of %s with a %lu KB heap\n",
+	       count, PROGRAM, (unsigned long)heap / 1024);
+
+	run("fork+execv", launch_fork, count);
+	run("vfork+execv", launch_vfork, count);
+	run("spawn", launch_spawn, count);
+
+	printf("launchbench: passed\n");
+	return 0;
+}
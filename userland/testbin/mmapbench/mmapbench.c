@@ -0,0 +1,228 @@
+/*
+ * mmapbench.c
+ *
+ * File throughput benchmark: read() against mmap().
+ *
+ * Writes a file of a given number of kilobytes, then sums its bytes
+ * twice: once read() through a user buffer, once through a MAP_PRIVATE
+ * mapping. The sums must agree. Then checks that changes made through a
+ * MAP_SHARED mapping reach the file, and removes it.
+ *
+ * Usage: mmapbench [kilobytes [filename]]
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PAGE       4096
+#define DEFAULT_KB 512
+#define DEFAULT_FILE "mmapbench.dat"
+
+static char buf[PAGE];
+
+/* Microseconds since start */
+static
+unsigned long
+elapsed(time_t start_s, unsigned long start_ns)
+{
+	time_t end_s;
+	unsigned long end_ns;
+
+	__time(&end_s, &end_ns);
+	if (end_ns < start_ns) {
+		end_ns += 1000000000;
+		end_s--;
+	}
+	return (unsigned long)(end_s - start_s) * 1000000 +
+		(end_ns - start_ns) / 1000;
+}
+
+static
+void
+report(const char *how, size_t size, unsigned long us)
+{
+	if (us == 0) {
+		us = 1;
+	}
+	printf("mmapbench: %-6s %lu KB in %lu us, %lu KB/s\n", how,
+	       (unsigned long)size / 1024, us,
+	       (unsigned long)((unsigned long long)size * 1000000 / 1024 / us));
+}
+
+static
+void
+makefile(const char *name, size_t size)
+{
+	size_t done, i;
+	int fd;
+
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: open for write", name);
+	}
+	for (done = 0; done < size; done += PAGE) {
+		for (i = 0; i < PAGE; i++) {
+			buf[i] = (char)((done + i) * 7 + (done / PAGE));
+		}
+		if (write(fd, buf, PAGE) != PAGE) {
+			err(1, "%s: write", name);
+		}
+	}
+	close(fd);
+}
+
+static
+unsigned long
+sum_read(const char *name, size_t size)
+{
+	unsigned long sum = 0;
+	size_t done;
+	ssize_t len, i;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", name);
+	}
+	for (done = 0; done < size; done += len) {
+		len = read(fd, buf, PAGE);
+		if (len <= 0) {
+			err(1, "%s: read", name);
+		}
+		for (i = 0; i < len; i++) {
+			sum += (unsigned char)buf[i];
+		}
+	}
+	close(fd);
+	return sum;
+}
+
+static
+unsigned long
+sum_mmap(const char *name, size_t size)
+{
+	unsigned long sum = 0;
+	const unsigned char *p;
+	size_t i;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", name);
+	}
+	p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "%s: mmap", name);
+	}
+	/* The mapping holds on to the file */
+	close(fd);
+
+	for (i = 0; i < size; i++) {
+		sum += p[i];
+	}
+	if (munmap((void *)p, size) < 0) {
+		err(1, "%s: munmap", name);
+	}
+	return sum;
+}
+
+/* Bumps the first byte of each page through a shared mapping */
+static
+void
+check_shared(const char *name, size_t size)
+{
+	unsigned char *p;
+	unsigned char expect;
+	size_t off;
+	int fd;
+
+	fd = open(name, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open for update", name);
+	}
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "%s: shared mmap", name);
+	}
+	for (off = 0; off < size; off += PAGE) {
+		p[off] += 1;
+	}
+	if (fsync(fd) < 0) {
+		err(1, "%s: fsync", name);
+	}
+	/* The second half only goes back when it is unmapped */
+	for (off = size / 2; off < size; off += PAGE) {
+		p[off] += 1;
+	}
+	if (munmap(p, size) < 0) {
+		err(1, "%s: munmap", name);
+	}
+	close(fd);
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", name);
+	}
+	for (off = 0; off < size; off += PAGE) {
+		if (read(fd, buf, PAGE) != PAGE) {
+			err(1, "%s: read", name);
+		}
+		expect = (unsigned char)(off * 7 + off / PAGE) +
+			(off < size / 2 ? 1 : 2);
+		if ((unsigned char)buf[0] != expect) {
+			errx(1, "%s: page %lu was not written back: %u, "
+			     "expected %u", name, (unsigned long)(off / PAGE),
+			     (unsigned char)buf[0], expect);
+		}
+	}
+	close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *name = DEFAULT_FILE;
+	size_t size = DEFAULT_KB * 1024;
+	unsigned long sum1, sum2, us;
+	time_t start_s;
+	unsigned long start_ns;
+
+	if (argc > 1) {
+		size = atoi(argv[1]) * 1024;
+		if (size < 2 * PAGE || size % PAGE != 0) {
+			errx(1, "Usage: mmapbench [kilobytes [filename]], "
+			     "at least 8 KB in whole pages");
+		}
+	}
+	if (argc > 2) {
+		name = argv[2];
+	}
+
+	makefile(name, size);
+
+	__time(&start_s, &start_ns);
+	sum1 = sum_read(name, size);
+	us = elapsed(start_s, start_ns);
+	report("read", size, us);
+
+	__time(&start_s, &start_ns);
+	sum2 = sum_mmap(name, size);
+	us = elapsed(start_s, start_ns);
+	report("mmap", size, us);
+
+	if (sum1 != sum2) {
+		errx(1, "sums differ: read %lu, mmap %lu", sum1, sum2);
+	}
+
+	check_shared(name, size);
+	remove(name);
+
+	printf("mmapbench: passed\n");
+	return 0;
+}
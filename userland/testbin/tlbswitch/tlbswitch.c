@@ -0,0 +1,82 @@
+/*
+ * tlbswitch.c
+ *
+ * Context switch benchmark for the TLB.
+ *
+ * Starts NPROCS processes that each sweep over a small working set of
+ * NPAGES pages, over and over, so that the cpu switches between them on
+ * every timer interrupt. Together the working sets fit in the TLB. When
+ * the TLB is flushed on every switch, each process refills its whole
+ * working set each time it runs; with ASID-tagged entries it refills
+ * almost nothing.
+ *
+ * Prints the elapsed time. Use the "tlb" kernel menu command before and
+ * after to see the number of refills and ASID rollovers.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+
+#define NPROCS  4
+#define NPAGES  12        /* NPROCS * NPAGES < 64 TLB entries */
+#define PAGE    4096
+#define SWEEPS  20000
+
+static char workingset[NPAGES * PAGE];
+
+static
+void
+sweep(void)
+{
+	volatile char *p = workingset;
+	int i, j;
+
+	for (i = 0; i < SWEEPS; i++) {
+		for (j = 0; j < NPAGES; j++) {
+			p[j * PAGE] += 1;
+		}
+	}
+}
+
+int
+main(void)
+{
+	time_t start_s, end_s;
+	unsigned long start_ns, end_ns;
+	pid_t pids[NPROCS];
+	int i, status;
+
+	__time(&start_s, &start_ns);
+
+	for (i = 0; i < NPROCS; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			sweep();
+			_exit(0);
+		}
+	}
+
+	for (i = 0; i < NPROCS; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+	}
+
+	__time(&end_s, &end_ns);
+
+	if (end_ns < start_ns) {
+		end_ns += 1000000000;
+		end_s--;
+	}
+	printf("tlbswitch: %d processes, %d pages each, %d sweeps: %lu.%09lu s\n",
+	       NPROCS, NPAGES, SWEEPS,
+	       (unsigned long)(end_s - start_s), end_ns - start_ns);
+	return 0;
+}